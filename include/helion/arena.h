@@ -0,0 +1,124 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#pragma once
+
+#ifndef __HELION_ARENA__
+#define __HELION_ARENA__
+
+#include <helion/gc.h>
+#include <stddef.h>
+#include <type_traits>
+#include <utility>
+
+namespace helion {
+
+
+  /**
+   * an arena is a bump allocator that hands out memory from large chunks, and
+   * frees all of it at once. The compiler uses one per function for the iir,
+   * so the instructions of a function sit next to each other in memory and
+   * the whole thing goes away in one step once it has been compiled.
+   *
+   * chunks come from the collector, and are reachable only through the
+   * arena (or through pointers into them). They are scanned for pointers, so
+   * anything in an arena can refer to collected objects (types, slices, etc)
+   * and keep them alive, but the collector never has to trace the
+   * individual objects inside of them. A function that is dropped without
+   * being released takes its chunks with it, like a collected object.
+   */
+  class arena {
+    struct chunk {
+      chunk *prev;
+      size_t size;
+      // the memory of the chunk follows the header
+      alignas(16) char data[0];
+    };
+
+    // objects that need their destructor run on release. Kept in the arena
+    // itself, so nothing about an arena lives outside the collected heap
+    struct finalizer {
+      void *obj;
+      void (*dtor)(void *);
+      finalizer *next;
+    };
+
+    chunk *head = nullptr;
+    char *cur = nullptr;
+    char *end = nullptr;
+    size_t allocated = 0;
+    finalizer *finalizers = nullptr;
+
+    static const size_t chunk_size = 16 * 1024;
+
+    void grow(size_t need) {
+      size_t size = need > chunk_size ? need : chunk_size;
+      auto *c = (chunk *)gc::alloc(sizeof(chunk) + size);
+      c->prev = head;
+      c->size = size;
+      head = c;
+      cur = c->data;
+      end = c->data + size;
+    }
+
+   public:
+    arena() = default;
+    // arenas own their chunks, so they can't be copied around
+    arena(const arena &) = delete;
+    arena &operator=(const arena &) = delete;
+    inline ~arena() { release(); }
+
+
+    inline void *alloc(size_t size, size_t align = alignof(max_align_t)) {
+      auto p = ((size_t)cur + align - 1) & ~(align - 1);
+      if (cur == nullptr || p + size > (size_t)end) {
+        grow(size + align);
+        p = ((size_t)cur + align - 1) & ~(align - 1);
+      }
+      cur = (char *)(p + size);
+      allocated += size;
+      return (void *)p;
+    }
+
+
+    template <typename T, typename... Args>
+    inline T *make(Args &&... args) {
+      T *thing = reinterpret_cast<T *>(alloc(sizeof(T), alignof(T)));
+      new (thing) T(std::forward<Args>(args)...);
+      if (!std::is_trivially_destructible<T>::value) {
+        auto *f = reinterpret_cast<finalizer *>(
+            alloc(sizeof(finalizer), alignof(finalizer)));
+        f->obj = thing;
+        f->dtor = [](void *p) { reinterpret_cast<T *>(p)->~T(); };
+        f->next = finalizers;
+        finalizers = f;
+      }
+      return thing;
+    }
+
+
+    // the number of bytes handed out since the last release
+    inline size_t bytes(void) { return allocated; }
+
+
+    /**
+     * run the destructors of everything in the arena (newest first) and give
+     * the chunks back. Any pointer into the arena is dangling after this.
+     */
+    inline void release(void) {
+      for (auto *f = finalizers; f != nullptr; f = f->next) f->dtor(f->obj);
+      finalizers = nullptr;
+
+      while (head != nullptr) {
+        auto *prev = head->prev;
+        gc::free(head);
+        head = prev;
+      }
+      cur = end = nullptr;
+      allocated = 0;
+    }
+  };
+
+}  // namespace helion
+
+#endif
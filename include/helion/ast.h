@@ -240,6 +240,11 @@ namespace helion {
       std::vector<std::shared_ptr<ast::return_node>> returns;
       std::string name = "";
       bool anonymous = false;
+
+      // to_iir is split in two so top level functions can all be declared up
+      // front, and have their bodies lowered in parallel after that
+      iir::func *declare(iir::scope *);
+      void lower(iir::func *);
       NODE_FOOTER;
     };
 
@@ -260,6 +265,27 @@ namespace helion {
 
 
 
+    class while_node : public node {
+     public:
+      std::shared_ptr<ast::node> cond;
+      std::shared_ptr<ast::do_block> body;
+      NODE_FOOTER;
+    };
+
+
+
+    // for init, cond, step
+    class for_node : public node {
+     public:
+      std::shared_ptr<ast::node> init;
+      std::shared_ptr<ast::node> cond;
+      std::shared_ptr<ast::node> step;
+      std::shared_ptr<ast::do_block> body;
+      NODE_FOOTER;
+    };
+
+
+
     class typedef_node : public node {
      public:
       struct field_t {
@@ -30,6 +30,7 @@
 #include "llvm/Target/TargetMachine.h"
 // Various transformations
 #include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
@@ -43,10 +44,14 @@
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IRReader/IRReader.h"
@@ -57,10 +62,13 @@
 
 #include <helion/text.h>
 #include <flat_hash_map.hpp>
+#include <atomic>
+#include <map>
 #include <mutex>
 #include <unordered_map>
 #include "slice.h"
 #include "util.h"
+#include "vm.h"
 
 
 /*
@@ -199,15 +207,74 @@ namespace helion {
 
   using RTDyldObjHandleT = llvm::orc::VModuleKey;
 
+
+  struct object_cache_options {
+    // on unless $HELION_CACHE is 0
+    bool enabled = true;
+    // $HELION_CACHE_DIR if it is empty, or else a helion directory in the
+    // user's cache directory
+    std::string dir;
+    // how big the cache can get on disk, in bytes. 0 has no limit
+    uint64_t max_bytes = 256ull << 20;
+  };
+
+  // compiled objects, kept on disk between runs (implemented in objcache.cpp)
+  class object_cache : public llvm::ObjectCache {
+   public:
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> stores{0};
+    std::atomic<uint64_t> evictions{0};
+
+    object_cache(llvm::TargetMachine &TM);
+
+    // should be done before anything is compiled
+    void configure(object_cache_options);
+    inline object_cache_options options(void) { return opts; }
+    bool enabled(void);
+    void print_stats(std::ostream &);
+
+    void notifyObjectCompiled(const llvm::Module *,
+                              llvm::MemoryBufferRef) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(
+        const llvm::Module *) override;
+
+   private:
+    llvm::TargetMachine &TM;
+    object_cache_options opts;
+    std::mutex lock;
+    // the keys of modules that missed, until their object is ready
+    std::unordered_map<const llvm::Module *, std::string> pending;
+    // how much is on disk, or -1 if it hasn't been counted yet
+    int64_t total = -1;
+
+    std::string key(const llvm::Module &);
+    std::string path(const std::string &key);
+    void trim(void);
+  };
+
+
   // orc jit execution engine
   // see julia's src/jitlayer.h for reference.
   // (most of the JIT design is stolen from julia's :>)
+  //
+  // the layers aren't thread safe, so everything that touches them holds the
+  // engine lock. Modules added as a ThreadSafeModule (each with a context of
+  // its own) are optimized and compiled to an object before the lock is
+  // taken, and only linking is serialized, so many of them can be compiled
+  // at once
   class ojit_ee {
    public:
     using CompilerResultT = std::unique_ptr<llvm::MemoryBuffer>;
     typedef llvm::orc::LegacyRTDyldObjectLinkingLayer ObjLayer;
     typedef llvm::orc::LegacyIRCompileLayer<ObjLayer, llvm::orc::SimpleCompiler>
         CompileLayer;
+    using OptimizeFunction = std::function<std::unique_ptr<llvm::Module>(
+        std::unique_ptr<llvm::Module>)>;
+    typedef llvm::orc::LegacyIRTransformLayer<CompileLayer, OptimizeFunction>
+        OptLayer;
+    class locked_layer;
+    typedef llvm::orc::LegacyCompileOnDemandLayer<locked_layer> LazyLayer;
     typedef llvm::orc::VModuleKey ModuleHandle;
     typedef llvm::StringMap<void *> SymbolTableT;
     typedef llvm::object::OwningBinary<llvm::object::ObjectFile> OwningObj;
@@ -217,12 +284,31 @@ namespace helion {
 
     ojit_ee(llvm::TargetMachine &TM);
 
+    // every module is compiled through it
+    object_cache cache;
+
+    // how hard modules are optimized, from 0 (not at all) to 3, like -O.
+    // $HELION_OPT_LEVEL, or 2. A module can ask for a level of its own with
+    // set_opt_level
+    int opt_level;
 
+
+    // give a symbol the code links against an address in the process, for
+    // things the executable doesn't export. A later mapping of the same name
+    // replaces the earlier one
     void add_global_mapping(llvm::StringRef, uint64_t);
 
 
 
-    ModuleHandle add_module(std::unique_ptr<llvm::Module>);
+    // a lazy module is only stubs at first. Each function in it is
+    // optimized and compiled on its own, by the first call to its stub, so
+    // the functions that never run are never compiled. Code that is wanted
+    // right away (the vm's hot functions) is better off added eagerly. Used
+    // by run_module_lazy, for whole programs
+    ModuleHandle add_module(std::unique_ptr<llvm::Module>, bool lazy = true);
+
+    // optimize and compile a module on the calling thread, then link it in
+    ModuleHandle add_module(llvm::orc::ThreadSafeModule);
     void remove_module(ModuleHandle);
 
     const llvm::DataLayout &getDataLayout() const;
@@ -240,6 +326,10 @@ namespace helion {
 
     inline void add_dlhandle(void *h) { dlhandles.push_back(h); }
 
+    // run the optimization pipeline for the module's level over it, which
+    // is also how code compiled ahead of time is optimized
+    void optimize(llvm::Module &);
+
    private:
     inline std::string mangle(const std::string &Name) {
       std::string MangledName;
@@ -257,6 +347,7 @@ namespace helion {
 
     llvm::JITSymbol find_mangled_symbol(const std::string &Name,
                                         bool ExportedSymbolsOnly = false);
+    std::shared_ptr<llvm::orc::SymbolResolver> resolver(ModuleHandle);
     llvm::TargetMachine &TM;
     const llvm::DataLayout DL;
     // Should be big enough that in the common case, The
@@ -267,21 +358,54 @@ namespace helion {
     std::shared_ptr<llvm::RTDyldMemoryManager> mem_mgr;
     ObjLayer obj_layer;
     CompileLayer compile_layer;
-
-    using OptimizeFunction = std::function<std::unique_ptr<llvm::Module>(
-        std::unique_ptr<llvm::Module>)>;
-
-
-    llvm::orc::LegacyIRTransformLayer<CompileLayer, OptimizeFunction> opt_layer;
+    OptLayer opt_layer;
+
+    // recursive, as linking looks symbols up through find_symbol
+    std::recursive_mutex lock;
+
+    // stubs compile on the thread that calls them, so the lazy layer reaches
+    // the layers under it through the lock
+    class locked_layer {
+      ojit_ee &ee;
+
+     public:
+      locked_layer(ojit_ee &ee) : ee(ee) {}
+      llvm::Error addModule(ModuleHandle, std::unique_ptr<llvm::Module>);
+      llvm::JITSymbol findSymbol(const std::string &, bool);
+      llvm::JITSymbol findSymbolIn(ModuleHandle, const std::string &, bool);
+      llvm::Error removeModule(ModuleHandle);
+    };
+    locked_layer locked;
+
+    std::unique_ptr<llvm::orc::JITCompileCallbackManager> callbacks;
+    LazyLayer lazy_layer;
+    // the lazy layer splits modules up into one per function, which each
+    // get a resolver of their own
+    std::map<ModuleHandle, std::shared_ptr<llvm::orc::SymbolResolver>>
+        resolvers;
 
     SymbolTableT GlobalSymbolTable;
     SymbolTableT LocalSymbolTable;
-    std::vector<ModuleHandle> module_keys;
+    // which layer a module went into, to look its symbols up there
+    enum class layer { eager, lazy, object };
+    struct added_module {
+      ModuleHandle key;
+      layer in;
+    };
+    std::vector<added_module> module_keys;
 
     std::vector<void *> dlhandles;
   };
 
 
+  // the optimization level of one module, in place of the engine's. It is
+  // kept on the module's functions, so it sticks with them when the lazy
+  // layer splits the module up (implemented in ojit_ee.cpp)
+  void set_opt_level(llvm::Module &, int level);
+  // -1 if the module hasn't asked for one
+  int get_opt_level(llvm::Module &);
+
+
 
 
   // execution engine is a nice global that exposes interfaces that
@@ -298,6 +422,43 @@ namespace helion {
    */
   iir::module *compile_module(std::unique_ptr<ast::module> m);
 
+  /**
+   * optimize, infer and specialize a module that was just lowered to iir (or
+   * read back in with read_module), which is everything compile_module does
+   * after the front end. `print` dumps the module before and after type
+   * inference, which --iir asks for
+   */
+  iir::module *compile_iir(std::unique_ptr<iir::module> m, bool print = false);
+
+  /**
+   * run a module's init function in a vm, which compiles whatever gets hot
+   * with jit_function
+   */
+  void run_module(iir::module &m, vm::machine &vm);
+
+  // the vm's tier 1 compiler, which lowers a function to llvm and jits it.
+  // Null if the function uses something it can't compile yet. Safe to call
+  // from many compile threads at once (implemented in llvmgen.cpp)
+  vm::entry_fn jit_function(vm::function &fn);
+
+  // run a module's init function with every function compiled by llvm the
+  // first time it is called, through the engine's lazy layer, instead of in
+  // the vm (implemented in llvmgen.cpp)
+  void run_module_lazy(iir::module &m);
+
+  // lower every function of a module to llvm, along with a main that runs
+  // its init function. Null (with the reason in `error`) if some function
+  // can't be compiled (implemented in llvmgen.cpp)
+  std::unique_ptr<llvm::Module> lower_module(iir::module &m,
+                                             llvm::LLVMContext &ctx,
+                                             std::string &error);
+
+  // compile a module ahead of time to `out`: an object file if it ends in
+  // .o, otherwise an executable linked with the runtime. Optimized at
+  // `opt_level`, or the engine's if it is -1 (implemented in aot.cpp)
+  int build_module(iir::module &m, const std::string &out,
+                   int opt_level = -1);
+
   void init_types(void);
   void init_codegen(void);
   void init_iir(void);
@@ -13,8 +13,16 @@ namespace helion {
 
 
     void *raw_alloc(int);
+    // memory that is scanned for pointers, but never collected. It has to be
+    // freed explicitly
+    void *raw_alloc_uncollectable(int);
     void raw_free(void *);
 
+    // threads that weren't started by the collector have to be registered
+    // with it before they allocate, or their stacks won't be scanned
+    void register_thread(void);
+    void unregister_thread(void);
+
 
     template <typename T, typename... Args>
     inline T *make_collected(Args &&... args) {
@@ -25,6 +33,9 @@ namespace helion {
 
 
     inline void *alloc(int m) { return raw_alloc(m); }
+    inline void *alloc_uncollectable(int m) {
+      return raw_alloc_uncollectable(m);
+    }
     inline void free(void *p) { return raw_free(p); }
   };  // namespace gc
 };    // namespace helion
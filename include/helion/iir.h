@@ -7,10 +7,14 @@
 
 #include <stdint.h>
 #include <unistd.h>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <map>
 #include <memory>
 #include <set>
 #include <unordered_map>
+#include "arena.h"
 #include "gc.h"
 #include "infer.h"
 #include "slice.h"
@@ -61,6 +65,10 @@ namespace helion {
      public:
       std::string name;
       std::vector<type *> params;
+      // ground types are interned (see intern_type), and keep their hash
+      // around so it never has to be recomputed
+      bool interned = false;
+      size_t hash = 0;
 
       inline named_type(std::string name)
           : type(type_type::named), name(name) {}
@@ -73,7 +81,14 @@ namespace helion {
     class var_type : public type {
      public:
       std::string name;
-      type *points_to = this;
+      // the variable's slot in the union-find store (see infer::unifier), or
+      // -1 if it has never been unified with anything
+      int slot = -1;
+      // what the variable was bound to when the store it was unified in was
+      // published. Never changes after that, so any thread can read it
+      type *published = nullptr;
+      // set on published variables that were generalized
+      bool generic = false;
       inline var_type(std::string name) : type(type_type::var), name(name) {}
       std::string str(void);
     };
@@ -82,6 +97,12 @@ namespace helion {
 
     var_type &new_variable_type(void);
 
+    // get the named type with these parameters. If every parameter is itself
+    // interned, the type is ground and there is exactly one object for it, so
+    // two ground types are equal iff they are the same pointer. Types with
+    // variables in them are made fresh, as the variables can still change
+    named_type *intern_type(std::string name, std::vector<type *> params = {});
+
 
     bool operator==(type &, type &);
     inline bool operator!=(type &a, type &b) { return !(a == b); }
@@ -93,6 +114,11 @@ namespace helion {
     type *convert_type(std::shared_ptr<ast::type_node>, iir::scope*);
     type *convert_type(std::string, iir::scope *);
 
+    // copy a type, replacing each type variable in it with a fresh one. The
+    // map remembers the replacements so that several types can be copied
+    // consistently (a function's signature and its body, for example)
+    type *clone_type(type *, std::unordered_map<type *, type *> &);
+
 
 
 
@@ -102,11 +128,11 @@ namespace helion {
      protected:
       std::unordered_map<std::string, value *> m_bindings;
       std::unordered_map<std::string, var_type *> m_var_types;
-      scope *m_parent;
+      scope *m_parent = nullptr;
       std::vector<std::unique_ptr<scope>> children;
 
      public:
-      module *mod;
+      module *mod = nullptr;
 
       inline scope *spawn() {
         auto p = gc::make_collected<scope>();
@@ -169,9 +195,7 @@ namespace helion {
     class const_flt : public value {
      public:
       double val;
-      inline void print(std::ostream &s, bool = false, int = 0) {
-        s << std::to_string(val);
-      }
+      void print(std::ostream &s, bool = false, int = 0);
       infer::deduction deduce(infer::context &ctx);
     };
 
@@ -184,6 +208,27 @@ namespace helion {
     extern type *int_type;
     extern type *float_type;
 
+    // the sized numeric types. Int and Float are the machine word sized
+    // defaults (64 bits), and are what unannotated constants are
+    extern type *int8_type;
+    extern type *int16_type;
+    extern type *int32_type;
+    extern type *int64_type;
+    extern type *float32_type;
+    extern type *float64_type;
+
+    enum class num_kind : char { none, integer, floating };
+
+    // the primitive numeric types are always kept unboxed, in registers and
+    // on the stack. These take the type as it is after inference, and say
+    // nothing about a type that is (or has) a variable
+    num_kind numeric_kind(type *);
+    // the width of a numeric type in bits, or 0 if it isn't one
+    int numeric_bits(type *);
+    inline bool is_numeric(type *t) {
+      return numeric_kind(t) != num_kind::none;
+    }
+
 
     enum class inst_type : char {
       unknown = 0,
@@ -203,10 +248,29 @@ namespace helion {
       store,
       cast,
       poparg,
+      // a function paired with a flat record of the variables it captures
+      closure,
+      // the location of one captured variable, inside a closure's body
+      env,
+      // comparisons, which produce 1 if they hold and 0 if they don't
+      lt,
+      le,
+      gt,
+      ge,
+      eq,
+      ne,
+      // move a primitive into a heap cell, for positions that hold a value of
+      // any type (polymorphic arguments and results), and back out again
+      box,
+      unbox,
     };
 
     const char *inst_type_to_str(inst_type);
 
+    inline bool is_comparison(inst_type t) {
+      return t >= inst_type::lt && t <= inst_type::ne;
+    }
+
 
 
     class func;
@@ -220,15 +284,40 @@ namespace helion {
     class instruction : public value {
      protected:
       inst_type itype;
-      block &bb;
+      block *bb;
       int uid;
 
+     public:
+      // nearly every instruction has three operands or less, so they are
+      // stored in the instruction itself instead of in their own allocation
+      static const int inline_operands = 3;
+
+     protected:
+      value *inline_ops[inline_operands] = {nullptr};
+
      public:
       slice<value *> args;
+      // set on allocs, popargs and closures that have to outlive the frame
+      // that creates them. Lowering allocates these through gc::alloc, and
+      // everything else on the stack
+      bool heap = false;
+      // set on calls whose value is returned right away, which don't need
+      // the caller's frame anymore. llvmgen emits these as musttail calls
+      bool tail = false;
+
       instruction(block &, inst_type, type &, slice<value *>);
       instruction(block &, inst_type, type &);
 
       inline inst_type get_inst_type(void) { return itype; }
+      inline block &get_block(void) { return *bb; }
+      inline void set_block(block &b) { bb = &b; }
+      inline int get_uid(void) { return uid; }
+
+      // terminators end a block and transfer control somewhere else
+      inline bool is_terminator(void) {
+        return itype == inst_type::ret || itype == inst_type::br ||
+               itype == inst_type::jmp;
+      }
 
       void print(std::ostream &, bool = false, int = 0);
 
@@ -257,6 +346,14 @@ namespace helion {
         // a block is terminated iff the terminator is not null
         return terminator != nullptr;
       }
+      inline void set_terminator(instruction *i) { terminator = i; }
+
+      inline slice<instruction *> &get_insts(void) { return insts; }
+      inline func &get_func(void) { return fn; }
+
+      // the blocks that control can flow to out of this block, read off of
+      // the terminator's block arguments
+      std::vector<block *> successors(void);
 
       void print(std::ostream &, bool = false, int = 0);
 
@@ -271,6 +368,9 @@ namespace helion {
       module &mod;
       // instructions have to have unique ids, so it comes from here
       int uid = 0;
+      // the blocks, instructions and constants of the function are all
+      // allocated in here, and freed together
+      arena mem;
 
      protected:
       friend builder;
@@ -282,12 +382,41 @@ namespace helion {
       std::string name = "";
       bool intrinsic = false;
 
+      // the monomorphic copies of this function, by the interned type of the
+      // instance each one was made for (see monomorphize). Interned types
+      // are unique, so they are ordered by address
+      std::map<type *, func *> specializations;
+      // the polymorphic function this one is a copy of, if it is one
+      func *generic = nullptr;
+
       std::shared_ptr<ast::func> node = nullptr;
       func(module &);
 
       int next_uid(void);
+      // how many ids have been handed out, which bounds the uid of every
+      // instruction in the function
+      inline int num_uids(void) { return uid; }
       block *new_block(void);
       void add_block(block *b);
+
+      inline arena &get_arena(void) { return mem; }
+      // create an instruction in this function's arena
+      template <typename... Args>
+      inline instruction *new_inst(block &b, Args &&... args) {
+        return mem.make<instruction>(b, std::forward<Args>(args)...);
+      }
+      value *new_int(size_t);
+      value *new_float(double);
+
+      // free everything in the body of the function at once. Only safe once
+      // nothing will look at the iir anymore (after codegen)
+      void release(void);
+
+      inline slice<block *> &get_blocks(void) { return blocks; }
+      inline block *entry(void) {
+        return blocks.size() == 0 ? nullptr : blocks[0];
+      }
+      inline module &get_module(void) { return mod; }
       void print(std::ostream &, bool = false, int = 0);
 
 
@@ -302,17 +431,128 @@ namespace helion {
     class module : public scope {
       std::string name;
       scope *mod_scope;
-      module *mod = this;
+      // every name handed out by unique_name (prefixed by its sigil), mapped
+      // to the next numeric suffix to try for it
+      std::unordered_map<std::string, int> used_names;
 
      public:
       std::vector<value *> globals;
+      // every function lowered into this module, including lambdas, in the
+      // order they were created. Optimization passes run over this list
+      std::vector<func *> funcs;
 
       module(std::string name);
+      void add_func(func *f);
+
+      // names have to be unique across the module for the printed iir to be
+      // read back in. `sigil` is the namespace ('%' for values, '@' for
+      // functions). The first use of a name gets it as-is, later ones get a
+      // numeric suffix (x, x.1, x.2...)
+      std::string unique_name(std::string base, char sigil);
+
+      // print every function in the module, in the format read_module reads
+      void print(std::ostream &);
       // creates a function
       func *create_func(std::shared_ptr<ast::func>);
       // create an intrinsic function which will call to a special part of the
       // compiler once we get to this stage
       func *create_intrinsic(std::string name, std::shared_ptr<ast::type_node>);
+
+      // release the bodies of every function in the module. Functions refer
+      // to each other's values (closures before conversion, inlined code) so
+      // they are all freed together
+      void release(void);
+    };
+
+
+    /**
+     * lowers the bodies of functions that don't depend on each other on
+     * worker threads. Workers only read from the module: the names, lambdas
+     * and type variables a job makes are kept in the job, and handed out to
+     * the module in the order the jobs were added once every worker is done.
+     * That way the module comes out the same however the threads ran.
+     *
+     * implemented in lowering.cpp
+     */
+    class lowering_queue {
+     public:
+      struct job {
+        int id;
+        func *fn;
+        std::function<void(void)> lower;
+        // lambdas created while lowering, in the order they were made
+        std::vector<func *> lambdas;
+        // the job's own pool of type variables. They get temporary names
+        // until the job is committed
+        std::vector<var_type *> vars;
+        int next_var = 0;
+        std::exception_ptr error = nullptr;
+
+        std::string next_var_name(void);
+      };
+
+      lowering_queue(module &m) : mod(m) {}
+
+      // queue up the body of a function that has already been declared
+      void add(func *fn, std::function<void(void)> lower);
+      // lower everything that was queued on up to `threads` threads (0 is one
+      // per core), and rethrow the first job's error if any of them failed
+      void run(int threads = 0);
+
+      // the job the calling thread is working on, or null off of a worker
+      static job *current(void);
+
+     private:
+      module &mod;
+      // a deque so jobs don't move while workers point at them
+      std::deque<job> jobs;
+
+      void commit(job &);
+    };
+
+
+
+
+    /**
+     * rebuild a module from the text that module::print produces. Values,
+     * blocks and functions can be referred to before they are defined.
+     * Malformed input throws a read_error
+     *
+     * implemented in iirreader.cpp
+     */
+    std::unique_ptr<module> read_module(std::string text,
+                                        std::string name = "");
+
+    class read_error : public std::runtime_error {
+     public:
+      int line;
+      read_error(int line, std::string msg)
+          : std::runtime_error("line " + std::to_string(line) + ": " + msg),
+            line(line) {}
+    };
+
+
+
+    /**
+     * a compact binary form of a module, for caching iir between runs. The
+     * format is versioned, and made of flat tables that refer to each other
+     * by index and to the start of the data by offset, never by pointer, so
+     * a file can be mapped into memory and read in place.
+     *
+     * implemented in iirserial.cpp
+     */
+    extern const uint32_t binary_version;
+
+    void write_binary(module &, std::ostream &);
+    std::unique_ptr<module> read_binary(const char *data, size_t size,
+                                        std::string name = "");
+    // mmap a file written by write_binary and read it
+    std::unique_ptr<module> read_binary_file(std::string path);
+
+    // thrown when binary iir is truncated, corrupt or from another version
+    class binary_error : public std::runtime_error {
+     public:
+      binary_error(std::string msg) : std::runtime_error(msg) {}
     };
 
 
@@ -329,6 +569,7 @@ namespace helion {
 
 
       instruction *add_inst(instruction *);
+      void open_target(void);
       instruction *create_inst(inst_type, type &);
       instruction *create_inst(inst_type, type &, slice<value *>);
 
@@ -344,6 +585,9 @@ namespace helion {
       void create_store(value *, value *);
       value *create_load(value *);
       value *create_call(value *, std::vector<value *>);
+      // constants owned by the function being built
+      value *create_int(size_t);
+      value *create_float(double);
 
 
       void create_ret(value *);
@@ -386,6 +630,7 @@ namespace std {
         return x;
       } else if (t.is_named()) {
         auto v = t.as_named();
+        if (v->interned) return v->hash;
         x = 0x856819292UL;
         x ^= std::hash<std::string>()(v->name);
         for (auto *p : v->params) {
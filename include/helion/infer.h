@@ -7,6 +7,11 @@
 
 #include "../immer/map.hpp"
 #include "util.h"
+#include <limits.h>
+#include <stdint.h>
+#include <exception>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace helion {
@@ -14,7 +19,10 @@ namespace helion {
     class type;
     class var_type;
     class value;
+    class instruction;
     class func;
+    class module;
+    class callee_table;
   };  // namespace iir
 
   /*
@@ -47,13 +55,152 @@ namespace helion {
 
 
 
-    class context : public std::unordered_map<iir::value *, iir::type *> {
+    /**
+     * the types deduced for the values in a function. Instructions already
+     * have an id that is unique in their function, so their types are kept
+     * in a vector indexed by it instead of being hashed. Anything else (other
+     * functions, mostly) goes in a map, as there are far fewer of them.
+     */
+    class context {
+      std::vector<iir::type *> insts;
+      std::unordered_map<iir::value *, iir::type *> others;
+
+      // the slot for an instruction of fn, or null if it is from elsewhere
+      iir::type **slot(iir::instruction *);
+
+     public:
+      iir::func *fn = nullptr;
+      // the context of the function this one was started from
+      context *parent = nullptr;
+      // contexts that other threads are reading from are frozen, and the
+      // types of functions go in the context below them instead
+      bool frozen = false;
+      // where loads of locations that only ever hold one function are
+      // resolved, if anywhere (see callee_table)
+      iir::callee_table *callees = nullptr;
+
+      context(void) = default;
+      // size the table for the instructions fn has now
+      explicit context(iir::func *fn);
+
+      // null if nothing has been deduced for the value yet
+      iir::type *lookup(iir::instruction *);
+      iir::type *lookup(iir::value *);
+      void set(iir::instruction *, iir::type *);
+      void set(iir::value *, iir::type *);
+
+      // the outermost context that isn't frozen, where the types of
+      // functions are kept. Looking them up goes on through the frozen ones
+      context &root(void);
+      // the function a value is known to be, or null
+      iir::func *resolve(iir::value *);
+      // move the types of functions into another context
+      void merge_into(context &);
+
+      void apply_subs(subs &S);
+    };
+
+    // a persistent environment, for scopes that need to take a snapshot and
+    // go back to it later. Copies share their structure, so they are cheap
+    using scoped_context = immer::map<iir::value *, iir::type *>;
+
+
+
+    /**
+     * the union-find store type variables are unified in. A variable is given
+     * an integer slot the first time it is unified, and slots are merged by
+     * rank with path compression, so finding a variable's type stays close to
+     * constant time however long the program is. While a mark is held, every
+     * slot that gets written is put on a trail first, so a unification that
+     * failed half way through can be rolled back.
+     */
+    class unifier {
+      struct entry {
+        int parent;
+        int rank;
+        // the level of the class, kept on the root (see enter)
+        int level;
+        // the non-variable type the class is bound to, only kept on the root
+        iir::type *bound;
+        iir::var_type *var;
+      };
+
+      std::vector<entry> slots;
+      std::vector<std::pair<int, entry>> trail;
+      int marks = 0;
+
+      void write(int, entry);
+      int root(int);
+
      public:
-       iir::func *fn;
-       void apply_subs(subs &S);
+      // variables at this level have been generalized, and are instantiated
+      // with fresh ones wherever they are used
+      static const int generic = INT_MAX;
+
+      // the level new slots start at. Inferring a function's body happens a
+      // level deeper than whatever referred to it, and unification only ever
+      // lowers levels, so the variables still deeper than the current level
+      // once the body is done are the ones that can be generalized. Nothing
+      // has to be searched for free variables
+      int level = 0;
+      inline void enter(void) { level++; }
+      inline void leave(void) { level--; }
+
+      int index(iir::var_type *);
+      int level_of(iir::var_type *);
+      // lower the level of a variable's class to at most `l`
+      void adjust(iir::var_type *, int l);
+      void make_generic(iir::var_type *);
+
+      // write what every variable in the store is bound to into the variable
+      // itself, and empty the store. Types don't depend on the store after
+      // that, so they can be shared with other threads
+      void publish(void);
+
+      // the type a class is bound to, or the variable at its root if it isn't
+      // bound to anything yet
+      iir::type *find(iir::type *);
+      // merge the classes of two variables
+      void link(iir::var_type *, iir::var_type *);
+      // bind the class of a variable to a type that isn't a variable
+      void bind(iir::var_type *, iir::type *);
+
+      // start recording writes. Each mark has to be rolled back or released
+      size_t mark(void);
+      // undo every write since the mark
+      void rollback(size_t);
+      // keep every write since the mark
+      void release(size_t);
+    };
+
+    // the store that find, unify and friends work in. Each task has its own,
+    // and there is one for everything else
+    unifier &store(void);
+
+
+    /**
+     * the state of inferring one definition group. Tasks have their own store
+     * and top level context, so they can run on different threads. The type
+     * variables a task makes are named out of its own pool until its results
+     * are committed, in group order, so the names don't depend on how the
+     * threads ran.
+     *
+     * implemented in typecheck.cpp
+     */
+    struct task {
+      int id;
+      unifier store;
+      context top;
+      std::vector<iir::var_type *> vars;
+      int next_var = 0;
+      std::exception_ptr error = nullptr;
+
+      std::string next_var_name(void);
+
+      // the task the calling thread is running, or null
+      static task *current(void);
     };
 
-    // using context = immer::map<iir::value*, iir::type*>;
 
     iir::type *find(iir::type *t);
 
@@ -61,7 +208,79 @@ namespace helion {
 
     void unify(iir::type *, iir::type *);
 
-    iir::type *inst(iir::type *, context &);
+    // unify two types, or leave them as they were and return false if they
+    // can't be
+    bool try_unify(iir::type *, iir::type *);
+
+    // mark every variable in the type that is deeper than the current level
+    // as generic
+    void generalize(iir::type *);
+    // a copy of the type with each generic variable replaced by a fresh one
+    // at the current level. Types without generic variables come back as-is
+    iir::type *inst(iir::type *);
+
+
+    /**
+     * the functions of a module, grouped into the strongly connected
+     * components of the graph of which function refers to which (directly,
+     * or through a location that is only ever assigned that function).
+     * Groups come out in dependency order, so nothing in a group refers to a
+     * group that comes after it.
+     *
+     * implemented in typecheck.cpp
+     */
+    struct def_group {
+      std::vector<iir::func *> funcs;
+      // the groups this one refers to, by index
+      std::vector<int> deps;
+      // a hash of the iir of every function in the group, and of the keys of
+      // the groups it depends on. If the key is the same, so are the types
+      uint64_t key = 0;
+    };
+
+    std::vector<def_group> definition_groups(iir::module &);
+
+
+    /**
+     * infers a module one definition group at a time, and remembers the types
+     * of each group (its signatures, and the type of every instruction in its
+     * bodies) by its key. Compiling the module again after an edit only
+     * infers the groups that changed, and the groups that depend on them. The
+     * rest get their types from the cache, and their bodies aren't inferred
+     * again. The cache can be saved to a file and loaded on the next run.
+     *
+     * implemented in typecheck.cpp
+     */
+    class inference_cache {
+      // the most threads groups are inferred on (0 is one per core)
+      int threads = 0;
+
+      struct entry {
+        size_t count;
+        // every type of the group, in the order check records them in, as
+        // text (see write_type), so they share nothing with the module
+        std::string types;
+        // looked up by the last check, so it is kept when saving
+        bool used;
+      };
+      std::unordered_map<uint64_t, entry> entries;
+
+     public:
+      inference_cache(int threads = 0) : threads(threads) {}
+
+      // false if the file couldn't be read, which leaves the cache empty
+      bool load(const std::string &path);
+      // keeps every entry the last check used, and as many others as fit
+      bool save(const std::string &path);
+
+      // groups that only depend on finished groups are inferred at the same
+      // time, unless they touch a location outside of themselves, or depend
+      // on a type that isn't closed. Those are inferred one at a time, as
+      // they share variables with other groups, and are never cached. Returns
+      // the number of groups that actually had to be inferred
+      int check(iir::module &, context &root);
+    };
+
 
 
     class analyze_failure : std::runtime_error {
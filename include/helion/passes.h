@@ -0,0 +1,277 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+#pragma once
+
+#ifndef __HELION_PASSES_H__
+#define __HELION_PASSES_H__
+
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "iir.h"
+
+
+namespace helion {
+  namespace iir {
+
+
+    /**
+     * control flow analysis over the blocks of an iir function. Most of the
+     * passes are driven by one of these.
+     *
+     * implemented in analysis.cpp
+     */
+
+    // the reachable blocks of a function in reverse postorder. The entry block
+    // is always first
+    std::vector<block *> reverse_postorder(func &);
+
+    // predecessor lists for every block in a function, indexed by block id
+    std::vector<std::vector<block *>> predecessors(func &);
+
+    // rewrite every operand in the function that refers to `from` to instead
+    // refer to `to`
+    void replace_uses(func &, value *from, value *to);
+
+    // the values of this function that some other function (a closure)
+    // refers to directly
+    std::unordered_set<value *> captured_locals(func &);
+
+
+    /**
+     * the dominator tree of a function, built with the iterative algorithm
+     * from Cooper, Harvey and Kennedy's "A Simple, Fast Dominance Algorithm".
+     * Blocks are looked up by their id, so the tree is only valid until the
+     * function's blocks are renumbered.
+     */
+    class domtree {
+      std::vector<block *> order;
+      std::vector<int> rpo_index;
+      std::vector<block *> idoms;
+      std::vector<std::vector<block *>> children;
+
+      block *intersect(block *, block *);
+
+     public:
+      domtree(func &);
+
+      inline std::vector<block *> &rpo(void) { return order; }
+      inline bool reachable(block *b) { return rpo_index[b->get_id()] != -1; }
+      // the immediate dominator of a block. The entry block is its own idom
+      inline block *idom(block *b) { return idoms[b->get_id()]; }
+      inline std::vector<block *> &get_children(block *b) {
+        return children[b->get_id()];
+      }
+
+      bool dominates(block *a, block *b);
+    };
+
+
+
+    /**
+     * a natural loop: the header, and every block that can reach one of the
+     * back edges into it without going through the header. Each back edge
+     * comes from a latch, a block in the loop that jumps to the header.
+     */
+    struct loop {
+      block *header;
+      // every block in the loop, in reverse postorder (header first)
+      std::vector<block *> blocks;
+      std::vector<block *> latches;
+      // the innermost loop this one is nested in, or null
+      loop *parent = nullptr;
+      int depth = 1;
+      // indexed by block id
+      std::vector<bool> in;
+
+      inline bool contains(block *b) {
+        return b->get_id() < (int)in.size() && in[b->get_id()];
+      }
+    };
+
+
+    /**
+     * the loops of a function, found from the back edges in a dominator
+     * tree. Like the tree, this is only valid until the blocks change.
+     * Irreducible cycles have no single header, and aren't reported.
+     */
+    class loop_info {
+      std::vector<std::unique_ptr<loop>> loops;
+      std::vector<loop *> innermost;
+
+     public:
+      loop_info(func &, domtree &);
+
+      // every loop, with inner loops before the loops around them
+      inline std::vector<std::unique_ptr<loop>> &get_loops(void) {
+        return loops;
+      }
+      // the innermost loop a block is in, or null if it's in none
+      inline loop *loop_for(block *b) { return innermost[b->get_id()]; }
+    };
+
+
+
+
+    /**
+     * dominator scoped global value numbering. Removes redundant arithmetic
+     * and loads, and forwards stored values into later loads of the same
+     * location. Returns true if the function was changed
+     *
+     * implemented in gvn.cpp
+     */
+    bool gvn(func &);
+
+
+    /**
+     * cfg cleanup and dead code elimination. Removes unreachable blocks,
+     * merges straight-line chains of blocks, threads jumps through empty
+     * blocks and deletes unused side-effect-free instructions. Blocks are
+     * renumbered when any are removed
+     *
+     * implemented in simplify.cpp
+     */
+    bool simplify(func &);
+
+
+
+    /**
+     * figures out which function a call will actually run, if it can be
+     * known before type inference. A callee is known if it is a function
+     * value, or a load of a location that is only ever assigned once, with a
+     * function. Built once for a whole pass over the module, and kept up to
+     * date by the passes that add to it.
+     *
+     * implemented in inline.cpp
+     */
+    class callee_table {
+      // the value last stored to each location, and how many stores and
+      // loads of it there are
+      std::unordered_map<value *, value *> stored;
+      std::unordered_map<value *, int> stores;
+      std::unordered_map<value *, int> loads;
+      // operands that are a function, and the locations each is stored to
+      std::unordered_map<value *, int> refs;
+      std::unordered_map<value *, std::vector<value *>> homes;
+
+     public:
+      callee_table(module &);
+      func *resolve(value *callee);
+      // the number of places anywhere in the module that refer to a
+      // function, either directly or by loading the one location it is
+      // stored to
+      int uses(func *);
+
+      // an instruction that was just added to the module
+      void add(instruction *);
+      // one that was taken out of it. Stores never are, so once a location
+      // has been written twice it stays unknown
+      void remove(instruction *);
+    };
+
+
+    // the largest function (in instructions) that will be inlined into a
+    // caller that isn't its only user
+    extern int inline_threshold;
+
+    /**
+     * inline calls to small, known functions into a function. The table is
+     * the module's, and is updated with what gets inlined
+     *
+     * implemented in inline.cpp
+     */
+    bool inline_calls(func &, callee_table &);
+
+
+
+    /**
+     * turn calls a function makes to itself in tail position into jumps back
+     * to the top of its body, so self recursion runs in constant stack space
+     *
+     * implemented in tailcall.cpp
+     */
+    bool eliminate_tail_recursion(func &);
+
+
+
+    /**
+     * loop invariant code motion. Pure instructions, and loads of locations
+     * the loop never writes, whose operands don't change inside a loop are
+     * moved into a preheader (a block that runs once, just before the loop
+     * is entered), which is created when a loop doesn't have one
+     *
+     * implemented in loops.cpp
+     */
+    bool licm(func &);
+
+    /**
+     * strength reduction of induction variables. A local that is stepped by
+     * a constant once per iteration is a basic induction variable, and each
+     * multiplication of one by a constant is replaced with a new variable
+     * that is stepped alongside it by addition instead
+     *
+     * implemented in loops.cpp
+     */
+    bool strength_reduce(func &);
+
+
+
+    /**
+     * closure conversion. Nested functions get flat environment records in
+     * place of direct references to their parents' variables, and escape
+     * analysis marks the closures (and captured variables) that have to be
+     * heap allocated. Runs over the whole module at once, as a closure's
+     * captures depend on every function nested inside it
+     *
+     * implemented in closure.cpp
+     */
+    void convert_closures(module &);
+
+
+
+    /**
+     * monomorphization. Runs after type inference, and points every call to
+     * a polymorphic function whose argument types are all known at a copy of
+     * the function specialized to those types. Copies are cached on the
+     * function they came from, so each instance is only made once however
+     * many call sites (or modules) use it. Returns how many copies were made
+     *
+     * implemented in monomorphize.cpp
+     */
+    int monomorphize(module &);
+
+    /**
+     * box primitives where they are passed to, or returned from, a position
+     * of a polymorphic function that can hold any type, and unbox them again
+     * on the way back. Arithmetic in the polymorphic function unboxes its
+     * operands the same way. Everywhere else they stay unboxed. The table
+     * is the module's, made once for every function in it
+     *
+     * implemented in boxing.cpp
+     */
+    bool place_boxes(func &, callee_table &);
+
+
+
+    /**
+     * run the standard set of iir passes over every function in the module
+     *
+     * implemented in passes.cpp
+     */
+    void optimize(module &);
+
+    /**
+     * run one pass over every function in the module, by name: gvn,
+     * simplify, inline, tailcall, licm, strength, closures or optimize (all
+     * of them). Returns false if there is no pass by that name. This is how
+     * the pass tests run a single pass over canned iir
+     *
+     * implemented in passes.cpp
+     */
+    bool run_pass(module &, std::string name);
+
+  }  // namespace iir
+}  // namespace helion
+
+#endif
@@ -7,6 +7,7 @@
 #define __HELION_SLICE_JIT__
 
 #include <helion/gc.h>
+#include <string.h>
 #include <initializer_list>
 #include <iostream>
 #include <iterator>
@@ -53,6 +54,10 @@ namespace helion {
       len = cap;
     }
 
+    // start out using memory owned by someone else, like a small buffer
+    // inline in an object. Growing past `count` moves to the heap as usual
+    inline slice(T *buf, int count) : cap(count), m_data(buf) {}
+
     inline slice(slice<T> &o) {
       reserve(o.capacity());
       *this = o;
@@ -73,7 +78,7 @@ namespace helion {
 
 
     inline slice &operator=(slice<T> &v) {
-      reserve(v.capacity());
+      reserve(v.size());
       clear();
       for (auto &e : v) {
         push_back(e);
@@ -83,7 +88,7 @@ namespace helion {
 
 
     inline slice &operator=(std::vector<T> &v) {
-      reserve(v.capacity());
+      reserve(v.size());
       clear();
       for (auto &e : v) {
         push_back(e);
@@ -154,7 +159,7 @@ namespace helion {
 
     inline void push_back(const T &value) {
       if (len == cap) {
-        reserve(cap * 2);
+        reserve(cap == 0 ? 1 : cap * 2);
       }
       m_data[len++] = value;
     }
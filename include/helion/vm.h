@@ -0,0 +1,284 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#pragma once
+
+#ifndef __HELION_VM_H__
+#define __HELION_VM_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "iir.h"
+
+
+namespace helion {
+
+  /**
+   * vm: the runtime that iir executes in. Every function starts out in the
+   * interpreter (tier 0), which runs a linear form of the iir made the first
+   * time the function is called. Calls and back edges are counted per
+   * function. A function that gets warm is turned into machine code by the
+   * baseline compiler, which is quick but does nothing clever, and one that
+   * gets hot is handed to a pool of compile threads. Whenever new code is
+   * ready it is swapped into the function's entry, and every call after that
+   * runs it.
+   */
+  namespace vm {
+
+    // every value is one machine word. Numbers are kept unboxed in it
+    // (integers sign extended to 64 bits, floats as the bits of a double) and
+    // everything else is a pointer
+    using word = uint64_t;
+
+    struct function;
+    class machine;
+
+    // a function value. Plain references to a function are closures without
+    // any captures
+    struct closure {
+      function *fn;
+      // bit n is set if capture n is a reference to a variable (the address
+      // of its location), rather than a copy of its value
+      word mask;
+      word env[0];
+    };
+
+    // the calling convention of every tier, so code in one can call code in
+    // any other. Arguments are locations in iir, so the callee can write to
+    // the array it is handed
+    using entry_fn = word (*)(closure *self, word *args);
+
+
+    enum class tier : int {
+      interp,
+      // the baseline compiler has had its go at it (see baseline.cpp). If it
+      // failed, the function is still interpreted until it gets hot
+      baseline,
+      // waiting for (or being compiled by) a compile thread
+      queued,
+      jit,
+      // the compiler gave up on it, so it stays in the tier it was in
+      failed,
+    };
+
+
+    // the ops of the interpreter's linear form, which the baseline compiler
+    // also works from
+    enum opcode : int {
+      op_add_i,
+      op_sub_i,
+      op_mul_i,
+      op_div_i,
+      op_neg_i,
+      op_add_f,
+      op_sub_f,
+      op_mul_f,
+      op_div_f,
+      op_neg_f,
+      op_lt_i,
+      op_le_i,
+      op_gt_i,
+      op_ge_i,
+      op_eq_i,
+      op_ne_i,
+      op_lt_f,
+      op_le_f,
+      op_gt_f,
+      op_ge_f,
+      op_eq_f,
+      op_ne_f,
+      // sign extend the low `b` bits of a register, in place
+      op_sext,
+      // round a double to the precision of a float, in place
+      op_round32,
+      op_i2f,
+      op_f2i,
+      op_move,
+      op_load,
+      op_store,
+      op_alloc,
+      op_halloc,
+      op_poparg,
+      op_hpoparg,
+      op_env,
+      op_closure,
+      op_call,
+      op_box,
+      op_unbox,
+      op_jmp,
+      // a jump backwards, which is counted
+      op_loop,
+      op_br,
+      // a branch with a target behind it
+      op_br_loop,
+      op_ret,
+      // falling off the end of a block without a terminator returns nothing
+      op_retz,
+      op_fail,
+      num_opcodes,
+    };
+
+    struct op {
+      // the interpreter's code for the op (direct threading)
+      const void *run;
+      opcode kind;
+      int32_t dst, a, b, c;
+    };
+
+    // a function flattened into ops over a register file (see interp.cpp)
+    struct code {
+      std::vector<op> ops;
+      // registers [0, consts.size()) start out as these
+      std::vector<word> consts;
+      // the operands of calls and closures, which have more than fit in an op
+      std::vector<int32_t> lists;
+      std::vector<std::string> messages;
+      int nregs = 0;
+      int nlocals = 0;
+      // the most arguments any call passes
+      int nargs = 0;
+    };
+
+
+    struct function {
+      iir::func *ir = nullptr;
+      machine *owner = nullptr;
+      // the indirection every call goes through. Swapped, once, when the
+      // function has been compiled
+      std::atomic<entry_fn> entry{nullptr};
+      closure *plain = nullptr;
+
+      std::atomic<uint32_t> calls{0};
+      std::atomic<uint32_t> back_edges{0};
+      std::atomic<tier> level{tier::interp};
+
+      // the interpreter's linear form, made on first call
+      std::atomic<code *> linear{nullptr};
+      std::mutex linear_lock;
+    };
+
+
+    // the tier 0 entry of every function that has a body
+    word interpret(closure *self, word *args);
+
+    // machine code for a function, made straight from its linear form with
+    // a template per op. Null if the function hasn't been interpreted yet,
+    // or if this isn't x86-64 (implemented in baseline.cpp)
+    entry_fn compile_baseline(function &);
+
+    // runtime errors (calling something unsupported, dividing by zero) end
+    // the program, as compiled code can't unwind through its frames
+    // (implemented in runtime.cpp)
+    [[noreturn]] void fail(const char *msg);
+
+
+    class machine {
+     public:
+      // the number of calls plus back edges that makes a function hot. 0
+      // turns the compiler off entirely
+      uint32_t hot_threshold;
+      // the same, for the baseline compiler. Lower, as it is cheap. 0 turns
+      // it off
+      uint32_t warm_threshold;
+
+      // how many functions can be compiled at once. Threads are only started
+      // as the queue needs them
+      unsigned compile_threads;
+
+      // makes code for a function on a compile thread, or returns null if it
+      // can't. Nothing is compiled without one. It is called from every
+      // compile thread at once, so it has to be thread safe
+      std::function<entry_fn(function &)> compiler;
+      // makes quick code for a function right away, on the thread that
+      // made it warm. compile_baseline unless it is changed
+      std::function<entry_fn(function &)> baseline;
+
+      // the thresholds default to $HELION_JIT_THRESHOLD and
+      // $HELION_BASELINE_THRESHOLD, and the number of compile threads to
+      // $HELION_JIT_THREADS (or one less than the number of cores)
+      machine(void);
+      ~machine(void);
+
+      // the runtime side of a function, made the first time it is asked for
+      function *get(iir::func *);
+      // the location of a global
+      word *global(iir::value *);
+
+      word call(iir::func *, std::vector<word> args = {});
+
+      // called after a function's counters go up, to compile it with the
+      // baseline compiler once it is warm, and queue it up for the real
+      // compiler once it is hot
+      inline void tick(function &fn) {
+        auto level = fn.level.load(std::memory_order_relaxed);
+        if (level != tier::interp && level != tier::baseline) return;
+        uint32_t n = fn.calls.load(std::memory_order_relaxed) +
+                     fn.back_edges.load(std::memory_order_relaxed);
+        if (level == tier::interp && warm_threshold != 0 &&
+            n >= warm_threshold) {
+          warm(fn);
+        } else if (hot_threshold != 0 && n >= hot_threshold) {
+          promote(fn);
+        }
+      }
+
+      // block until everything that has been queued is compiled
+      void drain(void);
+
+     private:
+      std::mutex lock;
+      std::unordered_map<iir::func *, function *> fns;
+      std::unordered_map<iir::value *, word *> globals;
+
+      std::vector<std::thread> workers;
+      std::mutex queue_lock;
+      std::condition_variable queue_cv;
+      std::condition_variable idle_cv;
+      std::deque<function *> queue;
+      // workers compiling something, and workers waiting for something to
+      // compile
+      unsigned busy = 0;
+      unsigned idle = 0;
+      bool stopping = false;
+
+      void warm(function &);
+      void promote(function &);
+      void compile_loop(void);
+    };
+
+
+    // the native implementation of an intrinsic, by the name it was created
+    // with. Null if there isn't one
+    entry_fn intrinsic(const std::string &name);
+
+  }  // namespace vm
+}  // namespace helion
+
+
+
+// what compiled code calls into, by address from the jit and by name from
+// code compiled ahead of time (implemented in runtime.cpp)
+extern "C" {
+  // zeroed memory from the collector
+  helion::vm::word helion_rt_alloc(helion::vm::word bytes);
+  // call a closure that isn't known until run time
+  helion::vm::word helion_rt_call(helion::vm::closure *,
+                                  helion::vm::word *args);
+  [[noreturn]] void helion_rt_fail(const char *msg);
+
+  // called first thing by a program compiled ahead of time
+  void helion_rt_start(void);
+  // the closure a program compiled ahead of time refers to one of its
+  // functions by. Calls through it go straight to the compiled code
+  helion::vm::closure *helion_rt_function(helion::vm::entry_fn);
+}
+
+#endif
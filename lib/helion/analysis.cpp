@@ -0,0 +1,216 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/iir.h>
+#include <helion/passes.h>
+#include <algorithm>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+
+
+std::vector<block *> iir::reverse_postorder(func &fn) {
+  std::vector<block *> post;
+  auto &blocks = fn.get_blocks();
+  if (blocks.size() == 0) return post;
+
+  std::vector<bool> seen(blocks.size(), false);
+  // explicit stack of (block, next successor to visit) so deep control flow
+  // doesn't blow the native stack
+  std::vector<std::pair<block *, size_t>> stack;
+  std::vector<std::vector<block *>> succs(blocks.size());
+
+  auto push = [&](block *b) {
+    seen[b->get_id()] = true;
+    succs[b->get_id()] = b->successors();
+    stack.push_back({b, 0});
+  };
+
+  push(fn.entry());
+  while (!stack.empty()) {
+    auto &[b, next] = stack.back();
+    auto &s = succs[b->get_id()];
+    if (next < s.size()) {
+      auto *n = s[next++];
+      if (!seen[n->get_id()]) push(n);
+      continue;
+    }
+    post.push_back(b);
+    stack.pop_back();
+  }
+
+  std::reverse(post.begin(), post.end());
+  return post;
+}
+
+
+
+std::vector<std::vector<block *>> iir::predecessors(func &fn) {
+  auto &blocks = fn.get_blocks();
+  std::vector<std::vector<block *>> preds(blocks.size());
+  for (auto *b : blocks) {
+    for (auto *s : b->successors()) preds[s->get_id()].push_back(b);
+  }
+  return preds;
+}
+
+
+
+void iir::replace_uses(func &fn, value *from, value *to) {
+  for (auto *b : fn.get_blocks()) {
+    for (auto *i : b->get_insts()) {
+      for (auto &a : i->args)
+        if (a == from) a = to;
+    }
+    if (b->terminated()) {
+      for (auto &a : b->get_terminator()->args)
+        if (a == from) a = to;
+    }
+  }
+}
+
+
+
+
+std::unordered_set<value *> iir::captured_locals(func &fn) {
+  std::unordered_set<value *> captured;
+  for (auto *other : fn.get_module().funcs) {
+    if (other == &fn) continue;
+    for (auto *b : other->get_blocks()) {
+      for (auto *i : b->get_insts()) {
+        for (auto *a : i->args) {
+          auto *ai = dynamic_cast<instruction *>(a);
+          if (ai != nullptr && &ai->get_block().get_func() == &fn)
+            captured.insert(a);
+        }
+      }
+    }
+  }
+  return captured;
+}
+
+
+
+
+domtree::domtree(func &fn) {
+  auto &blocks = fn.get_blocks();
+  order = reverse_postorder(fn);
+  rpo_index.assign(blocks.size(), -1);
+  idoms.assign(blocks.size(), nullptr);
+  children.resize(blocks.size());
+
+  if (order.empty()) return;
+
+  for (size_t i = 0; i < order.size(); i++) rpo_index[order[i]->get_id()] = i;
+
+  auto preds = predecessors(fn);
+  auto *entry = order[0];
+  idoms[entry->get_id()] = entry;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 1; i < order.size(); i++) {
+      auto *b = order[i];
+      block *new_idom = nullptr;
+      for (auto *p : preds[b->get_id()]) {
+        // skip predecessors that haven't been processed, or aren't reachable
+        if (idoms[p->get_id()] == nullptr) continue;
+        new_idom = new_idom == nullptr ? p : intersect(p, new_idom);
+      }
+      if (idoms[b->get_id()] != new_idom) {
+        idoms[b->get_id()] = new_idom;
+        changed = true;
+      }
+    }
+  }
+
+  for (size_t i = 1; i < order.size(); i++) {
+    auto *b = order[i];
+    children[idoms[b->get_id()]->get_id()].push_back(b);
+  }
+}
+
+
+
+block *domtree::intersect(block *a, block *b) {
+  while (a != b) {
+    while (rpo_index[a->get_id()] > rpo_index[b->get_id()])
+      a = idoms[a->get_id()];
+    while (rpo_index[b->get_id()] > rpo_index[a->get_id()])
+      b = idoms[b->get_id()];
+  }
+  return a;
+}
+
+
+
+bool domtree::dominates(block *a, block *b) {
+  if (!reachable(a) || !reachable(b)) return false;
+  // walk up the tree from b until we hit a or the entry
+  while (true) {
+    if (a == b) return true;
+    auto *up = idom(b);
+    if (up == b) return false;
+    b = up;
+  }
+}
+
+
+
+
+loop_info::loop_info(func &fn, domtree &dt) {
+  auto &blocks = fn.get_blocks();
+  innermost.assign(blocks.size(), nullptr);
+  auto preds = predecessors(fn);
+
+  for (auto *h : dt.rpo()) {
+    std::vector<block *> latches;
+    for (auto *p : preds[h->get_id()])
+      if (dt.reachable(p) && dt.dominates(h, p)) latches.push_back(p);
+    if (latches.empty()) continue;
+
+    auto l = std::make_unique<loop>();
+    l->header = h;
+    l->latches = latches;
+    l->in.assign(blocks.size(), false);
+    l->in[h->get_id()] = true;
+
+    // everything that reaches a latch backwards without passing the header
+    std::vector<block *> work = latches;
+    while (!work.empty()) {
+      auto *b = work.back();
+      work.pop_back();
+      if (l->in[b->get_id()]) continue;
+      l->in[b->get_id()] = true;
+      for (auto *p : preds[b->get_id()])
+        if (dt.reachable(p)) work.push_back(p);
+    }
+
+    for (auto *b : dt.rpo())
+      if (l->in[b->get_id()]) l->blocks.push_back(b);
+    loops.push_back(std::move(l));
+  }
+
+  // a loop nested in another has strictly fewer blocks, so sorting by size
+  // puts inner loops first. The parent of a loop is then the first loop
+  // after it that contains its header
+  std::stable_sort(loops.begin(), loops.end(), [](auto &a, auto &b) {
+    return a->blocks.size() < b->blocks.size();
+  });
+  for (size_t i = 0; i < loops.size(); i++) {
+    auto *l = loops[i].get();
+    for (size_t j = i + 1; j < loops.size() && l->parent == nullptr; j++)
+      if (loops[j]->contains(l->header)) l->parent = loops[j].get();
+    for (auto *b : l->blocks)
+      if (innermost[b->get_id()] == nullptr) innermost[b->get_id()] = l;
+  }
+  // parents come after their children, so walk backwards to fill in depths
+  for (size_t i = loops.size(); i-- > 0;) {
+    auto *l = loops[i].get();
+    if (l->parent != nullptr) l->depth = l->parent->depth + 1;
+  }
+}
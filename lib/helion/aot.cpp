@@ -0,0 +1,99 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/core.h>
+#include <helion/util.h>
+#include <stdlib.h>
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+// the runtime library executables are linked with, which cmake points at the
+// one it built
+#ifndef HELION_RT
+#define HELION_RT "libhelion-rt.a"
+#endif
+
+
+using namespace helion;
+
+extern llvm::TargetMachine *target_machine;
+
+
+/*
+ * ahead of time compilation. A module is lowered with the same code the jit
+ * uses, optimized the same way and compiled by the same target machine, but
+ * to an object file. Executables link that with the runtime and the
+ * collector, statically, so they need neither llvm nor helion to run.
+ *
+ * the target machine makes code that isn't position independent, so
+ * executables are linked with -no-pie.
+ */
+
+
+
+static bool ends_with(const std::string &s, const std::string &end) {
+  return s.size() >= end.size() &&
+         s.compare(s.size() - end.size(), end.size(), end) == 0;
+}
+
+
+static bool emit_object(llvm::Module &mod, const std::string &path) {
+  std::error_code ec;
+  llvm::raw_fd_ostream dest(path, ec, llvm::sys::fs::F_None);
+  if (ec) {
+    puts("unable to open " + path + ":", ec.message());
+    return false;
+  }
+
+  llvm::legacy::PassManager pm;
+  if (target_machine->addPassesToEmitFile(
+          pm, dest, nullptr, llvm::TargetMachine::CGFT_ObjectFile)) {
+    puts("the target can't emit object files");
+    return false;
+  }
+  pm.run(mod);
+  dest.flush();
+  return true;
+}
+
+
+static bool link(const std::string &obj, const std::string &out) {
+  std::string cc = "c++";
+  if (auto *e = getenv("HELION_CC"); e != nullptr) cc = e;
+
+  auto cmd = cc + " -no-pie -o '" + out + "' '" + obj + "' '" HELION_RT "'" +
+             " -Wl,-Bstatic -lgc -Wl,-Bdynamic -lpthread -lm";
+  if (system(cmd.c_str()) != 0) {
+    puts("linking failed:", cmd);
+    return false;
+  }
+  return true;
+}
+
+
+
+int helion::build_module(iir::module &m, const std::string &out,
+                         int opt_level) {
+  llvm::LLVMContext ctx;
+  std::string error;
+  auto mod = lower_module(m, ctx, error);
+  if (!mod) {
+    puts("error:", error);
+    return 1;
+  }
+  if (opt_level >= 0) set_opt_level(*mod, opt_level);
+  execution_engine->optimize(*mod);
+
+  if (ends_with(out, ".o")) return emit_object(*mod, out) ? 0 : 1;
+
+  llvm::SmallString<128> obj;
+  if (llvm::sys::fs::createTemporaryFile("helion", "o", obj)) {
+    puts("unable to make a temporary file");
+    return 1;
+  }
+  bool ok = emit_object(*mod, obj.c_str()) && link(obj.c_str(), out);
+  llvm::sys::fs::remove(obj);
+  return ok ? 0 : 1;
+}
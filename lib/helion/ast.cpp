@@ -399,3 +399,28 @@ text ast::if_node::str(int depth) {
 
   return s;
 }
+
+
+
+text ast::while_node::str(int depth) {
+  text s;
+  s += "while ";
+  s += cond->str();
+  s += " ";
+  s += body->str(depth);
+  return s;
+}
+
+
+text ast::for_node::str(int depth) {
+  text s;
+  s += "for ";
+  s += init->str();
+  s += ", ";
+  s += cond->str();
+  s += ", ";
+  s += step->str();
+  s += " ";
+  s += body->str(depth);
+  return s;
+}
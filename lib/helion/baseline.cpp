@@ -0,0 +1,603 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/gc.h>
+#include <helion/vm.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <initializer_list>
+
+
+using namespace helion;
+using namespace helion::vm;
+
+
+/*
+ * the baseline compiler. It makes x86-64 code straight from the
+ * interpreter's linear form, by pasting down a fixed template for each op.
+ * The frame is the interpreter's frame, moved onto the machine stack:
+ *
+ *     rbx -> registers  (constants first, then one per instruction)
+ *     r14 -> locals
+ *     r15 -> the argument array for calls
+ *     r12 =  the closure it was called through
+ *     r13 =  its arguments
+ *
+ * every op loads its operands from the frame and stores its result back, so
+ * there is no register allocation, and making the code costs about as much
+ * as copying it. It is a normal entry_fn (System V), so it calls and is
+ * called by interpreted and llvm compiled functions without caring which
+ * they are, and a hot function moves on from it the same way it would from
+ * the interpreter.
+ */
+
+
+
+#if defined(__x86_64__)
+
+
+// what the code calls into. Addresses are baked into it
+
+static void bl_enter(function *fn) {
+  fn->calls.fetch_add(1, std::memory_order_relaxed);
+  fn->owner->tick(*fn);
+}
+
+static void bl_back_edge(function *fn) {
+  fn->back_edges.fetch_add(1, std::memory_order_relaxed);
+  fn->owner->tick(*fn);
+}
+
+static word bl_cell(word w) {
+  auto *cell = (word *)gc::alloc(sizeof(word));
+  *cell = w;
+  return (word)cell;
+}
+
+static word bl_closure(word *r, const int32_t *list, int n, word *where) {
+  auto *rec = (closure *)where;
+  if (rec == nullptr)
+    rec = (closure *)gc::alloc(sizeof(closure) + n * sizeof(word));
+  rec->fn = ((closure *)r[list[0]])->fn;
+  rec->mask = r[list[1]];
+  for (int k = 0; k < n; k++) rec->env[k] = r[list[k + 2]];
+  return (word)rec;
+}
+
+static word bl_call(closure *c, word *args) {
+  return c->fn->entry.load(std::memory_order_acquire)(c, args);
+}
+
+
+
+namespace {
+
+  enum reg : int {
+    rax = 0,
+    rcx = 1,
+    rdx = 2,
+    rbx = 3,
+    rsp = 4,
+    rbp = 5,
+    rsi = 6,
+    rdi = 7,
+    r12 = 12,
+    r13 = 13,
+    r14 = 14,
+    r15 = 15,
+    // the same numbers, for sse instructions
+    xmm0 = 0,
+  };
+
+  // condition codes, for jcc and setcc
+  enum cond : uint8_t {
+    cc_b = 0x2,
+    cc_ae = 0x3,
+    cc_e = 0x4,
+    cc_ne = 0x5,
+    cc_a = 0x7,
+    cc_p = 0xa,
+    cc_np = 0xb,
+    cc_l = 0xc,
+    cc_ge = 0xd,
+    cc_le = 0xe,
+    cc_g = 0xf,
+  };
+
+
+  // just the encodings the templates use. Memory operands are always
+  // [base + disp32], which keeps the encoding uniform
+  class assembler {
+   public:
+    std::vector<uint8_t> bytes;
+
+    size_t here(void) { return bytes.size(); }
+
+    void byte(uint8_t b) { bytes.push_back(b); }
+    void u32(uint32_t n) {
+      for (int i = 0; i < 4; i++) byte(n >> (8 * i));
+    }
+    void u64(uint64_t n) {
+      for (int i = 0; i < 8; i++) byte(n >> (8 * i));
+    }
+
+    // an instruction with a register and a memory operand
+    void rm(uint8_t prefix, bool w, std::initializer_list<uint8_t> opc,
+            int r, int base, int32_t disp) {
+      if (prefix != 0) byte(prefix);
+      rex(w, r, base);
+      for (auto o : opc) byte(o);
+      byte(0x80 | (r & 7) << 3 | (base & 7));
+      // rsp and r12 as a base need a sib byte
+      if ((base & 7) == 4) byte(0x24);
+      u32(disp);
+    }
+
+    // an instruction with two register operands
+    void rr(uint8_t prefix, bool w, std::initializer_list<uint8_t> opc,
+            int r, int m) {
+      if (prefix != 0) byte(prefix);
+      rex(w, r, m);
+      for (auto o : opc) byte(o);
+      byte(0xc0 | (r & 7) << 3 | (m & 7));
+    }
+
+    void load(int r, int base, int32_t disp) {
+      rm(0, true, {0x8b}, r, base, disp);
+    }
+    void store(int base, int32_t disp, int r) {
+      rm(0, true, {0x89}, r, base, disp);
+    }
+    void lea(int r, int base, int32_t disp) {
+      rm(0, true, {0x8d}, r, base, disp);
+    }
+    void move(int dst, int src) { rr(0, true, {0x8b}, dst, src); }
+
+    void imm(int r, uint64_t n) {
+      rex(true, 0, r);
+      byte(0xb8 + (r & 7));
+      u64(n);
+    }
+
+    void push(int r) {
+      if (r >= 8) byte(0x41);
+      byte(0x50 + (r & 7));
+    }
+    void pop(int r) {
+      if (r >= 8) byte(0x41);
+      byte(0x58 + (r & 7));
+    }
+
+    void call(uint64_t addr) {
+      imm(rax, addr);
+      rr(0, false, {0xff}, 2, rax);
+    }
+
+    // returns the position of the displacement, to be patched
+    size_t jmp(void) {
+      byte(0xe9);
+      u32(0);
+      return here() - 4;
+    }
+    size_t jcc(cond c) {
+      byte(0x0f);
+      byte(0x80 | c);
+      u32(0);
+      return here() - 4;
+    }
+    void patch(size_t at, size_t target) {
+      int32_t rel = (int32_t)target - (int32_t)(at + 4);
+      memcpy(&bytes[at], &rel, 4);
+    }
+
+    void setcc(cond c, int r) {
+      rr(0, false, {0x0f, (uint8_t)(0x90 | c)}, 0, r);
+    }
+
+   private:
+    void rex(bool w, int r, int b) {
+      uint8_t x = 0x40 | w << 3 | ((r >> 3) & 1) << 2 | ((b >> 3) & 1);
+      if (x != 0x40) byte(x);
+    }
+  };
+
+
+
+  class baseline_gen {
+    function &fn;
+    code &c;
+    assembler a;
+
+    // where each op starts, and the jumps that go to them
+    std::vector<size_t> starts;
+    std::vector<std::pair<size_t, int32_t>> jumps;
+    std::vector<size_t> epilogue_jumps;
+    std::vector<size_t> divzero_jumps;
+    int32_t frame = 0;
+
+   public:
+    baseline_gen(function &fn, code &c) : fn(fn), c(c) {}
+
+    std::vector<uint8_t> &run(void) {
+      prologue();
+      for (size_t n = 0; n < c.ops.size(); n++) {
+        starts.push_back(a.here());
+        emit(n, c.ops[n]);
+      }
+
+      size_t end = a.here();
+      for (auto at : epilogue_jumps) a.patch(at, end);
+      epilogue();
+      for (auto &[at, target] : jumps) a.patch(at, starts[target]);
+
+      if (divzero_jumps.size() != 0) {
+        for (auto at : divzero_jumps) a.patch(at, a.here());
+        a.imm(rdi, (uint64_t) "division by zero");
+        a.call((uint64_t)vm::fail);
+      }
+      return a.bytes;
+    }
+
+
+   private:
+    static int32_t at(int32_t r) { return 8 * r; }
+
+    void prologue(void) {
+      a.push(rbp);
+      a.move(rbp, rsp);
+      a.push(rbx);
+      a.push(r12);
+      a.push(r13);
+      a.push(r14);
+      a.push(r15);
+
+      // six pushes and the return address leave the stack 8 off of 16, so
+      // the frame makes up the difference
+      int32_t words = c.nregs + c.nlocals + std::max(c.nargs, 1);
+      frame = 8 * words;
+      if (frame % 16 == 0) frame += 8;
+      a.rr(0, true, {0x81}, 5, rsp);
+      a.u32(frame);
+
+      a.move(rbx, rsp);
+      a.lea(r14, rbx, at(c.nregs));
+      a.lea(r15, r14, at(c.nlocals));
+      a.move(r12, rdi);
+      a.move(r13, rsi);
+
+      a.imm(rdi, (uint64_t)&fn);
+      a.call((uint64_t)bl_enter);
+
+      for (size_t n = 0; n < c.consts.size(); n++) {
+        a.imm(rax, c.consts[n]);
+        a.store(rbx, at(n), rax);
+      }
+      // xor eax, eax
+      a.rr(0, false, {0x31}, rax, rax);
+      for (int n = 0; n < c.nlocals; n++) a.store(r14, at(n), rax);
+    }
+
+    void epilogue(void) {
+      a.rr(0, true, {0x81}, 0, rsp);
+      a.u32(frame);
+      a.pop(r15);
+      a.pop(r14);
+      a.pop(r13);
+      a.pop(r12);
+      a.pop(rbx);
+      a.pop(rbp);
+      a.byte(0xc3);
+    }
+
+
+    // rax = r[x], op, r[dst] = rax
+    void int_op(const op &o, std::initializer_list<uint8_t> opc) {
+      a.load(rax, rbx, at(o.a));
+      a.rm(0, true, opc, rax, rbx, at(o.b));
+      a.store(rbx, at(o.dst), rax);
+    }
+
+    void flt_op(const op &o, uint8_t opc) {
+      a.rm(0xf2, false, {0x0f, 0x10}, xmm0, rbx, at(o.a));
+      a.rm(0xf2, false, {0x0f, opc}, xmm0, rbx, at(o.b));
+      a.rm(0xf2, false, {0x0f, 0x11}, xmm0, rbx, at(o.dst));
+    }
+
+    void int_cmp(const op &o, cond cc) {
+      a.load(rax, rbx, at(o.a));
+      a.rm(0, true, {0x3b}, rax, rbx, at(o.b));
+      set(o, cc);
+    }
+
+    // unordered compares set zf, pf and cf, so only `above` style conditions
+    // (and eq/ne with the parity flag) are false for nan
+    void flt_cmp(const op &o, cond cc, bool swap) {
+      int32_t x = swap ? o.b : o.a, y = swap ? o.a : o.b;
+      a.rm(0xf2, false, {0x0f, 0x10}, xmm0, rbx, at(x));
+      a.rm(0x66, false, {0x0f, 0x2e}, xmm0, rbx, at(y));
+      if (cc == cc_e || cc == cc_ne) {
+        a.setcc(cc, rax);
+        a.setcc(cc == cc_e ? cc_np : cc_p, rcx);
+        // and al, cl / or al, cl
+        a.byte(cc == cc_e ? 0x20 : 0x08);
+        a.byte(0xc8);
+        zext(o);
+        return;
+      }
+      set(o, cc);
+    }
+
+    void set(const op &o, cond cc) {
+      a.setcc(cc, rax);
+      zext(o);
+    }
+
+    // movzx eax, al, and store
+    void zext(const op &o) {
+      a.rr(0, false, {0x0f, 0xb6}, rax, rax);
+      a.store(rbx, at(o.dst), rax);
+    }
+
+    void back_edge(void) {
+      a.imm(rdi, (uint64_t)&fn);
+      a.call((uint64_t)bl_back_edge);
+    }
+
+    void jump(int32_t target) { jumps.push_back({a.jmp(), target}); }
+
+
+    void emit(size_t index, const op &o) {
+      switch (o.kind) {
+        case op_add_i:
+          return int_op(o, {0x03});
+        case op_sub_i:
+          return int_op(o, {0x2b});
+        case op_mul_i:
+          return int_op(o, {0x0f, 0xaf});
+        case op_div_i:
+          a.load(rcx, rbx, at(o.b));
+          a.rr(0, true, {0x85}, rcx, rcx);
+          divzero_jumps.push_back(a.jcc(cc_e));
+          a.load(rax, rbx, at(o.a));
+          // cqo, idiv rcx
+          a.byte(0x48);
+          a.byte(0x99);
+          a.rr(0, true, {0xf7}, 7, rcx);
+          a.store(rbx, at(o.dst), rax);
+          return;
+        case op_neg_i:
+          a.load(rax, rbx, at(o.a));
+          a.rr(0, true, {0xf7}, 3, rax);
+          a.store(rbx, at(o.dst), rax);
+          return;
+
+        case op_add_f:
+          return flt_op(o, 0x58);
+        case op_sub_f:
+          return flt_op(o, 0x5c);
+        case op_mul_f:
+          return flt_op(o, 0x59);
+        case op_div_f:
+          return flt_op(o, 0x5e);
+        case op_neg_f:
+          // flip the sign bit: btc rax, 63
+          a.load(rax, rbx, at(o.a));
+          a.rr(0, true, {0x0f, 0xba}, 7, rax);
+          a.byte(63);
+          a.store(rbx, at(o.dst), rax);
+          return;
+
+        case op_lt_i:
+          return int_cmp(o, cc_l);
+        case op_le_i:
+          return int_cmp(o, cc_le);
+        case op_gt_i:
+          return int_cmp(o, cc_g);
+        case op_ge_i:
+          return int_cmp(o, cc_ge);
+        case op_eq_i:
+          return int_cmp(o, cc_e);
+        case op_ne_i:
+          return int_cmp(o, cc_ne);
+        case op_lt_f:
+          return flt_cmp(o, cc_a, true);
+        case op_le_f:
+          return flt_cmp(o, cc_ae, true);
+        case op_gt_f:
+          return flt_cmp(o, cc_a, false);
+        case op_ge_f:
+          return flt_cmp(o, cc_ae, false);
+        case op_eq_f:
+          return flt_cmp(o, cc_e, false);
+        case op_ne_f:
+          return flt_cmp(o, cc_ne, false);
+
+        case op_sext:
+          a.load(rax, rbx, at(o.a));
+          // shl rax, n / sar rax, n
+          a.rr(0, true, {0xc1}, 4, rax);
+          a.byte(64 - o.b);
+          a.rr(0, true, {0xc1}, 7, rax);
+          a.byte(64 - o.b);
+          a.store(rbx, at(o.dst), rax);
+          return;
+        case op_round32:
+          // cvtsd2ss, cvtss2sd
+          a.rm(0xf2, false, {0x0f, 0x5a}, xmm0, rbx, at(o.a));
+          a.rr(0xf3, false, {0x0f, 0x5a}, xmm0, xmm0);
+          a.rm(0xf2, false, {0x0f, 0x11}, xmm0, rbx, at(o.dst));
+          return;
+        case op_i2f:
+          a.rm(0xf2, true, {0x0f, 0x2a}, xmm0, rbx, at(o.a));
+          a.rm(0xf2, false, {0x0f, 0x11}, xmm0, rbx, at(o.dst));
+          return;
+        case op_f2i:
+          a.rm(0xf2, true, {0x0f, 0x2c}, rax, rbx, at(o.a));
+          a.store(rbx, at(o.dst), rax);
+          return;
+        case op_move:
+          a.load(rax, rbx, at(o.a));
+          a.store(rbx, at(o.dst), rax);
+          return;
+
+        case op_load:
+        case op_unbox:
+          a.load(rax, rbx, at(o.a));
+          a.load(rax, rax, 0);
+          a.store(rbx, at(o.dst), rax);
+          return;
+        case op_store:
+          a.load(rax, rbx, at(o.a));
+          a.load(rcx, rbx, at(o.b));
+          a.store(rax, 0, rcx);
+          return;
+        case op_alloc:
+          a.lea(rax, r14, at(o.a));
+          a.store(rbx, at(o.dst), rax);
+          return;
+        case op_halloc:
+          a.rr(0, false, {0x31}, rdi, rdi);
+          a.call((uint64_t)bl_cell);
+          a.store(rbx, at(o.dst), rax);
+          return;
+        case op_poparg:
+          a.lea(rax, r13, at(o.a));
+          a.store(rbx, at(o.dst), rax);
+          return;
+        case op_hpoparg:
+          a.load(rdi, r13, at(o.a));
+          a.call((uint64_t)bl_cell);
+          a.store(rbx, at(o.dst), rax);
+          return;
+        case op_box:
+          a.load(rdi, rbx, at(o.a));
+          a.call((uint64_t)bl_cell);
+          a.store(rbx, at(o.dst), rax);
+          return;
+
+        case op_env:
+          // captures by reference hold the address of the variable, and
+          // captures by copy are the variable
+          a.lea(rax, r12, offsetof(closure, env) + at(o.a));
+          a.load(rcx, r12, offsetof(closure, mask));
+          // bt rcx, n; jnc over the load
+          a.rr(0, true, {0x0f, 0xba}, 4, rcx);
+          a.byte(o.a);
+          a.byte(0x73);
+          a.byte(7);
+          a.load(rax, rax, 0);
+          a.store(rbx, at(o.dst), rax);
+          return;
+
+        case op_closure:
+          a.move(rdi, rbx);
+          a.imm(rsi, (uint64_t)&c.lists[o.a]);
+          a.imm(rdx, o.b);
+          if (o.c < 0) {
+            a.rr(0, false, {0x31}, rcx, rcx);
+          } else {
+            a.lea(rcx, r14, at(o.c));
+          }
+          a.call((uint64_t)bl_closure);
+          a.store(rbx, at(o.dst), rax);
+          return;
+
+        case op_call: {
+          if (o.c == 0) {
+            a.rr(0, false, {0x31}, rax, rax);
+            a.store(r15, 0, rax);
+          }
+          for (int k = 0; k < o.c; k++) {
+            a.load(rax, rbx, at(c.lists[o.b + k]));
+            a.store(r15, at(k), rax);
+          }
+          a.load(rdi, rbx, at(o.a));
+          a.move(rsi, r15);
+          if (o.a < (int32_t)c.consts.size() && c.consts[o.a] != 0) {
+            // a known function, so its entry is read directly. Plain loads
+            // are acquires on x86. Null operands are constant 0s, and go
+            // through bl_call like any other unknown callee
+            auto *callee = ((closure *)c.consts[o.a])->fn;
+            a.imm(rax, (uint64_t)&callee->entry);
+            a.load(rax, rax, 0);
+            a.rr(0, false, {0xff}, 2, rax);
+          } else {
+            a.call((uint64_t)bl_call);
+          }
+          a.store(rbx, at(o.dst), rax);
+          return;
+        }
+
+        case op_loop:
+          back_edge();
+          // fall through
+        case op_jmp:
+          return jump(o.a);
+
+        case op_br:
+        case op_br_loop: {
+          a.load(rax, rbx, at(o.a));
+          a.rr(0, true, {0x85}, rax, rax);
+          size_t other = a.jcc(cc_e);
+          if (o.kind == op_br_loop && o.b <= (int32_t)index) back_edge();
+          jump(o.b);
+          a.patch(other, a.here());
+          if (o.kind == op_br_loop && o.c <= (int32_t)index) back_edge();
+          jump(o.c);
+          return;
+        }
+
+        case op_ret:
+          a.load(rax, rbx, at(o.a));
+          epilogue_jumps.push_back(a.jmp());
+          return;
+        case op_retz:
+          a.rr(0, false, {0x31}, rax, rax);
+          epilogue_jumps.push_back(a.jmp());
+          return;
+        case op_fail:
+          a.imm(rdi, (uint64_t)c.messages[o.a].c_str());
+          a.call((uint64_t)vm::fail);
+          return;
+
+        default:
+          return;
+      }
+    }
+  };
+}  // namespace
+
+
+
+entry_fn vm::compile_baseline(function &fn) {
+  auto *c = fn.linear.load(std::memory_order_acquire);
+  if (c == nullptr) return nullptr;
+
+  baseline_gen gen(fn, *c);
+  auto &bytes = gen.run();
+
+  // code is never freed, as a call can be in it at any time
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (bytes.size() + page - 1) / page * page;
+  void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return nullptr;
+  memcpy(mem, bytes.data(), bytes.size());
+  if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, size);
+    return nullptr;
+  }
+  return (entry_fn)mem;
+}
+
+
+#else
+
+
+entry_fn vm::compile_baseline(function &) { return nullptr; }
+
+
+#endif
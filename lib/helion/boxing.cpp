@@ -0,0 +1,169 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/iir.h>
+#include <helion/infer.h>
+#include <helion/passes.h>
+#include <algorithm>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+/*
+ * representation selection, after monomorphization. Primitive numbers are
+ * unboxed everywhere their type is known. A polymorphic function can't know
+ * how big its arguments are though, so it is handed every value of a
+ * variable type as a pointer to a heap cell, and returns one the same way:
+ *
+ *     %r: Int = call @id, %x          %b: Int = box %x
+ *                               =>    %r: Int = call @id, %b
+ *                                     %u: Int = unbox %r
+ *
+ * monomorphization already pointed every call it could at a copy with
+ * ground types, so this only happens where that wasn't possible (a callee
+ * that isn't known, or an instance that isn't fully known). Inside the body
+ * that is called, arithmetic on those values takes them out of their cells
+ * first, and puts a result of a variable type back in one:
+ *
+ *     %s: a = add %x, %y              %ux: a = unbox %x
+ *                               =>    %uy: a = unbox %y
+ *                                     %s: a = add %ux, %uy
+ *                                     %bs: a = box %s
+ */
+
+
+
+// the types of the positions a function with the given signature takes its
+// arguments in, and returns its result in. Signatures are either curried, one
+// arrow per argument, or a single arrow from a tuple of the arguments
+static void positions(type *sig, size_t nargs, std::vector<type *> &params,
+                      type *&ret) {
+  sig = infer::find(sig);
+  auto *n = sig->as_named();
+  if (n != nullptr && n->name == "->") {
+    auto *args = infer::find(n->params[0])->as_named();
+    if (args != nullptr && args->name == "()" && args->params.size() == nargs) {
+      for (auto *p : args->params) params.push_back(infer::find(p));
+      ret = infer::find(n->params[1]);
+      return;
+    }
+  }
+
+  for (size_t i = 0; i < std::max<size_t>(nargs, 1); i++) {
+    n = sig->as_named();
+    // calling something that isn't known to be a function, so nothing about
+    // its positions is known either
+    if (n == nullptr || n->name != "->") {
+      params.resize(nargs, sig);
+      ret = sig;
+      return;
+    }
+    if (i < nargs) params.push_back(infer::find(n->params[0]));
+    sig = infer::find(n->params[1]);
+  }
+  ret = sig;
+}
+
+
+
+// a value of a variable type is always in a cell, unless it was just taken
+// out of one
+static bool in_cell(value *v) {
+  if (v == nullptr || !infer::find(&v->get_type())->is_var()) return false;
+  auto *i = dynamic_cast<instruction *>(v);
+  return i == nullptr || i->get_inst_type() != inst_type::unbox;
+}
+
+
+static bool arithmetic(inst_type t) {
+  switch (t) {
+    case inst_type::add:
+    case inst_type::sub:
+    case inst_type::mul:
+    case inst_type::div:
+    case inst_type::invert:
+    case inst_type::cast:
+      return true;
+    default:
+      return is_comparison(t);
+  }
+}
+
+
+// unbox the operands of arithmetic in a polymorphic body, and box its result
+// again if that has a variable type too
+static bool unbox_operands(func &fn, block &b, instruction *i,
+                           slice<instruction *> &insts) {
+  bool changed = false;
+  if (arithmetic(i->get_inst_type())) {
+    for (auto &a : i->args) {
+      if (!in_cell(a)) continue;
+      slice<value *> as = {a};
+      auto *unbox = fn.new_inst(b, inst_type::unbox, a->get_type(), as);
+      insts.push_back(unbox);
+      a = unbox;
+      changed = true;
+    }
+  }
+  insts.push_back(i);
+
+  if (changed && infer::find(&i->get_type())->is_var()) {
+    slice<value *> as = {i};
+    auto *box = fn.new_inst(b, inst_type::box, i->get_type(), as);
+    // like the unbox of a call's result below
+    replace_uses(fn, i, box);
+    insts.push_back(box);
+  }
+  return changed;
+}
+
+
+
+bool iir::place_boxes(func &fn, callee_table &callees) {
+  bool changed = false;
+
+  for (auto *b : fn.get_blocks()) {
+    slice<instruction *> insts;
+    for (auto *i : b->get_insts()) {
+      if (i->get_inst_type() != inst_type::call) {
+        if (unbox_operands(fn, *b, i, insts)) changed = true;
+        continue;
+      }
+
+      // a known callee's own signature says which of its positions are
+      // variables, even where the call's instance of it is ground
+      auto *callee = callees.resolve(i->args[0]);
+      auto *sig = callee != nullptr ? &callee->get_type()
+                                    : &i->args[0]->get_type();
+      size_t nargs = i->args.size() - 1;
+      std::vector<type *> params;
+      type *ret = nullptr;
+      positions(sig, nargs, params, ret);
+
+      for (size_t n = 0; n < nargs; n++) {
+        auto *a = i->args[n + 1];
+        if (a == nullptr || !is_numeric(&a->get_type()) || !params[n]->is_var())
+          continue;
+        slice<value *> as = {a};
+        auto *box = fn.new_inst(*b, inst_type::box, a->get_type(), as);
+        insts.push_back(box);
+        i->args[n + 1] = box;
+        changed = true;
+      }
+      insts.push_back(i);
+
+      if (is_numeric(&i->get_type()) && ret->is_var()) {
+        slice<value *> as = {i};
+        auto *unbox = fn.new_inst(*b, inst_type::unbox, i->get_type(), as);
+        // the unbox isn't in the block yet, so it keeps the call as its operand
+        replace_uses(fn, i, unbox);
+        insts.push_back(unbox);
+        changed = true;
+      }
+    }
+    b->get_insts() = insts;
+  }
+  return changed;
+}
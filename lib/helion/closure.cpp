@@ -0,0 +1,355 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/iir.h>
+#include <helion/passes.h>
+#include <unordered_map>
+#include <unordered_set>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+/*
+ * closure conversion. While lowering from the ast, a nested function refers
+ * to the locals and arguments of the functions around it directly, as if they
+ * were its own. This pass gives every such function a flat environment
+ * record instead:
+ *
+ *     fn outer:                     fn outer:
+ *       %x = alloc                    %x = alloc
+ *       store %x, 1                   store %x, 1
+ *       %f = call @inner         =>   %c = closure @inner, 1, %x
+ *                                     %f = call %c
+ *     fn inner:                     fn inner:
+ *       %v = load outer.%x            %e = env 0
+ *                                     %v = load %e
+ *
+ * the operands of a closure are the function, a mask of which captures are
+ * by reference (bit set) and the captures themselves. Variables that are
+ * never written after the closure is made are copied into the record by
+ * value, everything else is captured by reference. Either way, `env i` is a
+ * location in the body, so loads and stores don't need to change.
+ *
+ * escape analysis then decides where things live. A closure that is only
+ * ever called (directly, or through locals that are only ever called) can't
+ * outlive the frame that made it, so it and the variables it captures stay on
+ * the stack. Closures that escape, and the variables they capture by
+ * reference, are marked `heap` so lowering allocates them through gc::alloc
+ */
+
+
+
+static func *owner_of(value *v) {
+  if (auto *i = dynamic_cast<instruction *>(v); i != nullptr)
+    return &i->get_block().get_func();
+  return nullptr;
+}
+
+
+static bool is_global(value *v) {
+  auto *i = dynamic_cast<instruction *>(v);
+  return i != nullptr && i->get_inst_type() == inst_type::global;
+}
+
+
+template <typename F>
+static void each_inst(func &fn, F cb) {
+  for (auto *b : fn.get_blocks()) {
+    for (auto *i : b->get_insts()) cb(i);
+    if (b->terminated()) cb(b->get_terminator());
+  }
+}
+
+
+
+
+namespace {
+
+  // an ordered set, so the layout of environment records is deterministic
+  struct capture_set {
+    std::vector<value *> order;
+    std::unordered_map<value *, int> index;
+
+    inline bool add(value *v) {
+      if (index.count(v) != 0) return false;
+      index[v] = order.size();
+      order.push_back(v);
+      return true;
+    }
+  };
+
+
+  // a place where a closure is made, and what it captures
+  struct closure_site {
+    instruction *inst;
+    func *fn;
+    std::vector<value *> captures;
+  };
+
+
+  class converter {
+    module &mod;
+
+    // the variables of other functions that each function needs, either
+    // itself or for the closures it makes
+    std::unordered_map<func *, capture_set> free;
+    // for each function, the env instruction standing in for a capture
+    std::unordered_map<func *, std::unordered_map<value *, value *>> envs;
+    // the number of stores to every location in the module
+    std::unordered_map<value *, int> stores;
+    // locations that are copied into environments instead of referenced
+    std::unordered_set<value *> by_copy;
+    std::vector<closure_site> sites;
+
+   public:
+    converter(module &mod) : mod(mod) {}
+
+
+    void run(void) {
+      find_free();
+      if (free.empty()) return;
+
+      for (auto *fn : mod.funcs)
+        each_inst(*fn, [&](instruction *i) {
+          if (i->get_inst_type() == inst_type::store) stores[i->args[0]]++;
+        });
+
+      for (auto *fn : mod.funcs) pick_copies(*fn);
+      for (auto *fn : mod.funcs) add_envs(*fn);
+      for (auto *fn : mod.funcs) make_closures(*fn);
+      for (auto &s : sites) place(s);
+    }
+
+
+   private:
+    std::vector<value *> *captures_of(value *v) {
+      auto *fn = dynamic_cast<func *>(v);
+      if (fn == nullptr) return nullptr;
+      auto it = free.find(fn);
+      if (it == free.end() || it->second.order.empty()) return nullptr;
+      return &it->second.order;
+    }
+
+
+    // collect the free variables of every function. A function that makes a
+    // closure also needs whatever that closure captures from further out, so
+    // this runs until nothing changes
+    void find_free(void) {
+      bool changed = true;
+      while (changed) {
+        changed = false;
+        for (auto *fn : mod.funcs) {
+          each_inst(*fn, [&](instruction *i) {
+            for (auto *a : i->args) {
+              auto *owner = owner_of(a);
+              if (owner != nullptr && owner != fn && !is_global(a))
+                changed |= free[fn].add(a);
+
+              auto *nested = dynamic_cast<func *>(a);
+              if (nested == nullptr || nested == fn) continue;
+              if (free.count(nested) == 0) continue;
+              // copy first, as adding can rehash the map under us
+              auto caps = free[nested].order;
+              for (auto *c : caps)
+                if (owner_of(c) != fn) changed |= free[fn].add(c);
+            }
+          });
+        }
+      }
+    }
+
+
+    // is an instruction at position `ai` in block `ab` guaranteed to have
+    // run before one at `bi` in `bb`? Terminators are at insts().size()
+    static bool before(domtree &dt, block *ab, int ai, block *bb, int bi) {
+      if (ab == bb) return ai < bi;
+      return dt.dominates(ab, bb);
+    }
+
+
+    // a variable can be copied into a closure if it will never change after
+    // that closure has been made. That's arguments that are never assigned,
+    // and locals with a single store that happens before every closure
+    // capturing them is created
+    void pick_copies(func &fn) {
+      std::unordered_map<value *, std::pair<block *, int>> def;
+      std::vector<std::tuple<block *, int, func *>> refs;
+
+      for (auto *b : fn.get_blocks()) {
+        int n = 0;
+        auto scan = [&](instruction *i) {
+          if (i->get_inst_type() == inst_type::store) def[i->args[0]] = {b, n};
+          for (auto *a : i->args)
+            if (captures_of(a) != nullptr) refs.push_back({b, n, (func *)a});
+          n++;
+        };
+        for (auto *i : b->get_insts()) scan(i);
+        if (b->terminated()) scan(b->get_terminator());
+      }
+
+      domtree dt(fn);
+      for (auto *b : fn.get_blocks()) {
+        for (auto *i : b->get_insts()) {
+          auto t = i->get_inst_type();
+          if (t == inst_type::poparg) {
+            if (stores[i] == 0) by_copy.insert(i);
+            continue;
+          }
+          if (t != inst_type::alloc || stores[i] != 1) continue;
+          // the single store has to be in this function
+          if (def.count(i) == 0) continue;
+          auto [db, di] = def[i];
+
+          bool ok = true;
+          for (auto &[rb, ri, nested] : refs) {
+            if (free[nested].index.count(i) == 0) continue;
+            if (!before(dt, db, di, rb, ri)) ok = false;
+          }
+          if (ok) by_copy.insert(i);
+        }
+      }
+    }
+
+
+    // give every function with free variables an env instruction for each
+    // one at the top of its entry block, and use those instead
+    void add_envs(func &fn) {
+      auto it = free.find(&fn);
+      if (it == free.end() || it->second.order.empty()) return;
+      if (fn.get_blocks().size() == 0) return;
+
+      auto *entry = fn.entry();
+      auto &names = envs[&fn];
+      slice<instruction *> insts;
+      int n = 0;
+      for (auto *loc : it->second.order) {
+        slice<value *> as = {fn.new_int(n++)};
+        auto *e = fn.new_inst(*entry, inst_type::env, loc->get_type(), as);
+        insts.push_back(e);
+        names[loc] = e;
+      }
+      for (auto *i : entry->get_insts()) insts.push_back(i);
+      entry->get_insts() = insts;
+
+      for (auto &[loc, e] : names) replace_uses(fn, loc, e);
+    }
+
+
+    // what a captured variable is called inside a function
+    value *local_name(func &fn, value *loc) {
+      if (owner_of(loc) == &fn) return loc;
+      return envs[&fn][loc];
+    }
+
+
+    void make_closures(func &fn) {
+      for (auto *b : fn.get_blocks()) {
+        slice<instruction *> insts;
+        auto rewrite = [&](instruction *i) {
+          for (auto &a : i->args) {
+            auto *caps = captures_of(a);
+            if (caps == nullptr) continue;
+
+            size_t mask = 0;
+            slice<value *> as = {a, nullptr};
+            for (size_t n = 0; n < caps->size(); n++) {
+              auto *loc = (*caps)[n];
+              auto *name = local_name(fn, loc);
+              if (by_copy.count(loc) != 0) {
+                slice<value *> largs = {name};
+                auto *l =
+                    fn.new_inst(*b, inst_type::load, name->get_type(), largs);
+                insts.push_back(l);
+                as.push_back(l);
+              } else {
+                mask |= 1UL << n;
+                as.push_back(name);
+              }
+            }
+            as[1] = fn.new_int(mask);
+
+            auto *c =
+                fn.new_inst(*b, inst_type::closure, a->get_type(), as);
+            insts.push_back(c);
+            sites.push_back({c, &fn, *caps});
+            a = c;
+          }
+        };
+
+        for (auto *i : b->get_insts()) {
+          rewrite(i);
+          insts.push_back(i);
+        }
+        if (b->terminated()) rewrite(b->get_terminator());
+        b->get_insts() = insts;
+      }
+    }
+
+
+    // a value escapes if it can be seen after its function returns. Values
+    // only called, or stored in locals that are only loaded to be called,
+    // don't. Tail calls are the exception, as they can reuse the frame (see
+    // llvmgen), so their callee has to outlive it
+    bool escapes(func &fn, value *v, std::unordered_set<value *> &seen) {
+      if (!seen.insert(v).second) return false;
+      bool esc = false;
+      each_inst(fn, [&](instruction *i) {
+        for (size_t n = 0; n < (size_t)i->args.size(); n++) {
+          if (i->args[n] != v) continue;
+          auto t = i->get_inst_type();
+          if (t == inst_type::call && n == 0 && !i->tail) continue;
+          if (t == inst_type::store && n == 1 && is_private(fn, i->args[0])) {
+            if (loads_escape(fn, i->args[0], seen)) esc = true;
+            continue;
+          }
+          esc = true;
+        }
+      });
+      return esc;
+    }
+
+
+    bool loads_escape(func &fn, value *loc, std::unordered_set<value *> &seen) {
+      bool esc = false;
+      each_inst(fn, [&](instruction *i) {
+        if (i->get_inst_type() == inst_type::load && i->args[0] == loc)
+          if (escapes(fn, i, seen)) esc = true;
+      });
+      return esc;
+    }
+
+
+    // a local that no other function can get to
+    bool is_private(func &fn, value *loc) {
+      auto *i = dynamic_cast<instruction *>(loc);
+      if (i == nullptr || i->get_inst_type() != inst_type::alloc) return false;
+      if (owner_of(loc) != &fn) return false;
+      for (auto &[f, caps] : free)
+        if (caps.index.count(loc) != 0) return false;
+      return true;
+    }
+
+
+    void place(closure_site &s) {
+      std::unordered_set<value *> seen;
+      if (!escapes(*s.fn, s.inst, seen)) return;
+
+      s.inst->heap = true;
+      for (auto *loc : s.captures) {
+        if (by_copy.count(loc) != 0) continue;
+        // the variable has to outlive the frame it was declared in
+        static_cast<instruction *>(loc)->heap = true;
+      }
+    }
+  };
+}  // namespace
+
+
+
+
+void iir::convert_closures(module &m) {
+  converter c(m);
+  c.run();
+}
@@ -7,9 +7,10 @@
 #include <helion/gc.h>
 #include <helion/iir.h>
 #include <helion/infer.h>
-#include <fstream>
+#include <helion/passes.h>
 #include <iostream>
 #include <unordered_map>
+#include "llvm/Support/FileSystem.h"
 
 
 using namespace helion;
@@ -146,6 +147,8 @@ iir::module *helion::compile_module(std::unique_ptr<ast::module> m) {
 
   // create a function that will be the 'init' function of this module
   auto *fn = gc::make_collected<iir::func>(imod);
+  fn->name = imod.unique_name("init", '@');
+  imod.add_func(fn);
 
   iir::builder b(*fn);
 
@@ -158,19 +161,63 @@ iir::module *helion::compile_module(std::unique_ptr<ast::module> m) {
     glob->to_iir(b, &imod);
   }
 
+  // top level functions are assigned to their globals in the init function.
+  // Their bodies can't see each other until they are called, so they are all
+  // declared first, and the bodies are lowered in parallel
+  iir::lowering_queue queue(imod);
+  std::unordered_map<ast::node *, iir::func *> declared;
   for (auto &e : m->stmts) {
+    auto *assign = e->as<ast::binary_op *>();
+    if (assign == nullptr || std::string(assign->op) != "=") continue;
+    auto node = std::dynamic_pointer_cast<ast::func>(assign->right);
+    if (node == nullptr || assign->left->as<ast::var *>() == nullptr) continue;
+
+    auto *f = node->declare(&imod);
+    declared[e.get()] = f;
+    queue.add(f, [node, f](void) { node->lower(f); });
+  }
+  queue.run();
+
+  for (auto &e : m->stmts) {
+    if (auto it = declared.find(e.get()); it != declared.end()) {
+      auto *assign = e->as<ast::binary_op *>();
+      std::string name = assign->left->as<ast::var *>()->str();
+      b.create_store(imod.find_binding(name), it->second);
+      continue;
+    }
     e->to_iir(b, &imod);
   }
 
-  puts("before type inference:");
-  fn->print(std::cout);
-  std::cout << std::endl;
+  return compile_iir(std::move(mod));
+}
+
+
+
+iir::module *helion::compile_iir(std::unique_ptr<iir::module> mod,
+                                 bool print) {
+  iir::module &imod = *mod;
+  iir::optimize(imod);
+
+  if (print) {
+    puts("before type inference:");
+    imod.print(std::cout);
+    std::cout << std::endl;
+  }
 
 
+  // inferred types are kept next to the compiled code between runs, so
+  // compiling the same definitions again doesn't infer them again
+  infer::inference_cache inferred;
+  std::string types_file;
+  if (execution_engine->cache.enabled()) {
+    auto dir = execution_engine->cache.options().dir;
+    if (!llvm::sys::fs::create_directories(dir)) types_file = dir + "/types";
+  }
+  if (types_file != "") inferred.load(types_file);
 
   try {
     infer::context gamma;
-    fn->deduce(gamma);
+    inferred.check(imod, gamma);
   } catch (infer::analyze_failure &e) {
     puts("failed to analyze IIR:");
     e.val->print(std::cerr);
@@ -179,18 +226,35 @@ iir::module *helion::compile_module(std::unique_ptr<ast::module> m) {
     die("Fatally uncaught exception:", e.what());
   }
 
-  puts("After type inference");
-  fn->print(std::cout);
-  std::cout << std::endl;
-
-  return nullptr;
+  if (types_file != "") inferred.save(types_file);
 
-  std::ofstream myfile;
-  myfile.open("example.ssa");
-  myfile << std::endl;
-  myfile.close();
+  // now that every call knows its types, polymorphic callees can be copied
+  // for the types they are actually used at
+  iir::monomorphize(imod);
+  // boxes don't change what any call resolves to, so one table does for
+  // the whole module
+  iir::callee_table callees(imod);
+  for (auto *f : imod.funcs) iir::place_boxes(*f, callees);
 
+  if (print) {
+    puts("After type inference");
+    imod.print(std::cout);
+    std::cout << std::endl;
+  }
 
-  return nullptr;
+  return mod.release();
 }
 
+
+
+
+void helion::run_module(iir::module &m, vm::machine &vm) {
+  if (!vm.compiler) vm.compiler = jit_function;
+  for (auto *f : m.funcs) {
+    if (f->name == "init") {
+      vm.call(f);
+      return;
+    }
+  }
+  die("module has no init function");
+}
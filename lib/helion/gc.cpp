@@ -29,6 +29,20 @@ void *helion::gc::raw_alloc(int n) {
   return GC_MALLOC(n);
 }
 
+void *helion::gc::raw_alloc_uncollectable(int n) {
+  return GC_MALLOC_UNCOLLECTABLE(n);
+}
+
 void helion::gc::raw_free(void *p) {
   GC_FREE(p);
 }
+
+void helion::gc::register_thread(void) {
+  struct GC_stack_base sb;
+  GC_get_stack_base(&sb);
+  GC_register_my_thread(&sb);
+}
+
+void helion::gc::unregister_thread(void) {
+  GC_unregister_my_thread();
+}
@@ -0,0 +1,260 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/iir.h>
+#include <helion/passes.h>
+#include <algorithm>
+#include <unordered_map>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+/*
+ * hash based global value numbering over the dominator tree. Every
+ * instruction that computes something without side effects is hashed by its
+ * opcode and the value numbers of its operands. If an equivalent expression
+ * is already available in a dominating block, the instruction is replaced by
+ * it.
+ *
+ * loads are numbered against a memory "epoch". Any store kills the load of the
+ * location it writes to (and makes the stored value the new known value of
+ * that location), and calls or merging control flow start a new epoch, which
+ * makes every previous load unavailable.
+ */
+
+namespace {
+
+  struct vn_key {
+    inst_type op;
+    int epoch = 0;
+    std::vector<value *> args;
+
+    inline bool operator==(const vn_key &o) const {
+      return op == o.op && epoch == o.epoch && args == o.args;
+    }
+  };
+
+
+  struct vn_key_hash {
+    size_t operator()(const vn_key &k) const {
+      size_t x = 0x345678UL;
+      size_t mult = 1000003UL;  // prime multiplier
+      x ^= (size_t)k.op;
+      x = (x ^ std::hash<int>()(k.epoch)) * mult;
+      for (auto *a : k.args) {
+        mult += (size_t)(852520UL + 2);
+        x = (x ^ std::hash<value *>()(a)) * mult;
+      }
+      return x;
+    }
+  };
+
+
+  // a hash table that can be rolled back to a previous state when the walk
+  // leaves a subtree of the dominator tree
+  class scoped_table {
+    std::unordered_map<vn_key, value *, vn_key_hash> table;
+    std::vector<std::pair<vn_key, value *>> undo;
+
+   public:
+    inline size_t mark(void) { return undo.size(); }
+
+    inline void rollback(size_t m) {
+      while (undo.size() > m) {
+        auto &[k, old] = undo.back();
+        if (old == nullptr) {
+          table.erase(k);
+        } else {
+          table[k] = old;
+        }
+        undo.pop_back();
+      }
+    }
+
+    inline value *lookup(const vn_key &k) {
+      auto it = table.find(k);
+      return it == table.end() ? nullptr : it->second;
+    }
+
+    inline void set(const vn_key &k, value *v) {
+      undo.push_back({k, lookup(k)});
+      table[k] = v;
+    }
+  };
+
+
+
+  class gvn_state {
+    domtree dt;
+    std::vector<std::vector<block *>> preds;
+    scoped_table avail;
+
+    // redundant instructions, mapped to the value that replaces them
+    std::unordered_map<value *, value *> leaders;
+    // constants are numbered by their value, not their identity
+    std::unordered_map<size_t, value *> ints;
+    std::unordered_map<double, value *> floats;
+
+    int epoch = 0;
+    int next_epoch = 0;
+
+   public:
+    bool changed = false;
+
+    gvn_state(func &fn) : dt(fn), preds(predecessors(fn)) {}
+
+    value *leader(value *v) {
+      if (auto it = leaders.find(v); it != leaders.end()) return it->second;
+
+      if (auto *c = dynamic_cast<const_int *>(v); c != nullptr) {
+        if (ints.count(c->val) == 0) ints[c->val] = c;
+        return ints[c->val];
+      }
+      if (auto *c = dynamic_cast<const_flt *>(v); c != nullptr) {
+        if (floats.count(c->val) == 0) floats[c->val] = c;
+        return floats[c->val];
+      }
+      return v;
+    }
+
+
+    void run(func &fn) {
+      if (dt.rpo().empty()) return;
+      visit(dt.rpo()[0]);
+
+      if (leaders.empty()) return;
+      changed = true;
+
+      // drop the replaced instructions and rewrite any remaining uses
+      for (auto *b : fn.get_blocks()) {
+        slice<instruction *> kept;
+        for (auto *i : b->get_insts()) {
+          if (leaders.count(i) == 0) kept.push_back(i);
+        }
+        b->get_insts() = kept;
+      }
+      for (auto &[from, to] : leaders) replace_uses(fn, from, leader(to));
+    }
+
+
+   private:
+    static bool is_pure(inst_type t) {
+      switch (t) {
+        case inst_type::add:
+        case inst_type::sub:
+        case inst_type::mul:
+        case inst_type::div:
+        case inst_type::invert:
+        case inst_type::cast:
+        case inst_type::lt:
+        case inst_type::le:
+        case inst_type::gt:
+        case inst_type::ge:
+        case inst_type::eq:
+        case inst_type::ne:
+        // boxes are never written to, so unboxing the same one twice gives
+        // the same value
+        case inst_type::unbox:
+          return true;
+        default:
+          return false;
+      }
+    }
+
+    static bool is_commutative(inst_type t) {
+      return t == inst_type::add || t == inst_type::mul ||
+             t == inst_type::eq || t == inst_type::ne;
+    }
+
+
+    static bool is_location(value *v) {
+      auto *i = dynamic_cast<instruction *>(v);
+      if (i == nullptr) return false;
+      auto t = i->get_inst_type();
+      return t == inst_type::alloc || t == inst_type::global ||
+             t == inst_type::poparg;
+    }
+
+
+    vn_key load_key(value *loc) { return {inst_type::load, epoch, {loc}}; }
+
+
+    void number(instruction *i) {
+      for (auto &a : i->args) a = leader(a);
+
+      auto op = i->get_inst_type();
+
+      if (is_pure(op)) {
+        vn_key k{op, 0, {i->args.begin(), i->args.end()}};
+        if (is_commutative(op)) std::sort(k.args.begin(), k.args.end());
+        if (auto *v = avail.lookup(k); v != nullptr) {
+          leaders[i] = v;
+        } else {
+          avail.set(k, i);
+        }
+        return;
+      }
+
+      if (op == inst_type::load) {
+        auto k = load_key(i->args[0]);
+        if (auto *v = avail.lookup(k); v != nullptr) {
+          leaders[i] = v;
+        } else {
+          avail.set(k, i);
+        }
+        return;
+      }
+
+      if (op == inst_type::store) {
+        auto *dst = i->args[0];
+        if (is_location(dst)) {
+          // the stored value is now what any load of dst would produce
+          avail.set(load_key(dst), i->args[1]);
+        } else {
+          // no idea where this writes, so forget everything we know
+          epoch = ++next_epoch;
+        }
+        return;
+      }
+
+      // calls can run closures that write to any of our locations
+      if (op == inst_type::call) {
+        epoch = ++next_epoch;
+        return;
+      }
+    }
+
+
+    void visit(block *b) {
+      auto m = avail.mark();
+
+      // memory is only known on entry if there is exactly one way in, and
+      // that is from the immediate dominator we just came from
+      if (preds[b->get_id()].size() != 1) epoch = ++next_epoch;
+
+      for (auto *i : b->get_insts()) number(i);
+      if (b->terminated()) {
+        for (auto &a : b->get_terminator()->args) a = leader(a);
+      }
+
+      int exit_epoch = epoch;
+      for (auto *c : dt.get_children(b)) {
+        epoch = exit_epoch;
+        visit(c);
+      }
+
+      avail.rollback(m);
+    }
+  };
+}  // namespace
+
+
+
+
+bool iir::gvn(func &fn) {
+  gvn_state s(fn);
+  s.run(fn);
+  return s.changed;
+}
@@ -6,6 +6,10 @@
 #include <helion/core.h>
 #include <helion/gc.h>
 #include <helion/iir.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 
 
 using namespace helion;
@@ -17,10 +21,45 @@ using namespace helion::iir;
 // some common types
 type *iir::int_type = nullptr;
 type *iir::float_type = nullptr;
+type *iir::int8_type = nullptr;
+type *iir::int16_type = nullptr;
+type *iir::int32_type = nullptr;
+type *iir::int64_type = nullptr;
+type *iir::float32_type = nullptr;
+type *iir::float64_type = nullptr;
 
 void helion::init_iir(void) {
-  int_type = gc::make_collected<named_type>("Int");
-  float_type = gc::make_collected<named_type>("Float");
+  int_type = intern_type("Int");
+  float_type = intern_type("Float");
+  int8_type = intern_type("Int8");
+  int16_type = intern_type("Int16");
+  int32_type = intern_type("Int32");
+  int64_type = intern_type("Int64");
+  float32_type = intern_type("Float32");
+  float64_type = intern_type("Float64");
+}
+
+
+
+// ground types are interned, so the numeric ones can be told apart by address
+num_kind iir::numeric_kind(type *t) {
+  t = infer::find(t);
+  if (t == int_type || t == int8_type || t == int16_type || t == int32_type ||
+      t == int64_type)
+    return num_kind::integer;
+  if (t == float_type || t == float32_type || t == float64_type)
+    return num_kind::floating;
+  return num_kind::none;
+}
+
+
+int iir::numeric_bits(type *t) {
+  t = infer::find(t);
+  if (t == int8_type) return 8;
+  if (t == int16_type) return 16;
+  if (t == int32_type || t == float32_type) return 32;
+  if (is_numeric(t)) return 64;
+  return 0;
 }
 
 
@@ -49,20 +88,33 @@ value *iir::new_float(double v) {
 }
 
 
+void const_flt::print(std::ostream &s, bool, int) {
+  // print the shortest representation that reads back as the same double,
+  // and always make it look like a float so it isn't read back as an int
+  char buf[32];
+  for (int prec = 1; prec <= 17; prec++) {
+    snprintf(buf, sizeof(buf), "%.*g", prec, val);
+    if (strtod(buf, nullptr) == val) break;
+  }
+  s << buf;
+  if (strpbrk(buf, ".eni") == nullptr) s << ".0";
+}
 
-std::atomic<int> next_inst_uid = 0;
 
+
+// uids only have to be unique inside of a function, so they come from the
+// function and lowering functions on different threads doesn't race on them
 instruction::instruction(block &_bb, inst_type t, type &dt, slice<value *> as)
-    : itype(t), bb(_bb) {
-  uid = next_inst_uid++;
+    : itype(t), bb(&_bb), args(inline_ops, inline_operands) {
+  uid = _bb.get_func().next_uid();
   set_type(dt);
   args = as;
 }
 
 
 instruction::instruction(block &_bb, inst_type t, type &dt)
-    : itype(t), bb(_bb) {
-  uid = next_inst_uid++;
+    : itype(t), bb(&_bb), args(inline_ops, inline_operands) {
+  uid = _bb.get_func().next_uid();
   set_type(dt);
 }
 
@@ -88,9 +140,16 @@ void instruction::print(std::ostream &s, bool just_name, int depth) {
     s << ": " << get_type().str() << " = ";
   }
 
+  if (heap) s << "heap ";
+  if (tail) s << "tail ";
   s << inst_type_to_str(itype) << " ";
   for (int i = 0; i < args.size(); i++) {
-    args[i]->print(s, true, depth + 3);
+    // a missing value (like the ret of a body that ends in an if) is Void
+    if (args[i] == nullptr) {
+      s << "null";
+    } else {
+      args[i]->print(s, true, depth + 3);
+    }
     if (i < args.size() - 1) s << ", ";
   }
 }
@@ -99,16 +158,43 @@ void instruction::print(std::ostream &s, bool just_name, int depth) {
 func::func(module &m) : mod(m) {}
 
 block *func::new_block(void) {
-  auto b = gc::make_collected<block>(*this);
+  auto b = mem.make<block>(*this);
   return b;
 }
 
+
+value *func::new_int(size_t v) {
+  auto *e = mem.make<const_int>();
+  e->set_type(*int_type);
+  e->val = v;
+  return e;
+}
+
+
+value *func::new_float(double v) {
+  auto *e = mem.make<const_flt>();
+  e->set_type(*float_type);
+  e->val = v;
+  return e;
+}
+
+
+void func::release(void) {
+  blocks.clear();
+  mem.release();
+}
+
 void func::add_block(block *b) {
   b->id = blocks.size();
   blocks.push_back(b);
 }
 
 void func::print(std::ostream &s, bool just_name, int depth) {
+  if (just_name) {
+    s << "@" << name;
+    return;
+  }
+
   std::string indent = "";
   for (int i = 0; i < depth; i++) indent += " ";
 
@@ -117,7 +203,7 @@ void func::print(std::ostream &s, bool just_name, int depth) {
   } else {
     s << "func ";
   }
-  s << name << "";
+  s << "@" << name << " ";
 
   if (blocks.size() == 0) {
     s << "decl ";
@@ -174,6 +260,20 @@ block::block(func &_fn) : fn(_fn) {}
 
 void block::add_inst(instruction *i) { insts.push_back(i); }
 
+
+std::vector<block *> block::successors(void) {
+  std::vector<block *> succ;
+  if (!terminated()) return succ;
+  for (auto *a : terminator->args) {
+    if (auto *b = dynamic_cast<block *>(a); b != nullptr) {
+      // a conditional branch to the same block twice only has one successor
+      if (std::find(succ.begin(), succ.end(), b) == succ.end())
+        succ.push_back(b);
+    }
+  }
+  return succ;
+}
+
 /**
  * massive ugly function to convert an enum name to a string
  */
@@ -199,6 +299,16 @@ const char *iir::inst_type_to_str(inst_type t) {
     handle(store);
     handle(cast);
     handle(poparg);
+    handle(closure);
+    handle(env);
+    handle(lt);
+    handle(le);
+    handle(gt);
+    handle(ge);
+    handle(eq);
+    handle(ne);
+    handle(box);
+    handle(unbox);
   };
 
 #undef handle
@@ -212,15 +322,16 @@ const char *iir::inst_type_to_str(inst_type t) {
 /*
  * module constructor
  */
-iir::module::module(std::string name) : scope(), name(name) {}
+iir::module::module(std::string name) : scope(), name(name) { mod = this; }
 
 func *iir::module::create_func(std::shared_ptr<ast::func> node) {
   func *fc = gc::make_collected<func>(*this);
   fc->node = node;
-  fc->name = node->name;
+  fc->name = unique_name(node->name, '@');
   fc->intrinsic = false;
   fc->sc = spawn();
   fc->set_type(*convert_type(node->proto->type, fc->sc));
+  add_func(fc);
   return fc;
 }
 
@@ -228,10 +339,56 @@ func *iir::module::create_intrinsic(std::string name,
                                     std::shared_ptr<ast::type_node> tn) {
   func *fc = gc::make_collected<func>(*this);
   fc->node = nullptr;
-  fc->name = name;
+  fc->name = unique_name(name, '@');
   fc->intrinsic = true;
   fc->sc = spawn();
   fc->set_type(*convert_type(tn, fc->sc));
   bind(name, fc);
+  add_func(fc);
   return fc;
 }
+
+
+void iir::module::add_func(func *f) {
+  // lambdas made on a worker are added when its job is committed
+  if (auto *job = lowering_queue::current(); job != nullptr) {
+    job->lambdas.push_back(f);
+    return;
+  }
+  funcs.push_back(f);
+}
+
+
+std::string iir::module::unique_name(std::string base, char sigil) {
+  // workers can't touch the table, so names stay as they are until the job
+  // is committed, which makes them unique in a fixed order
+  if (lowering_queue::current() != nullptr) return base;
+
+  std::string key = sigil + base;
+  if (used_names.count(key) == 0) {
+    used_names[key] = 1;
+    return base;
+  }
+  // the count on the base name is the next suffix to try. Some suffixes may
+  // already be taken by names that were read in, so skip over those
+  int &n = used_names[key];
+  std::string name;
+  do {
+    name = base + "." + std::to_string(n++);
+  } while (used_names.count(sigil + name) != 0);
+  used_names[sigil + name] = 1;
+  return name;
+}
+
+
+void iir::module::print(std::ostream &s) {
+  for (auto *fn : funcs) {
+    fn->print(s);
+    s << "\n";
+  }
+}
+
+
+void iir::module::release(void) {
+  for (auto *fn : funcs) fn->release();
+}
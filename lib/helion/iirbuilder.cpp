@@ -25,10 +25,10 @@ value *iir::builder::create_alloc(type &d) {
 }
 
 void iir::builder::create_ret(value *v) {
-  if (target->terminated()) return;
+  open_target();
   slice<value *> as = {v};
-  target->terminator = gc::make_collected<instruction>(*target, inst_type::ret,
-                                                       new_variable_type(), as);
+  target->terminator = current_func.new_inst(*target, inst_type::ret,
+                                             new_variable_type(), as);
 }
 
 
@@ -38,37 +38,51 @@ instruction *builder::add_inst(instruction *i) {
 }
 
 
-instruction *builder::create_inst(inst_type it, type &dt) {
+// code after a terminator (statements after a return, for example) can never
+// run, but it still has to be lowered somewhere. Instead of dropping it, start
+// a fresh block that nothing jumps to, and let the cfg simplifier delete it
+void builder::open_target(void) {
   assert(target != nullptr);
-  auto i = gc::make_collected<instruction>(*target, it, dt);
+  if (!target->terminated()) return;
+  auto b = new_block("unreachable");
+  insert_block(b);
+  target = b;
+}
+
+
+instruction *builder::create_inst(inst_type it, type &dt) {
+  open_target();
+  auto i = current_func.new_inst(*target, it, dt);
   return add_inst(i);
 }
 
 instruction *builder::create_inst(inst_type it, type &dt, slice<value *> as) {
-  assert(target != nullptr);
-  auto i = gc::make_collected<instruction>(*target, it, dt, as);
+  open_target();
+  auto i = current_func.new_inst(*target, it, dt, as);
   return add_inst(i);
 }
 
 
 
 value *builder::create_binary(inst_type t, value *l, value *r) {
+  // comparisons always produce an integer truth value, whatever they compare
+  if (is_comparison(t)) return create_inst(t, *int_type, {l, r});
   return create_inst(t, new_variable_type(), {l, r});
 }
 
 
 void builder::create_branch(value *cond, block *if_true, block *if_false) {
-  if (target->terminated()) return;
-  slice<value *> as = {if_true, if_false};
-  target->terminator = gc::make_collected<instruction>(*target, inst_type::br,
-                                                       new_variable_type(), as);
+  open_target();
+  slice<value *> as = {cond, if_true, if_false};
+  target->terminator = current_func.new_inst(*target, inst_type::br,
+                                             new_variable_type(), as);
 }
 
 void builder::create_jmp(block *b) {
-  if (target->terminated()) return;
+  open_target();
   slice<value *> as = {b};
-  target->terminator = gc::make_collected<instruction>(*target, inst_type::jmp,
-                                                       new_variable_type(), as);
+  target->terminator = current_func.new_inst(*target, inst_type::jmp,
+                                             new_variable_type(), as);
 }
 
 
@@ -87,6 +101,11 @@ value *builder::create_load(value *from) {
 }
 
 
+value *builder::create_int(size_t v) { return current_func.new_int(v); }
+
+value *builder::create_float(double v) { return current_func.new_float(v); }
+
+
 value *builder::create_poparg(type &t) {
   return create_inst(inst_type::poparg, t, {});
 }
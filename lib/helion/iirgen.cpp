@@ -16,9 +16,9 @@ using namespace helion;
 
 iir::value *ast::number::to_iir(iir::builder &b, iir::scope *sc) {
   if (type == num_type::integer) {
-    return iir::new_int(as.integer);
+    return b.create_int(as.integer);
   } else if (type == num_type::floating) {
-    return iir::new_float(as.floating);
+    return b.create_float(as.floating);
   }
   return nullptr;
 }
@@ -27,7 +27,8 @@ iir::value *ast::number::to_iir(iir::builder &b, iir::scope *sc) {
 
 static iir::value *compile_assign(iir::builder &b, iir::scope *sc,
                                   std::shared_ptr<ast::node> to_n,
-                                  std::shared_ptr<ast::node> val_n) {
+                                  std::shared_ptr<ast::node> val_n,
+                                  iir::inst_type op = iir::inst_type::unknown) {
   using namespace iir;
 
   auto val = val_n->to_iir(b, sc);
@@ -42,6 +43,10 @@ static iir::value *compile_assign(iir::builder &b, iir::scope *sc,
     if (dst == nullptr)
       throw std::logic_error("unable to find var in assignment");
 
+    // compound assignment (x += 1) applies the operator to the old value
+    if (op != inst_type::unknown)
+      val = b.create_binary(op, b.create_load(dst), val);
+
     b.create_store(dst, val);
     return val;
   }
@@ -53,23 +58,34 @@ static iir::value *compile_assign(iir::builder &b, iir::scope *sc,
 
 
 
+static const std::unordered_map<std::string, iir::inst_type> binary_ops = {
+    {"+", iir::inst_type::add}, {"-", iir::inst_type::sub},
+    {"*", iir::inst_type::mul}, {"/", iir::inst_type::div},
+    {"<", iir::inst_type::lt},  {"<=", iir::inst_type::le},
+    {">", iir::inst_type::gt},  {">=", iir::inst_type::ge},
+    {"==", iir::inst_type::eq}, {"!=", iir::inst_type::ne},
+};
+
 
 iir::value *ast::binary_op::to_iir(iir::builder &b, iir::scope *sc) {
   // assignment is a special case of the binary op, as normally destinations
   // return the value of a variable, instead of a reference to its storage
   // location
-  if (this->op == "=") return compile_assign(b, sc, left, right);
+  std::string op = this->op;
+  if (op == "=") return compile_assign(b, sc, left, right);
+  if (op.size() == 2 && op[1] == '=') {
+    auto it = binary_ops.find(op.substr(0, 1));
+    if (it != binary_ops.end() && !iir::is_comparison(it->second))
+      return compile_assign(b, sc, left, right, it->second);
+  }
 
   auto lhs = left->to_iir(b, sc);
   auto rhs = right->to_iir(b, sc);
 
 
 
-
-  if (this->op == "+") return b.create_binary(iir::inst_type::add, rhs, lhs);
-  if (this->op == "-") return b.create_binary(iir::inst_type::sub, rhs, lhs);
-  if (this->op == "*") return b.create_binary(iir::inst_type::mul, rhs, lhs);
-  if (this->op == "/") return b.create_binary(iir::inst_type::div, rhs, lhs);
+  auto it = binary_ops.find(op);
+  if (it != binary_ops.end()) return b.create_binary(it->second, lhs, rhs);
   return nullptr;
 }
 
@@ -125,6 +141,10 @@ iir::value *ast::do_block::to_iir(iir::builder &b, iir::scope *sc) {
 iir::value *ast::return_node::to_iir(iir::builder &b, iir::scope *sc) {
   // to_iir the return value
   auto rv = val->to_iir(b, sc);
+  // returning the result of a call makes it a tail call
+  if (val->as<ast::call *>() != nullptr)
+    if (auto *call = dynamic_cast<iir::instruction *>(rv); call != nullptr)
+      call->tail = true;
   b.create_ret(rv);
   return rv;
 }
@@ -135,17 +155,24 @@ iir::value *ast::type_node::to_iir(iir::builder &b, iir::scope *sc) {
 }
 
 iir::value *ast::var_decl::to_iir(iir::builder &b, iir::scope *sc) {
+  // an annotation (`let x: Int8 = ...`) fixes the type of the location, which
+  // is how sized numbers get into a program. Defs carry their function's
+  // signature here too, but that is already on the function itself
+  iir::type *ty = &iir::new_variable_type();
+  if (type != nullptr && std::dynamic_pointer_cast<ast::func>(value) == nullptr)
+    ty = iir::convert_type(type, sc);
+
   iir::value *dst;
   // if we are in the global scope, make a global
   if (global) {
-    dst = b.create_global(iir::new_variable_type());
-    dst->set_name(name);
+    dst = b.create_global(*ty);
+    dst->set_name(sc->mod->unique_name(name, '%'));
     sc->bind(name, dst);
     return dst;
   }
   auto *v = value->to_iir(b, sc);
-  dst = b.create_alloc(iir::new_variable_type());
-  dst->set_name(name);
+  dst = b.create_alloc(*ty);
+  dst->set_name(sc->mod->unique_name(name, '%'));
 
   sc->bind(name, dst);
   b.create_store(dst, v);
@@ -169,14 +196,22 @@ iir::value *ast::prototype::to_iir(iir::builder &b, iir::scope *sc) {
 }
 
 
-iir::value *ast::func::to_iir(iir::builder &b, iir::scope *sc) {
+iir::func *ast::func::declare(iir::scope *sc) {
   auto *fn = gc::make_collected<iir::func>(*sc->mod);
+  fn->name = sc->mod->unique_name(name == "" ? "lambda" : name, '@');
+  sc->mod->add_func(fn);
 
+  fn->sc = sc->spawn();
+  fn->set_type(*iir::convert_type(this->proto->type, fn->sc));
+  return fn;
+}
+
+
+void ast::func::lower(iir::func *fn) {
   iir::builder b2(*fn);
-  auto ns = sc->spawn();
+  auto ns = fn->sc;
 
   auto bb = fn->new_block();
-  fn->set_type(*iir::convert_type(this->proto->type, ns));
   fn->add_block(bb);
   b2.set_target(bb);
 
@@ -184,7 +219,7 @@ iir::value *ast::func::to_iir(iir::builder &b, iir::scope *sc) {
     std::string name = arg->name;
     auto ty = iir::convert_type(arg->type, ns);
     auto pop = b2.create_poparg(*ty);
-    pop->set_name(name);
+    pop->set_name(ns->mod->unique_name(name, '%'));
     ns->bind(name, pop);
   }
 
@@ -199,7 +234,12 @@ iir::value *ast::func::to_iir(iir::builder &b, iir::scope *sc) {
   } else {
     stmt->to_iir(b2, ns);
   }
+}
 
+
+iir::value *ast::func::to_iir(iir::builder &b, iir::scope *sc) {
+  auto *fn = declare(sc);
+  lower(fn);
   return fn;
 }
 
@@ -209,7 +249,6 @@ iir::value *ast::def::to_iir(iir::builder &b, iir::scope *sc) {
 }
 
 iir::value *ast::if_node::to_iir(iir::builder &b, iir::scope *sc) {
-  puts(str());
   auto cond_val = cond->to_iir(b, sc);
 
 
@@ -253,6 +292,69 @@ iir::value *ast::if_node::to_iir(iir::builder &b, iir::scope *sc) {
 }
 
 
+/*
+ * loops lower to a condition block that the end of the body jumps back to:
+ *
+ *     jmp &cond
+ *   &cond:
+ *     br <cond>, &body, &exit
+ *   &body:
+ *     ...
+ *     jmp &cond
+ *   &exit:
+ */
+iir::value *ast::while_node::to_iir(iir::builder &b, iir::scope *sc) {
+  auto cond_bb = b.new_block("while_cond");
+  auto body_bb = b.new_block("while_body");
+  auto exit_bb = b.new_block("while_exit");
+
+  b.create_jmp(cond_bb);
+  b.insert_block(cond_bb);
+  b.set_target(cond_bb);
+  b.create_branch(cond->to_iir(b, sc), body_bb, exit_bb);
+
+  b.insert_block(body_bb);
+  b.set_target(body_bb);
+  body->to_iir(b, sc);
+  b.create_jmp(cond_bb);
+
+  b.insert_block(exit_bb);
+  b.set_target(exit_bb);
+  return nullptr;
+}
+
+
+iir::value *ast::for_node::to_iir(iir::builder &b, iir::scope *sc) {
+  // the loop's variables go away when it ends
+  auto ns = sc->spawn();
+  init->to_iir(b, ns);
+
+  auto cond_bb = b.new_block("for_cond");
+  auto body_bb = b.new_block("for_body");
+  auto step_bb = b.new_block("for_step");
+  auto exit_bb = b.new_block("for_exit");
+
+  b.create_jmp(cond_bb);
+  b.insert_block(cond_bb);
+  b.set_target(cond_bb);
+  b.create_branch(cond->to_iir(b, ns), body_bb, exit_bb);
+
+  b.insert_block(body_bb);
+  b.set_target(body_bb);
+  body->to_iir(b, ns);
+  b.create_jmp(step_bb);
+
+  b.insert_block(step_bb);
+  b.set_target(step_bb);
+  step->to_iir(b, ns);
+  b.create_jmp(cond_bb);
+
+  b.insert_block(exit_bb);
+  b.set_target(exit_bb);
+  return nullptr;
+}
+
+
 iir::value *ast::typedef_node::to_iir(iir::builder &b, iir::scope *sc) {
   return nullptr;
 }
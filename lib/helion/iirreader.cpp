@@ -0,0 +1,422 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <ctype.h>
+#include <helion/ast.h>
+#include <helion/core.h>
+#include <helion/gc.h>
+#include <helion/iir.h>
+#include <helion/parser.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+/*
+ * reads back the text that module::print writes. The format is line based:
+ *
+ *     func @name (a, b) -> c      a function. `decl` goes before the type
+ *       &bb.0:                    if it has no body, and intrinsics start
+ *         %x: a = poparg          with `intrinsic` instead of `func`
+ *         %y: b = poparg
+ *         %1: c = call @f, %x, 2
+ *         ret %1
+ *
+ * operands are `%value`, `&block.id`, `@func`, integer and float constants or
+ * `null`, for no value at all.
+ * Unnamed instructions are printed with their uid (`%1`), which is only unique
+ * inside of its function, so those names are local to the function they are
+ * in. Values and functions can be used before they are defined, and all of them
+ * are resolved once the whole module has been read. Types use the same syntax
+ * as the language itself, and are converted the same way. Lines starting
+ * with `#` are comments.
+ */
+
+
+
+namespace {
+
+  // a cursor over a single line of the input
+  class line_reader {
+    const std::string &src;
+    size_t i = 0;
+
+   public:
+    int line;
+
+    line_reader(const std::string &src, int line) : src(src), line(line) {}
+
+    [[noreturn]] void fail(std::string msg) { throw read_error(line, msg); }
+
+    void skip_space(void) {
+      while (i < src.size() && isspace(src[i])) i++;
+    }
+
+    bool done(void) {
+      skip_space();
+      return i >= src.size();
+    }
+
+    char peek(void) {
+      skip_space();
+      return i < src.size() ? src[i] : '\0';
+    }
+
+    void expect(char c) {
+      if (peek() != c) fail(std::string("expected '") + c + "'");
+      i++;
+    }
+
+    // a run of characters up to whitespace or one of the stop characters
+    std::string word(const char *stop = ",:") {
+      skip_space();
+      size_t start = i;
+      while (i < src.size() && !isspace(src[i]) && strchr(stop, src[i]) == 0)
+        i++;
+      if (i == start) fail("expected a name");
+      return src.substr(start, i - start);
+    }
+
+    // everything up to (but not including) c, with the spaces trimmed off
+    std::string until(char c) {
+      skip_space();
+      size_t end = src.find(c, i);
+      if (end == std::string::npos) fail(std::string("expected '") + c + "'");
+      auto s = src.substr(i, end - i);
+      i = end;
+      while (!s.empty() && isspace(s.back())) s.pop_back();
+      return s;
+    }
+
+    std::string rest(void) {
+      skip_space();
+      auto s = src.substr(i);
+      i = src.size();
+      while (!s.empty() && isspace(s.back())) s.pop_back();
+      return s;
+    }
+  };
+
+
+
+  class reader {
+    module &mod;
+    func *fn = nullptr;
+    block *bb = nullptr;
+
+    // everything is looked up by the name it was printed with, minus the sigil
+    // (see value_key for uids)
+    std::unordered_map<std::string, value *> values;
+    std::unordered_map<std::string, func *> funcs;
+    std::unordered_set<func *> defined_funcs;
+    // the line each function was first mentioned on, for errors about it
+    std::unordered_map<func *, int> first_use;
+    // the blocks of the current function
+    std::unordered_map<std::string, block *> blocks;
+    std::unordered_set<block *> placed;
+    // generated type variables (z0, z1...) are unique across the module, so
+    // they are shared between functions, unlike ones the user wrote
+    std::unordered_map<std::string, var_type *> generated;
+
+    // operands that refer to values, filled in at the end
+    struct fixup {
+      instruction *inst;
+      int arg;
+      std::string key;
+      std::string name;
+      int line;
+    };
+    std::vector<fixup> fixups;
+    std::vector<instruction *> stores;
+
+    std::unordered_map<std::string, inst_type> opcodes;
+
+   public:
+    reader(module &mod) : mod(mod) {
+      for (int t = 1;; t++) {
+        auto *name = inst_type_to_str((inst_type)t);
+        if (strcmp(name, "unknown") == 0) break;
+        opcodes[name] = (inst_type)t;
+      }
+    }
+
+
+    void read(std::string &text) {
+      std::istringstream in(text);
+      std::string src;
+      int line = 0;
+      while (std::getline(in, src)) {
+        line_reader l(src, ++line);
+        // blank lines and `#` comments, for hand written tests
+        if (l.done() || l.peek() == '#') continue;
+        read_line(l);
+      }
+      end_func(line);
+      resolve();
+    }
+
+
+   private:
+    void read_line(line_reader &l) {
+      auto c = l.peek();
+      if (c == '&') return read_label(l);
+      if (c == '%') return read_inst(l);
+
+      auto kw = l.word();
+      if (kw == "func" || kw == "intrinsic") return read_header(l, kw);
+      if (opcodes.count(kw) != 0 || kw == "heap" || kw == "tail")
+        return read_inst(l, kw);
+      l.fail("unexpected '" + kw + "'");
+    }
+
+
+    // the key a value is stored under. Uids are reused between functions, so
+    // they get the function's name in front of them
+    std::string value_key(std::string &name) {
+      if (!isdigit(name[0])) return name;
+      return "@" + fn->name + "%" + name;
+    }
+
+
+    func *get_func(line_reader &l, std::string &name) {
+      if (funcs.count(name) == 0) {
+        auto *f = gc::make_collected<func>(mod);
+        f->name = name;
+        funcs[name] = f;
+        first_use[f] = l.line;
+      }
+      return funcs[name];
+    }
+
+
+    block *get_block(line_reader &l, std::string &label) {
+      if (fn == nullptr) l.fail("block outside of a function");
+      if (blocks.count(label) == 0) {
+        auto *b = fn->new_block();
+        // the printer calls unnamed blocks `bb`, and adds the id on the end
+        auto name = label.substr(0, label.rfind('.'));
+        if (name != "bb") b->set_name(name);
+        blocks[label] = b;
+      }
+      return blocks[label];
+    }
+
+
+    void end_func(int line) {
+      for (auto &[label, b] : blocks) {
+        if (placed.count(b) == 0)
+          throw read_error(line, "block &" + label + " is never defined");
+      }
+      blocks.clear();
+      placed.clear();
+      fn = nullptr;
+      bb = nullptr;
+    }
+
+
+    // func @name [decl] type
+    void read_header(line_reader &l, std::string &kw) {
+      end_func(l.line);
+
+      l.expect('@');
+      auto name = l.word("");
+      auto *f = get_func(l, name);
+      if (!defined_funcs.insert(f).second) l.fail("redefinition of @" + name);
+      if (mod.unique_name(name, '@') != name) l.fail("@" + name + " is taken");
+
+      auto t = l.rest();
+      if (t.compare(0, 5, "decl ") == 0) t = t.substr(5);
+
+      fn = f;
+      fn->intrinsic = kw == "intrinsic";
+      fn->sc = mod.spawn();
+      fn->set_type(*read_type(l, t));
+      mod.add_func(fn);
+      if (fn->intrinsic) mod.bind(name, fn);
+    }
+
+
+    // &label.id:
+    void read_label(line_reader &l) {
+      l.expect('&');
+      auto label = l.word();
+      l.expect(':');
+      if (!l.done()) l.fail("unexpected text after block label");
+
+      auto *b = get_block(l, label);
+      if (!placed.insert(b).second) l.fail("redefinition of &" + label);
+      fn->add_block(b);
+      bb = b;
+    }
+
+
+    // [%name: type =] [heap] [tail] op arg, arg...
+    void read_inst(line_reader &l, std::string kw = "") {
+      std::string name;
+      type *ty = nullptr;
+      if (kw == "") {
+        l.expect('%');
+        name = l.word();
+        l.expect(':');
+        ty = read_type(l, l.until('='));
+        l.expect('=');
+        kw = l.word();
+      }
+
+      bool heap = false;
+      bool tail = false;
+      if (kw == "heap") {
+        heap = true;
+        kw = l.word();
+      }
+      if (kw == "tail") {
+        tail = true;
+        kw = l.word();
+      }
+      if (opcodes.count(kw) == 0) l.fail("unknown instruction '" + kw + "'");
+      auto op = opcodes[kw];
+
+      if (bb == nullptr) l.fail("instruction outside of a block");
+      if (bb->terminated()) l.fail("instruction after the end of a block");
+
+      bool no_result = op == inst_type::ret || op == inst_type::br ||
+                       op == inst_type::jmp || op == inst_type::store;
+      if (no_result != (ty == nullptr))
+        l.fail(std::string(no_result ? "unexpected" : "missing") +
+               " result for " + kw);
+      if (ty == nullptr) ty = &new_variable_type();
+
+      slice<value *> args;
+      std::vector<std::pair<int, std::string>> refs;
+      while (!l.done()) {
+        if (args.size() != 0) l.expect(',');
+        args.push_back(read_operand(l, refs, args.size()));
+      }
+
+      auto *i = fn->new_inst(*bb, op, *ty, args);
+      i->heap = heap;
+      i->tail = tail;
+      for (auto &[n, ref] : refs)
+        fixups.push_back({i, n, value_key(ref), ref, l.line});
+      if (op == inst_type::store) stores.push_back(i);
+
+      if (name != "") {
+        auto key = value_key(name);
+        if (values.count(key) != 0) l.fail("redefinition of %" + name);
+        values[key] = i;
+        // instructions without a name are printed with their uid, which
+        // they get a new one of
+        if (!isdigit(name[0])) {
+          if (mod.unique_name(name, '%') != name)
+            l.fail("%" + name + " is taken");
+          i->set_name(name);
+        }
+      }
+
+      if (i->is_terminator()) {
+        bb->set_terminator(i);
+      } else {
+        bb->add_inst(i);
+      }
+    }
+
+
+    value *read_operand(line_reader &l,
+                        std::vector<std::pair<int, std::string>> &refs,
+                        int n) {
+      auto c = l.peek();
+      if (c == '%' || c == '&' || c == '@') {
+        l.expect(c);
+        auto name = l.word();
+        if (c == '&') return get_block(l, name);
+        if (c == '@') return get_func(l, name);
+        refs.push_back({n, name});
+        return nullptr;
+      }
+
+      auto tok = l.word();
+      if (tok == "null") return nullptr;
+      char *end = nullptr;
+      if (strpbrk(tok.c_str(), ".eEni") != nullptr) {
+        double d = strtod(tok.c_str(), &end);
+        if (*end != '\0') l.fail("bad float '" + tok + "'");
+        return fn->new_float(d);
+      }
+      size_t v = strtoull(tok.c_str(), &end, 10);
+      if (*end != '\0') l.fail("bad operand '" + tok + "'");
+      return fn->new_int(v);
+    }
+
+
+    type *read_type(line_reader &l, std::string src) {
+      if (src == "") l.fail("expected a type");
+
+      // give each generated type variable a fresh name, so they can't collide
+      // with ones made after the module has been read
+      std::string renamed;
+      for (size_t i = 0; i < src.size();) {
+        if (!isalnum(src[i]) && src[i] != '_') {
+          renamed += src[i++];
+          continue;
+        }
+        size_t start = i;
+        while (i < src.size() && (isalnum(src[i]) || src[i] == '_')) i++;
+        auto word = src.substr(start, i - start);
+
+        bool gen = word.size() > 1 && word[0] == 'z';
+        for (size_t c = 1; gen && c < word.size(); c++)
+          gen = isdigit(word[c]);
+        if (gen) {
+          if (generated.count(word) == 0) {
+            auto *v = &new_variable_type();
+            mod.set_vtype(v->name, v);
+            generated[word] = v;
+          }
+          word = generated[word]->name;
+        }
+        renamed += word;
+      }
+
+      try {
+        return convert_type(renamed, fn->sc);
+      } catch (syntax_error &e) {
+        l.fail("bad type '" + src + "'");
+      }
+    }
+
+
+    void resolve(void) {
+      for (auto &f : fixups) {
+        auto it = values.find(f.key);
+        if (it == values.end())
+          throw read_error(f.line, "unknown value %" + f.name);
+        f.inst->args[f.arg] = it->second;
+      }
+
+      // stores have the type of the location they write to
+      for (auto *s : stores) s->set_type(s->args[0]->get_type());
+
+      for (auto &[name, f] : funcs) {
+        if (defined_funcs.count(f) == 0)
+          throw read_error(first_use[f],
+                           "function @" + name + " is never defined");
+      }
+    }
+  };
+}  // namespace
+
+
+
+
+std::unique_ptr<module> iir::read_module(std::string text, std::string name) {
+  auto mod = std::make_unique<module>(name);
+  reader r(*mod);
+  r.read(text);
+  return mod;
+}
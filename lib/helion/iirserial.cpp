@@ -0,0 +1,595 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <helion/gc.h>
+#include <helion/iir.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <functional>
+#include <ostream>
+#include <unordered_map>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+/*
+ * binary iir. A file is a header followed by a handful of tables, each one a
+ * flat array of fixed size records:
+ *
+ *     header     magic, version, and the offset and length of every table
+ *     strings    every name, null terminated, back to back
+ *     types      named and variable types. Parameters of named types are a
+ *                run in the type_params table, and variables refer to the
+ *                type they were bound to (if any)
+ *     funcs      each with a run of blocks
+ *     blocks     each with a run of instructions, and its terminator
+ *     insts      each with a run of operands
+ *     operands   a tagged reference to an instruction, block or function, or
+ *                an inline constant, or null
+ *     globals    operands for module::globals
+ *
+ * everything refers to everything else by index, and tables are found by
+ * their offset from the start of the file, so the data is position
+ * independent. Records are laid out in the host's byte order.
+ */
+
+
+const uint32_t iir::binary_version = 2;
+
+static const char binary_magic[4] = {'H', 'I', 'I', 'R'};
+static const uint32_t none = 0xFFFFFFFF;
+
+
+namespace {
+
+  struct table {
+    uint32_t offset;
+    uint32_t count;
+  };
+
+  struct header {
+    char magic[4];
+    uint32_t version;
+    table strings;
+    table types;
+    table type_params;
+    table funcs;
+    table blocks;
+    table insts;
+    table operands;
+    table globals;
+  };
+
+  enum : uint8_t { type_named, type_var };
+
+  struct type_rec {
+    uint8_t kind;
+    uint8_t pad[3];
+    uint32_t name;
+    // named types: the run of parameters. Variables: what they point to
+    uint32_t first;
+    uint32_t count;
+  };
+
+  enum : uint8_t { func_intrinsic = 1 };
+
+  struct func_rec {
+    uint32_t name;
+    uint32_t type;
+    uint32_t first_block;
+    uint32_t nblocks;
+    uint8_t flags;
+    uint8_t pad[3];
+  };
+
+  struct block_rec {
+    uint32_t name;
+    uint32_t first_inst;
+    uint32_t ninsts;
+    uint32_t terminator;
+  };
+
+  enum : uint8_t { inst_heap = 1, inst_tail = 2 };
+
+  struct inst_rec {
+    uint8_t op;
+    uint8_t flags;
+    uint8_t pad[2];
+    uint32_t name;
+    uint32_t type;
+    uint32_t first_operand;
+    uint32_t noperands;
+  };
+
+  // null operands are legal (a ret of an if expression, a store of nil), and
+  // are kept as they are
+  enum : uint8_t { op_inst, op_block, op_func, op_int, op_float, op_null };
+
+  struct operand_rec {
+    uint8_t kind;
+    uint8_t pad[7];
+    // an index for references, or the bits of a constant
+    uint64_t val;
+  };
+
+  static_assert(sizeof(type_rec) == 16, "binary iir layout changed");
+  static_assert(sizeof(func_rec) == 20, "binary iir layout changed");
+  static_assert(sizeof(block_rec) == 16, "binary iir layout changed");
+  static_assert(sizeof(inst_rec) == 20, "binary iir layout changed");
+  static_assert(sizeof(operand_rec) == 16, "binary iir layout changed");
+
+
+
+
+  class writer {
+    module &mod;
+
+    std::string strings;
+    std::unordered_map<std::string, uint32_t> string_index;
+
+    std::vector<type_rec> types;
+    std::vector<uint32_t> type_params;
+    std::unordered_map<type *, uint32_t> type_index;
+
+    std::vector<func_rec> funcs;
+    std::vector<block_rec> blocks;
+    std::vector<inst_rec> insts;
+    std::vector<operand_rec> operands;
+    std::vector<operand_rec> globals;
+
+    std::unordered_map<value *, uint32_t> index;
+
+   public:
+    writer(module &mod) : mod(mod) { str(""); }
+
+
+    void write(std::ostream &out) {
+      number();
+      for (auto *fn : mod.funcs) emit(*fn);
+      for (auto *g : mod.globals) globals.push_back(operand(g));
+
+      header h;
+      memset(&h, 0, sizeof(h));
+      memcpy(h.magic, binary_magic, sizeof(h.magic));
+      h.version = binary_version;
+
+      // lay the tables out one after another, each aligned to 8 bytes
+      std::string body;
+      auto place = [&](table &t, const void *data, size_t size, size_t n) {
+        while ((sizeof(header) + body.size()) % 8 != 0) body += '\0';
+        t.offset = sizeof(header) + body.size();
+        t.count = n;
+        body.append((const char *)data, size * n);
+      };
+      place(h.strings, strings.data(), 1, strings.size());
+      place(h.types, types.data(), sizeof(type_rec), types.size());
+      place(h.type_params, type_params.data(), sizeof(uint32_t),
+            type_params.size());
+      place(h.funcs, funcs.data(), sizeof(func_rec), funcs.size());
+      place(h.blocks, blocks.data(), sizeof(block_rec), blocks.size());
+      place(h.insts, insts.data(), sizeof(inst_rec), insts.size());
+      place(h.operands, operands.data(), sizeof(operand_rec), operands.size());
+      place(h.globals, globals.data(), sizeof(operand_rec), globals.size());
+
+      out.write((const char *)&h, sizeof(h));
+      out.write(body.data(), body.size());
+    }
+
+
+   private:
+    uint32_t str(const std::string &s) {
+      if (auto it = string_index.find(s); it != string_index.end())
+        return it->second;
+      uint32_t off = strings.size();
+      strings += s;
+      strings += '\0';
+      string_index[s] = off;
+      return off;
+    }
+
+
+    // give every function, block and instruction its index up front, so
+    // operands can refer to ones that haven't been written yet
+    void number(void) {
+      uint32_t nfuncs = 0, nblocks = 0, ninsts = 0;
+      for (auto *fn : mod.funcs) {
+        index[fn] = nfuncs++;
+        for (auto *b : fn->get_blocks()) {
+          index[b] = nblocks++;
+          for (auto *i : b->get_insts()) index[i] = ninsts++;
+          if (b->terminated()) index[b->get_terminator()] = ninsts++;
+        }
+      }
+    }
+
+
+    uint32_t add_type(type *t) {
+      if (auto it = type_index.find(t); it != type_index.end())
+        return it->second;
+
+      uint32_t n = types.size();
+      type_index[t] = n;
+      types.push_back({});
+
+      type_rec r;
+      memset(&r, 0, sizeof(r));
+      if (auto *v = t->as_var(); v != nullptr) {
+        r.kind = type_var;
+        r.name = str(v->name);
+        r.first = none;
+        if (auto *to = infer::find(v); to != v) r.first = add_type(to);
+      } else {
+        auto *nt = t->as_named();
+        r.kind = type_named;
+        r.name = str(nt->name);
+        // parameters are added first, as they can add parameter runs of
+        // their own
+        std::vector<uint32_t> ps;
+        for (auto *p : nt->params) ps.push_back(add_type(p));
+        r.first = type_params.size();
+        r.count = ps.size();
+        for (auto p : ps) type_params.push_back(p);
+      }
+      types[n] = r;
+      return n;
+    }
+
+
+    operand_rec operand(value *v) {
+      operand_rec r;
+      memset(&r, 0, sizeof(r));
+      if (v == nullptr) {
+        r.kind = op_null;
+      } else if (auto *c = dynamic_cast<const_int *>(v); c != nullptr) {
+        r.kind = op_int;
+        r.val = c->val;
+      } else if (auto *c = dynamic_cast<const_flt *>(v); c != nullptr) {
+        r.kind = op_float;
+        memcpy(&r.val, &c->val, sizeof(double));
+      } else {
+        if (index.count(v) == 0)
+          throw binary_error("operand refers to a value outside the module");
+        r.val = index[v];
+        if (dynamic_cast<instruction *>(v) != nullptr) {
+          r.kind = op_inst;
+        } else if (dynamic_cast<block *>(v) != nullptr) {
+          r.kind = op_block;
+        } else {
+          r.kind = op_func;
+        }
+      }
+      return r;
+    }
+
+
+    void emit(instruction *i) {
+      inst_rec r;
+      memset(&r, 0, sizeof(r));
+      r.op = (uint8_t)i->get_inst_type();
+      r.flags = (i->heap ? inst_heap : 0) | (i->tail ? inst_tail : 0);
+      r.name = str(i->get_name());
+      r.type = add_type(&i->get_type());
+      r.first_operand = operands.size();
+      r.noperands = i->args.size();
+      for (auto *a : i->args) operands.push_back(operand(a));
+      insts.push_back(r);
+    }
+
+
+    void emit(func &fn) {
+      func_rec r;
+      memset(&r, 0, sizeof(r));
+      r.name = str(fn.name);
+      r.type = add_type(&fn.get_type());
+      r.flags = fn.intrinsic ? func_intrinsic : 0;
+      r.first_block = blocks.size();
+      r.nblocks = fn.get_blocks().size();
+      funcs.push_back(r);
+
+      for (auto *b : fn.get_blocks()) {
+        block_rec br;
+        br.name = str(b->get_name());
+        br.first_inst = insts.size();
+        br.ninsts = b->get_insts().size();
+        br.terminator = none;
+        for (auto *i : b->get_insts()) emit(i);
+        if (b->terminated()) {
+          br.terminator = insts.size();
+          emit(b->get_terminator());
+        }
+        blocks.push_back(br);
+      }
+    }
+  };
+
+
+
+
+  class loader {
+    module &mod;
+    const char *data;
+    size_t size;
+    const header *h;
+
+    std::vector<type *> types;
+    std::vector<func *> funcs;
+    std::vector<block *> blocks;
+    std::vector<instruction *> insts;
+
+   public:
+    loader(module &mod, const char *data, size_t size)
+        : mod(mod), data(data), size(size) {}
+
+
+    void load(void) {
+      if (size < sizeof(header)) throw binary_error("truncated header");
+      h = (const header *)data;
+      if (memcmp(h->magic, binary_magic, sizeof(h->magic)) != 0)
+        throw binary_error("not a binary iir file");
+      if (h->version != binary_version)
+        throw binary_error("binary iir version " + std::to_string(h->version) +
+                           ", expected " + std::to_string(binary_version));
+
+      load_types();
+      load_funcs();
+      load_insts();
+
+      auto *gs = get<operand_rec>(h->globals);
+      for (uint32_t i = 0; i < h->globals.count; i++)
+        mod.globals.push_back(operand(gs[i], nullptr));
+    }
+
+
+   private:
+    // the records of a table, after checking they are all in bounds
+    template <typename T>
+    const T *get(const table &t) {
+      if (t.offset % alignof(T) != 0 || t.offset > size ||
+          (size - t.offset) / sizeof(T) < t.count)
+        throw binary_error("table out of bounds");
+      return (const T *)(data + t.offset);
+    }
+
+
+    static void check(uint32_t i, size_t n, const char *what) {
+      if (i >= n) throw binary_error(std::string("bad ") + what + " index");
+    }
+
+
+    static void check_run(uint32_t first, uint32_t count, size_t n,
+                          const char *what) {
+      if (first > n || n - first < count)
+        throw binary_error(std::string("bad ") + what + " run");
+    }
+
+
+    std::string str(uint32_t off) {
+      auto *s = get<char>(h->strings);
+      check(off, h->strings.count, "string");
+      auto *end = (const char *)memchr(s + off, 0, h->strings.count - off);
+      if (end == nullptr) throw binary_error("unterminated string");
+      return std::string(s + off, end);
+    }
+
+
+    // type variables the compiler made up (z0, z1...) are renamed so they
+    // can't be confused with ones made after loading
+    static bool is_generated(std::string &name) {
+      if (name.size() < 2 || name[0] != 'z') return false;
+      for (size_t i = 1; i < name.size(); i++)
+        if (!isdigit(name[i])) return false;
+      return true;
+    }
+
+
+    void load_types(void) {
+      auto *recs = get<type_rec>(h->types);
+      auto *params = get<uint32_t>(h->type_params);
+      size_t n = h->types.count;
+
+      // named types are built after their parameters so ground types can be
+      // interned. Variables are made up front, as they can be bound to types
+      // that refer back to them
+      types.assign(n, nullptr);
+      for (size_t i = 0; i < n; i++) {
+        auto name = str(recs[i].name);
+        if (recs[i].kind == type_var) {
+          if (is_generated(name)) {
+            types[i] = &new_variable_type();
+          } else {
+            types[i] = gc::make_collected<var_type>(name);
+          }
+        } else if (recs[i].kind != type_named) {
+          throw binary_error("bad type kind");
+        }
+      }
+
+      std::vector<bool> building(n, false);
+      std::function<type *(uint32_t)> build = [&](uint32_t i) -> type * {
+        check(i, n, "type");
+        if (types[i] != nullptr) return types[i];
+        if (building[i]) throw binary_error("recursive type");
+        building[i] = true;
+
+        auto &r = recs[i];
+        check_run(r.first, r.count, h->type_params.count, "type parameter");
+        std::vector<type *> ps;
+        for (uint32_t p = r.first; p < r.first + r.count; p++)
+          ps.push_back(build(params[p]));
+        types[i] = intern_type(str(r.name), ps);
+        return types[i];
+      };
+
+      for (size_t i = 0; i < n; i++) build(i);
+
+      for (size_t i = 0; i < n; i++) {
+        auto &r = recs[i];
+        if (r.kind != type_var || r.first == none) continue;
+        infer::do_union(types[i]->as_var(), build(r.first));
+      }
+    }
+
+
+    type &get_type(uint32_t i) {
+      check(i, types.size(), "type");
+      return *types[i];
+    }
+
+
+    void load_funcs(void) {
+      auto *recs = get<func_rec>(h->funcs);
+      auto *brecs = get<block_rec>(h->blocks);
+
+      for (uint32_t i = 0; i < h->funcs.count; i++) {
+        auto &r = recs[i];
+        auto *fn = gc::make_collected<func>(mod);
+        auto name = str(r.name);
+        fn->name = mod.unique_name(name, '@');
+        fn->intrinsic = (r.flags & func_intrinsic) != 0;
+        fn->sc = mod.spawn();
+        fn->set_type(get_type(r.type));
+        mod.add_func(fn);
+        if (fn->intrinsic) mod.bind(name, fn);
+        funcs.push_back(fn);
+
+        check_run(r.first_block, r.nblocks, h->blocks.count, "block");
+        for (uint32_t b = r.first_block; b < r.first_block + r.nblocks; b++) {
+          auto *nb = fn->new_block();
+          nb->set_name(str(brecs[b].name));
+          fn->add_block(nb);
+          blocks.push_back(nb);
+        }
+      }
+      if (blocks.size() != h->blocks.count)
+        throw binary_error("blocks not owned by any function");
+    }
+
+
+    value *operand(const operand_rec &r, func *fn) {
+      switch (r.kind) {
+        case op_inst:
+          check(r.val, insts.size(), "instruction");
+          return insts[r.val];
+        case op_block:
+          check(r.val, blocks.size(), "block");
+          return blocks[r.val];
+        case op_func:
+          check(r.val, funcs.size(), "function");
+          return funcs[r.val];
+        case op_int:
+          return fn != nullptr ? fn->new_int(r.val) : new_int(r.val);
+        case op_float: {
+          double d;
+          memcpy(&d, &r.val, sizeof(double));
+          return fn != nullptr ? fn->new_float(d) : new_float(d);
+        }
+        case op_null:
+          return nullptr;
+      }
+      throw binary_error("bad operand kind");
+    }
+
+
+    void load_insts(void) {
+      auto *brecs = get<block_rec>(h->blocks);
+      auto *irecs = get<inst_rec>(h->insts);
+      auto *orecs = get<operand_rec>(h->operands);
+
+      // instructions are in block order, so make them all before filling in
+      // operands, which can refer forward
+      std::vector<const inst_rec *> recs;
+      for (uint32_t b = 0; b < blocks.size(); b++) {
+        auto &br = brecs[b];
+        auto *bb = blocks[b];
+        check_run(br.first_inst, br.ninsts, h->insts.count, "instruction");
+
+        auto make = [&](uint32_t n) {
+          auto &r = irecs[n];
+          if (n != insts.size())
+            throw binary_error("instructions out of order");
+          auto *op = inst_type_to_str((inst_type)r.op);
+          if (r.op == 0 || strcmp(op, "unknown") == 0)
+            throw binary_error("bad instruction type");
+          auto *i = bb->get_func().new_inst(*bb, (inst_type)r.op,
+                                             get_type(r.type));
+          i->heap = (r.flags & inst_heap) != 0;
+          i->tail = (r.flags & inst_tail) != 0;
+          auto name = str(r.name);
+          if (name != "") i->set_name(mod.unique_name(name, '%'));
+          insts.push_back(i);
+          recs.push_back(&r);
+          return i;
+        };
+
+        for (uint32_t n = br.first_inst; n < br.first_inst + br.ninsts; n++)
+          bb->add_inst(make(n));
+        if (br.terminator != none) {
+          check(br.terminator, h->insts.count, "instruction");
+          bb->set_terminator(make(br.terminator));
+        }
+      }
+
+      for (size_t n = 0; n < insts.size(); n++) {
+        auto &r = *recs[n];
+        auto *i = insts[n];
+        check_run(r.first_operand, r.noperands, h->operands.count, "operand");
+        for (uint32_t o = r.first_operand; o < r.first_operand + r.noperands;
+             o++)
+          i->args.push_back(operand(orecs[o], &i->get_block().get_func()));
+      }
+    }
+  };
+}  // namespace
+
+
+
+
+void iir::write_binary(module &m, std::ostream &out) {
+  writer w(m);
+  w.write(out);
+}
+
+
+
+std::unique_ptr<module> iir::read_binary(const char *data, size_t size,
+                                         std::string name) {
+  auto mod = std::make_unique<module>(name);
+  loader l(*mod, data, size);
+  l.load();
+  return mod;
+}
+
+
+
+std::unique_ptr<module> iir::read_binary_file(std::string path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) throw binary_error("unable to open " + path);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    throw binary_error("unable to read " + path);
+  }
+
+  size_t size = st.st_size;
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) throw binary_error("unable to map " + path);
+
+  // nothing in the module points into the file, so it can be unmapped as
+  // soon as it has been read
+  try {
+    auto mod = read_binary((const char *)data, size, path);
+    munmap(data, size);
+    return mod;
+  } catch (...) {
+    munmap(data, size);
+    throw;
+  }
+}
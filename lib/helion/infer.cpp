@@ -4,6 +4,7 @@
 
 #include <helion/iir.h>
 #include <helion/infer.h>
+#include <helion/passes.h>
 #include <stdexcept>
 
 using namespace helion;
@@ -11,35 +12,179 @@ using namespace helion;
 
 
 
-static bool has_var_type_definition(iir::type *t) {
-  if (t->is_var()) {
-    if (t->as_var()->points_to == t) return true;
+// does the variable occur anywhere in the type
+static bool mentions(iir::type *t, iir::type *var) {
+  t = infer::find(t);
+  if (t == var) return true;
+  if (auto *n = t->as_named(); n != nullptr) {
+    for (auto *p : n->params)
+      if (mentions(p, var)) return true;
   }
+  return false;
+}
+
+
+// find a variable in the return type that the arguments don't determine
+static bool has_var_type_definition(iir::type *t, iir::type *args) {
+  t = infer::find(t);
+  if (t->is_var()) return !mentions(args, t);
 
   if (t->is_named()) {
     auto n = t->as_named();
     for (auto &p : n->params) {
-      if (has_var_type_definition(p)) return true;
+      if (has_var_type_definition(p, args)) return true;
     }
   }
   return false;
 }
 
 
-// find the real type for some type. Basically expands the type
-// variable into its real named variable
-iir::type *infer::find(iir::type *t) {
-  if (t->is_var()) {
-    auto tv = t->as_var();
-    if (tv->points_to != tv) {
-      // tv->points_to = find(tv->points_to);
-      return find(tv->points_to);
+
+infer::unifier &infer::store(void) {
+  static unifier s;
+  if (auto *t = task::current(); t != nullptr) return t->store;
+  return s;
+}
+
+
+void infer::unifier::write(int i, entry e) {
+  if (marks > 0) trail.push_back({i, slots[i]});
+  slots[i] = e;
+}
+
+
+int infer::unifier::index(iir::var_type *v) {
+  if (v->slot < 0) {
+    v->slot = slots.size();
+    slots.push_back({v->slot, 0, level, nullptr, v});
+  }
+  return v->slot;
+}
+
+
+int infer::unifier::root(int i) {
+  int r = i;
+  while (slots[r].parent != r) r = slots[r].parent;
+  // point everything on the way straight at the root
+  while (slots[i].parent != r) {
+    auto e = slots[i];
+    int next = e.parent;
+    e.parent = r;
+    write(i, e);
+    i = next;
+  }
+  return r;
+}
+
+
+iir::type *infer::unifier::find(iir::type *t) {
+  auto *v = t->as_var();
+  while (v != nullptr && v->published != nullptr) {
+    t = v->published;
+    v = t->as_var();
+  }
+  // variables that were never unified are their own class
+  if (v == nullptr || v->slot < 0) return t;
+  auto &e = slots[root(v->slot)];
+  if (e.bound != nullptr) return e.bound;
+  return e.var;
+}
+
+
+void infer::unifier::link(iir::var_type *a, iir::var_type *b) {
+  int ra = root(index(a));
+  int rb = root(index(b));
+  if (ra == rb) return;
+
+  // the shallower tree goes under the deeper one
+  if (slots[ra].rank < slots[rb].rank) std::swap(ra, rb);
+  auto top = slots[ra];
+  auto sub = slots[rb];
+  if (top.rank == sub.rank) top.rank++;
+  top.level = std::min(top.level, sub.level);
+  if (top.bound == nullptr) top.bound = sub.bound;
+  sub.parent = ra;
+  write(ra, top);
+  write(rb, sub);
+}
+
+
+void infer::unifier::bind(iir::var_type *v, iir::type *t) {
+  int r = root(index(v));
+  auto e = slots[r];
+  e.bound = t;
+  write(r, e);
+}
+
+
+int infer::unifier::level_of(iir::var_type *v) {
+  return slots[root(index(v))].level;
+}
+
+
+void infer::unifier::adjust(iir::var_type *v, int l) {
+  int r = root(index(v));
+  if (slots[r].level <= l) return;
+  auto e = slots[r];
+  e.level = l;
+  write(r, e);
+}
+
+
+void infer::unifier::make_generic(iir::var_type *v) {
+  int r = root(index(v));
+  auto e = slots[r];
+  e.level = generic;
+  write(r, e);
+}
+
+
+void infer::unifier::publish(void) {
+  for (auto &e : slots) {
+    auto *v = e.var;
+    auto *t = find(v);
+    if (t != v) {
+      v->published = t;
+    } else if (slots[root(v->slot)].level == generic) {
+      v->generic = true;
     }
   }
-  return t;
+  // only once everything is published, as finding needs the slots
+  for (auto &e : slots) e.var->slot = -1;
+  slots.clear();
+  trail.clear();
+}
+
+
+size_t infer::unifier::mark(void) {
+  marks++;
+  return trail.size();
+}
+
+
+void infer::unifier::rollback(size_t m) {
+  while (trail.size() > m) {
+    auto &[i, e] = trail.back();
+    slots[i] = e;
+    trail.pop_back();
+  }
+  marks--;
+}
+
+
+void infer::unifier::release(size_t m) {
+  marks--;
+  // the outermost mark has nothing left to roll back to
+  if (marks == 0) trail.clear();
 }
 
 
+
+// find the real type for some type. Basically expands the type
+// variable into its real named variable
+iir::type *infer::find(iir::type *t) { return store().find(t); }
+
+
 static bool is_arrow(iir::type *t) {
   if (!t->is_named()) return false;
   auto n = t->as_named();
@@ -49,7 +194,7 @@ static bool is_arrow(iir::type *t) {
 
 static bool occurs(iir::var_type *ta, iir::type *tb) {
   auto t = infer::find(tb);
-  if (t->is_var()) return *ta == *tb;
+  if (t->is_var()) return t == infer::find(ta);
   if (t->is_named()) {
     auto n = t->as_named();
     for (auto &p : n->params) {
@@ -62,12 +207,33 @@ static bool occurs(iir::var_type *ta, iir::type *tb) {
 
 
 
+static void adjust_levels(iir::type *t, int l) {
+  t = infer::find(t);
+  if (auto *v = t->as_var(); v != nullptr) {
+    infer::store().adjust(v, l);
+    return;
+  }
+  auto *n = t->as_named();
+  // ground types don't have any variables to adjust
+  if (n->interned) return;
+  for (auto *p : n->params) adjust_levels(p, l);
+}
+
+
+
 void infer::do_union(iir::var_type *ta, iir::type *tb) {
-  if (*ta == *tb) return;
+  auto t = find(tb);
+  if (find(ta) == t) return;
+  if (t->is_var()) {
+    store().link(ta, t->as_var());
+    return;
+  }
   // check for recursive types, can't quite do that yet
-  if (occurs(ta, tb))
+  if (occurs(ta, t))
     throw infer::unify_error(ta, tb, "recursive type breaks unification");
-  ta->points_to = tb;
+  // whatever ta is bound to can't be generalized any deeper than ta can be
+  adjust_levels(t, store().level_of(ta));
+  store().bind(ta, t);
 }
 
 
@@ -115,23 +281,19 @@ void infer::unify(iir::type *ta, iir::type *tb) {
 
 
   if (t1->is_var() && t2->is_var()) {
-    auto tv = t1->as_var();
-    tv->points_to = t2;
+    store().link(t1->as_var(), t2->as_var());
     return;
   }
 
 
 
   if (t1->is_var()) {
-    auto tv = t1->as_var();
-    puts("here");
-    do_union(tv, t2);
+    do_union(t1->as_var(), t2);
     return;
   }
 
   if (t2->is_var()) {
-    auto tv = t2->as_var();
-    do_union(tv, t1);
+    do_union(t2->as_var(), t1);
     return;
   }
 
@@ -140,6 +302,72 @@ void infer::unify(iir::type *ta, iir::type *tb) {
 
 
 
+bool infer::try_unify(iir::type *ta, iir::type *tb) {
+  auto &s = store();
+  auto m = s.mark();
+  try {
+    unify(ta, tb);
+  } catch (infer::unify_error &) {
+    s.rollback(m);
+    return false;
+  }
+  s.release(m);
+  return true;
+}
+
+
+
+void infer::generalize(iir::type *t) {
+  t = find(t);
+  auto &s = store();
+  if (auto *v = t->as_var(); v != nullptr) {
+    if (v->generic) return;
+    int l = s.level_of(v);
+    if (l > s.level && l != unifier::generic) s.make_generic(v);
+    return;
+  }
+  auto *n = t->as_named();
+  if (n->interned) return;
+  for (auto *p : n->params) generalize(p);
+}
+
+
+static iir::type *inst(iir::type *t,
+                       std::unordered_map<iir::type *, iir::type *> &fresh) {
+  t = infer::find(t);
+  auto &s = infer::store();
+  if (auto *v = t->as_var(); v != nullptr) {
+    // variables published by another task carry their own flag
+    bool generic = v->generic ||
+                   (v->slot >= 0 && s.level_of(v) == infer::unifier::generic);
+    if (!generic) return t;
+    if (auto it = fresh.find(t); it != fresh.end()) return it->second;
+    auto *n = &iir::new_variable_type();
+    s.index(n);
+    fresh[t] = n;
+    return n;
+  }
+
+  auto *n = t->as_named();
+  if (n->interned) return t;
+  bool same = true;
+  std::vector<iir::type *> params;
+  for (auto *p : n->params) {
+    params.push_back(inst(p, fresh));
+    if (params.back() != p) same = false;
+  }
+  if (same) return t;
+  return iir::intern_type(n->name, params);
+}
+
+
+iir::type *infer::inst(iir::type *t) {
+  std::unordered_map<iir::type *, iir::type *> fresh;
+  return ::inst(t, fresh);
+}
+
+
+
 // the constant values are the easiest to work with
 infer::deduction iir::const_int::deduce(infer::context &) {
   return {iir::int_type};
@@ -150,15 +378,61 @@ infer::deduction iir::const_flt::deduce(infer::context &) {
 
 
 
+// numeric constants don't have a width of their own. One used where a sized
+// type of the same kind is expected takes that type on (so `x + 1` stays an
+// Int8 when x is one), and is only its default type (Int or Float) anywhere
+// else. Lowering materializes a constant at the type of the position it is in
+static bool is_constant(iir::value *v) {
+  return dynamic_cast<iir::const_int *>(v) != nullptr ||
+         dynamic_cast<iir::const_flt *>(v) != nullptr;
+}
+
+
+static void unify_value(infer::context &gamma, iir::value *v, iir::type *t) {
+  // a null operand (nil, or the value of a body that ends in an if) says
+  // nothing about the type of where it goes
+  if (v == nullptr) return;
+  if (is_constant(v)) {
+    auto kind = iir::numeric_kind(&v->get_type());
+    if (iir::numeric_kind(t) == kind) return;
+  }
+  auto d = v->deduce(gamma);
+  infer::unify(d.type != nullptr ? d.type : &v->get_type(), t);
+}
+
+
+
 static infer::deduction deduce_ret(infer::context &gamma,
                                    iir::instruction *ins) {
   // returns need to know about the return type of their function, and therefore
   // will try to unify the return type of the function with the value of this
   // expression
   auto val = ins->args[0];
-  auto vd = val->deduce(gamma);
-  infer::unify(vd.type, gamma.fn->return_type());
-  return vd;
+  unify_value(gamma, val, gamma.fn->return_type());
+  return {gamma.fn->return_type()};
+}
+
+
+
+// arithmetic works on two values of the same type, and produces another.
+// Comparisons take two of the same type too, but always produce an Int
+static infer::deduction deduce_arith(infer::context &gamma,
+                                     iir::instruction *ins) {
+  auto *t = &ins->get_type();
+  if (iir::is_comparison(ins->get_inst_type())) t = &iir::new_variable_type();
+  gamma.set(ins, &ins->get_type());
+
+  try {
+    // everything that isn't a constant decides the type first, so the
+    // constants know what they are being used as
+    for (auto *a : ins->args)
+      if (!is_constant(a)) unify_value(gamma, a, t);
+    for (auto *a : ins->args)
+      if (is_constant(a)) unify_value(gamma, a, t);
+  } catch (infer::unify_error &e) {
+    die("UNIFICATION OF ARITHMETIC FAILED");
+  }
+  return {&ins->get_type()};
 }
 
 
@@ -168,7 +442,7 @@ static infer::deduction deduce_ret(infer::context &gamma,
 // allocating for
 static infer::deduction deduce_alloc(infer::context &gamma,
                                      iir::instruction *ins) {
-  gamma[ins] = &ins->get_type();
+  gamma.set(ins, &ins->get_type());
   return {&ins->get_type()};
 }
 
@@ -178,18 +452,13 @@ static infer::deduction deduce_store(infer::context &gamma,
   auto dst = ins->args[0];
   auto src = ins->args[1];
 
-  auto src_ded = src->deduce(gamma);
-
-  auto dst_type = &dst->get_type();
-  auto src_type = src_ded.type;
-
   try {
-    infer::unify(dst_type, src_type);
+    unify_value(gamma, src, &dst->get_type());
   } catch (infer::unify_error &e) {
     die("UNIFICATION OF STORE FAILED");
   }
 
-  gamma[ins] = &dst->get_type();
+  gamma.set(ins, &dst->get_type());
   return {&dst->get_type()};
 }
 
@@ -197,9 +466,17 @@ static infer::deduction deduce_store(infer::context &gamma,
 
 static infer::deduction deduce_load(infer::context &gamma,
                                     iir::instruction *ins) {
+  // loading a location that only ever holds one function is a reference to
+  // that function, which gets an instance of its type like any other
+  if (auto *f = gamma.resolve(ins); f != nullptr) {
+    auto d = f->deduce(gamma);
+    gamma.set(ins, d.type);
+    return d;
+  }
+
   auto src = ins->args[0];
   src->deduce(gamma);
-  gamma[ins] = &src->get_type();
+  gamma.set(ins, &src->get_type());
   return {&src->get_type()};
 }
 
@@ -208,14 +485,37 @@ static infer::deduction deduce_load(infer::context &gamma,
 
 static infer::deduction deduce_call(infer::context &gamma,
                                     iir::instruction *ins) {
-  // create an un-scoped variable type to represent the return type
-  // of the function. We will unify this to figure out what it should be in the
-  // end
-  auto ret_type = &iir::new_variable_type();
-
+  // the type of the call is the variable the builder gave it. The callee is
+  // unified with a function from the arguments to it, one argument at a time
+  // as functions are curried. Polymorphic callees come back from deduce as a
+  // fresh instance, so each call site can pick its own types
+  auto ret_type = &ins->get_type();
+  gamma.set(ins, ret_type);
+
+  auto type_of = [&](iir::value *v) -> iir::type * {
+    if (v == nullptr) return &iir::new_variable_type();
+    auto d = v->deduce(gamma);
+    return d.type != nullptr ? d.type : &v->get_type();
+  };
+
+  std::vector<iir::type *> args;
+  for (size_t i = 1; i < ins->args.size(); i++)
+    args.push_back(type_of(ins->args[i]));
+  // functions without arguments take Void
+  if (args.size() == 0) args.push_back(iir::intern_type("Void"));
 
+  try {
+    auto *fn = type_of(ins->args[0]);
+    for (size_t i = 0; i < args.size(); i++) {
+      iir::type *res = ret_type;
+      if (i != args.size() - 1) res = &iir::new_variable_type();
+      infer::unify(fn, iir::intern_type("->", {args[i], res}));
+      fn = res;
+    }
+  } catch (infer::unify_error &e) {
+    die("UNIFICATION OF CALL FAILED");
+  }
 
-  gamma[ins] = ret_type;
   return {ret_type};
 }
 
@@ -224,7 +524,7 @@ static infer::deduction deduce_call(infer::context &gamma,
 infer::deduction iir::instruction::deduce(infer::context &gamma) {
   // if this instruction has already been analyzied, simply return the old value
   // case 1 in Algorithm W
-  if (gamma.count(this) != 0) return {gamma.at(this)};
+  if (auto *t = gamma.lookup(this); t != nullptr) return {t};
 
   switch (itype) {
     case inst_type::ret:
@@ -245,17 +545,34 @@ infer::deduction iir::instruction::deduce(infer::context &gamma) {
     case inst_type::call:
       return deduce_call(gamma, this);
 
-    case inst_type::br:
-    case inst_type::jmp:
-    case inst_type::global:
     case inst_type::add:
     case inst_type::sub:
     case inst_type::mul:
     case inst_type::div:
     case inst_type::invert:
-    case inst_type::dot:
-    case inst_type::cast:
+    case inst_type::lt:
+    case inst_type::le:
+    case inst_type::gt:
+    case inst_type::ge:
+    case inst_type::eq:
+    case inst_type::ne:
+      return deduce_arith(gamma, this);
+
+    // these are exactly the type they were made with. A cast is how a value
+    // changes from one numeric type to another
     case inst_type::poparg:
+    case inst_type::cast:
+    case inst_type::box:
+    case inst_type::unbox:
+      gamma.set(this, &get_type());
+      return {&get_type()};
+
+    case inst_type::br:
+    case inst_type::jmp:
+    case inst_type::global:
+    case inst_type::dot:
+    case inst_type::closure:
+    case inst_type::env:
 
     default:
       return {};
@@ -268,7 +585,7 @@ infer::deduction iir::block::deduce(infer::context &gamma) {
   infer::subs S;
   for (auto &inst : this->insts) {
     auto ded = inst->deduce(gamma);
-    gamma[inst] = ded.type;
+    gamma.set(inst, ded.type);
     for (auto &sub : ded.S) {
       S.push_back(sub);
     }
@@ -284,30 +601,121 @@ infer::deduction iir::block::deduce(infer::context &gamma) {
 }
 
 
-infer::deduction iir::func::deduce(infer::context &G) {
-  infer::context gamma;
-  gamma.fn = this;
+static void touch(iir::type *t) {
+  t = infer::find(t);
+  if (auto *v = t->as_var(); v != nullptr) {
+    infer::store().index(v);
+    return;
+  }
+  for (auto *p : t->as_named()->params) touch(p);
+}
 
+
+infer::deduction iir::func::deduce(infer::context &G) {
+  // functions are let-bound. Their type is generalized once the body has been
+  // inferred, and every reference gets its own instance of it
+  auto &root = G.root();
+  if (auto *t = root.lookup(this); t != nullptr) return {infer::inst(t)};
+
+  // references from inside the body (recursion) see the type before it is
+  // generalized, so they are monomorphic
+  root.set(this, &get_type());
+
+  auto &s = infer::store();
+  s.enter();
+  // variables in the signature that the body never touches still belong to
+  // this level
+  touch(&get_type());
+  infer::context gamma(this);
+  gamma.parent = &G;
   for (auto &b : this->blocks) {
     b->deduce(gamma);
   }
-  G[this] = &get_type();
+  s.leave();
 
 
+  auto args = get_type().as_named()->params[0];
   auto ret = get_type().as_named()->params[1];
 
-  if (has_var_type_definition(ret)) {
+  if (has_var_type_definition(ret, args)) {
     puts("Cannot declare type variable in return type");
     throw infer::analyze_failure(this);
   }
 
+  infer::generalize(&get_type());
+  return {infer::inst(&get_type())};
+}
+
+
+
+infer::context::context(iir::func *fn) : insts(fn->num_uids(), nullptr), fn(fn) {}
+
+
+iir::type **infer::context::slot(iir::instruction *i) {
+  if (fn == nullptr || &i->get_block().get_func() != fn) return nullptr;
+  size_t id = i->get_uid();
+  // instructions can be made after the table was sized
+  if (id >= insts.size()) insts.resize(fn->num_uids(), nullptr);
+  return &insts[id];
+}
+
+
+iir::type *infer::context::lookup(iir::instruction *i) {
+  if (auto *s = slot(i); s != nullptr) return *s;
+  auto it = others.find(i);
+  return it == others.end() ? nullptr : it->second;
+}
+
+
+iir::type *infer::context::lookup(iir::value *v) {
+  if (auto *i = dynamic_cast<iir::instruction *>(v); i != nullptr)
+    return lookup(i);
+  for (auto *c = this; c != nullptr; c = c->parent) {
+    auto it = c->others.find(v);
+    if (it != c->others.end()) return it->second;
+  }
+  return nullptr;
+}
+
+
+void infer::context::set(iir::instruction *i, iir::type *t) {
+  if (auto *s = slot(i); s != nullptr) {
+    *s = t;
+    return;
+  }
+  others[i] = t;
+}
+
 
-  // TODO:
-  // run over all the blocks and do some kind of substitution i guess
+void infer::context::set(iir::value *v, iir::type *t) {
+  if (auto *i = dynamic_cast<iir::instruction *>(v); i != nullptr)
+    return set(i, t);
+  others[v] = t;
+}
+
+
+
+infer::context &infer::context::root(void) {
+  auto *c = this;
+  while (c->parent != nullptr && !c->parent->frozen) c = c->parent;
+  return *c;
+}
 
-  return {&get_type()};
+
+iir::func *infer::context::resolve(iir::value *v) {
+  for (auto *c = this; c != nullptr; c = c->parent) {
+    if (c->callees != nullptr) return c->callees->resolve(v);
+  }
+  return nullptr;
 }
 
 
+void infer::context::merge_into(context &c) {
+  for (auto &[v, t] : others) c.others[v] = t;
+  others.clear();
+}
 
-void infer::context::apply_subs(subs &S) { puts("applying subs"); }
+
+void infer::context::apply_subs(subs &S) {
+  for (auto &sub : S) do_union(sub.from, sub.to);
+}
@@ -0,0 +1,385 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/iir.h>
+#include <helion/passes.h>
+#include <unordered_map>
+#include <unordered_set>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+/*
+ * the inliner works directly on iir, before type inference. A call is
+ * inlined if its callee can be pinned down to a single function (either the
+ * call is to a function value directly, like an immediately applied lambda,
+ * or it loads a location that is only ever assigned one function) and that
+ * function is cheap enough.
+ *
+ * calls are split like this:
+ *
+ *     before...               before...
+ *     %r = call @f, %a   =>   %res = alloc
+ *     after...                jmp &f.entry
+ *                           &f.entry: (cloned body of f, where each ret v
+ *                                      becomes `store %res, v; jmp &cont`)
+ *                           &cont:
+ *                             %r = load %res
+ *                             after...
+ */
+
+
+int iir::inline_threshold = 40;
+
+// the most rounds of inlining done into a single function, so that chains of
+// small helpers get flattened without risking runaway growth
+static const int max_inline_rounds = 4;
+
+
+
+// the number of instructions in a function, which is the cost model
+static int func_size(func &fn) {
+  int n = 0;
+  for (auto *b : fn.get_blocks()) {
+    n += b->get_insts().size();
+    if (b->terminated()) n++;
+  }
+  return n;
+}
+
+
+static func *owner_of(value *v) {
+  if (auto *i = dynamic_cast<instruction *>(v); i != nullptr)
+    return &i->get_block().get_func();
+  return nullptr;
+}
+
+
+// globals belong to the module's init function, but are visible everywhere
+static bool is_global(value *v) {
+  auto *i = dynamic_cast<instruction *>(v);
+  return i != nullptr && i->get_inst_type() == inst_type::global;
+}
+
+
+template <typename F>
+static void each_inst(func &fn, F cb) {
+  for (auto *b : fn.get_blocks()) {
+    for (auto *i : b->get_insts()) cb(i);
+    if (b->terminated()) cb(b->get_terminator());
+  }
+}
+
+
+
+
+callee_table::callee_table(module &m) {
+  for (auto *fn : m.funcs) each_inst(*fn, [&](instruction *i) { add(i); });
+}
+
+
+void callee_table::add(instruction *i) {
+  for (auto *a : i->args) {
+    if (dynamic_cast<func *>(a) != nullptr) refs[a]++;
+  }
+  if (i->get_inst_type() == inst_type::load) loads[i->args[0]]++;
+  if (i->get_inst_type() != inst_type::store) return;
+  auto *dst = i->args[0];
+  stores[dst]++;
+  stored[dst] = i->args[1];
+  if (dynamic_cast<func *>(i->args[1]) != nullptr)
+    homes[i->args[1]].push_back(dst);
+}
+
+
+void callee_table::remove(instruction *i) {
+  for (auto *a : i->args) {
+    if (dynamic_cast<func *>(a) != nullptr) refs[a]--;
+  }
+  if (i->get_inst_type() == inst_type::load) loads[i->args[0]]--;
+}
+
+
+
+func *callee_table::resolve(value *v) {
+  if (auto *f = dynamic_cast<func *>(v); f != nullptr) return f;
+
+  auto *i = dynamic_cast<instruction *>(v);
+  if (i == nullptr || i->get_inst_type() != inst_type::load) return nullptr;
+
+  // only locations that are written exactly once have a known value
+  auto *loc = i->args[0];
+  auto it = stored.find(loc);
+  if (it == stored.end() || stores[loc] != 1) return nullptr;
+  return dynamic_cast<func *>(it->second);
+}
+
+
+
+int callee_table::uses(func *f) {
+  auto it = refs.find(f);
+  int n = it == refs.end() ? 0 : it->second;
+
+  // a function stored to a known location (every top level function, in
+  // its global) is used wherever that location is loaded, not by the store
+  if (auto h = homes.find(f); h != homes.end()) {
+    for (auto *loc : h->second)
+      if (stores[loc] == 1) n += loads[loc] - 1;
+  }
+  return n;
+}
+
+
+
+
+namespace {
+
+  class inliner {
+    func &caller;
+    callee_table &callees;
+
+   public:
+    inliner(func &caller, callee_table &callees)
+        : caller(caller), callees(callees) {}
+
+
+    // determine if a function can be inlined into the caller at all, without
+    // regard to the cost
+    bool can_inline(func *callee, int nargs) {
+      if (callee == &caller || callee->intrinsic) return false;
+      if (callee->get_blocks().size() == 0) return false;
+
+      int popargs = 0;
+      bool ok = true;
+      each_inst(*callee, [&](instruction *i) {
+        if (i->get_inst_type() == inst_type::poparg) popargs++;
+
+        for (auto *a : i->args) {
+          // the body can only refer to values of its own, or to values the
+          // caller can also see (like closing over the caller's locals)
+          auto *owner = owner_of(a);
+          if (owner != nullptr && owner != callee && owner != &caller &&
+              !is_global(a))
+            ok = false;
+
+          // nested closures that capture the callee's own locals would be
+          // left pointing at the original body
+          if (auto *nested = dynamic_cast<func *>(a); nested != nullptr) {
+            if (captures_from(*nested, callee)) ok = false;
+          }
+        }
+
+        // recursive functions are never inlined
+        if (i->get_inst_type() == inst_type::call &&
+            callees.resolve(i->args[0]) == callee)
+          ok = false;
+      });
+      return ok && popargs == nargs;
+    }
+
+
+    bool worth_inlining(func *callee) {
+      // a function with no other uses (immediately applied lambdas, for
+      // example) doesn't grow the code when inlined, so it always is
+      if (callees.uses(callee) <= 1) return true;
+      return func_size(*callee) <= inline_threshold;
+    }
+
+
+    bool run(void) {
+      bool changed = false;
+      for (int round = 0; round < max_inline_rounds; round++) {
+        // snapshot the call sites, as inlining rewrites the block list
+        std::vector<instruction *> calls;
+        each_inst(caller, [&](instruction *i) {
+          if (i->get_inst_type() == inst_type::call) calls.push_back(i);
+        });
+
+        bool round_changed = false;
+        for (auto *call : calls) {
+          auto *callee = callees.resolve(call->args[0]);
+          if (callee == nullptr) continue;
+          if (!can_inline(callee, call->args.size() - 1)) continue;
+          if (!worth_inlining(callee)) continue;
+          inline_call(call, callee);
+          round_changed = true;
+        }
+        if (!round_changed) break;
+        changed = true;
+      }
+      return changed;
+    }
+
+
+   private:
+    static bool captures_from(func &nested, func *owner) {
+      std::unordered_set<func *> seen;
+      return captures_from(nested, owner, seen);
+    }
+
+    static bool captures_from(func &nested, func *owner,
+                              std::unordered_set<func *> &seen) {
+      if (!seen.insert(&nested).second) return false;
+      bool found = false;
+      each_inst(nested, [&](instruction *i) {
+        for (auto *a : i->args) {
+          if (owner_of(a) == owner) found = true;
+          if (auto *n = dynamic_cast<func *>(a); n != nullptr)
+            if (captures_from(*n, owner, seen)) found = true;
+        }
+      });
+      return found;
+    }
+
+
+    void inline_call(instruction *call, func *callee) {
+      auto &bb = call->get_block();
+
+      // split the calling block at the call. Everything after it moves into
+      // the continuation block
+      auto *cont = caller.new_block();
+      cont->set_name("inline_cont");
+
+      slice<instruction *> before;
+      bool seen = false;
+      for (auto *i : bb.get_insts()) {
+        if (i == call) {
+          seen = true;
+          continue;
+        }
+        if (seen) {
+          i->set_block(*cont);
+          cont->add_inst(i);
+        } else {
+          before.push_back(i);
+        }
+      }
+      bb.get_insts() = before;
+      if (bb.terminated()) bb.get_terminator()->set_block(*cont);
+      cont->set_terminator(bb.get_terminator());
+      bb.set_terminator(nullptr);
+
+      // the types of the body are copied with fresh type variables, so every
+      // inlined copy can be inferred independently of the others
+      std::unordered_map<type *, type *> fresh;
+      std::unordered_map<value *, value *> vmap;
+
+      auto *result = caller.new_inst(
+          bb, inst_type::alloc, *clone_type(callee->return_type(), fresh));
+      bb.add_inst(result);
+
+      // clone the blocks first, so branches can be remapped
+      std::vector<block *> clones;
+      for (auto *b : callee->get_blocks()) {
+        auto *nb = caller.new_block();
+        nb->set_name(b->get_name() == "" ? "inlined" : b->get_name());
+        vmap[b] = nb;
+        clones.push_back(nb);
+      }
+
+      int argi = 1;
+      for (size_t n = 0; n < clones.size(); n++) {
+        auto *from = callee->get_blocks()[n];
+        auto *to = clones[n];
+        for (auto *i : from->get_insts()) {
+          // arguments are popped in order. A poparg is a location the body
+          // loads from (and can even store to), so each one becomes a local
+          // in the caller initialized with the call's operand
+          if (i->get_inst_type() == inst_type::poparg) {
+            auto *slot = caller.new_inst(
+                bb, inst_type::alloc, *clone_type(&i->get_type(), fresh));
+            slice<value *> sargs = {slot, call->args[argi++]};
+            bb.add_inst(slot);
+            bb.add_inst(caller.new_inst(
+                bb, inst_type::store, slot->get_type(), sargs));
+            vmap[i] = slot;
+            continue;
+          }
+          auto *ni = caller.new_inst(
+              *to, i->get_inst_type(), *clone_type(&i->get_type(), fresh),
+              i->args);
+          vmap[i] = ni;
+          to->add_inst(ni);
+        }
+
+        // a body that falls off its end returns nothing. That is stored
+        // like any other result, as the result is only zeroed once per
+        // frame, and the call may be in a loop
+        if (!from->terminated()) {
+          slice<value *> sargs = {result, nullptr};
+          to->add_inst(caller.new_inst(
+              *to, inst_type::store, result->get_type(), sargs));
+          slice<value *> jargs = {cont};
+          to->set_terminator(
+              caller.new_inst(*to, inst_type::jmp, new_variable_type(), jargs));
+          continue;
+        }
+        auto *t = from->get_terminator();
+        if (t->get_inst_type() == inst_type::ret) {
+          // returns store to the result and continue after the call
+          slice<value *> sargs = {result, t->args[0]};
+          to->add_inst(caller.new_inst(
+              *to, inst_type::store, result->get_type(), sargs));
+          slice<value *> jargs = {cont};
+          to->set_terminator(
+              caller.new_inst(*to, inst_type::jmp, t->get_type(), jargs));
+        } else {
+          to->set_terminator(caller.new_inst(
+              *to, t->get_inst_type(), t->get_type(), t->args));
+        }
+      }
+
+      // now that every value has a copy, point the operands at them
+      for (auto *nb : clones) {
+        each_inst_in(nb, [&](instruction *i) {
+          for (auto &a : i->args) {
+            if (auto it = vmap.find(a); it != vmap.end()) a = it->second;
+          }
+        });
+      }
+
+      slice<value *> jargs = {clones[0]};
+      bb.set_terminator(
+          caller.new_inst(bb, inst_type::jmp, new_variable_type(), jargs));
+
+      for (auto *nb : clones) caller.add_block(nb);
+      caller.add_block(cont);
+
+      // the call's value is whatever ended up in the result
+      slice<value *> largs = {result};
+      auto *load =
+          caller.new_inst(*cont, inst_type::load, result->get_type(), largs);
+      slice<instruction *> cinsts = {load};
+      for (auto *i : cont->get_insts()) cinsts.push_back(i);
+      cont->get_insts() = cinsts;
+      replace_uses(caller, call, load);
+
+      // everything new goes in the table, so the next round (and the next
+      // caller) can resolve through the stores of the arguments
+      callees.remove(call);
+      for (int n = before.size(); n < bb.get_insts().size(); n++)
+        callees.add(bb.get_insts()[n]);
+      for (auto *nb : clones)
+        each_inst_in(nb, [&](instruction *i) { callees.add(i); });
+      callees.add(load);
+    }
+
+
+    template <typename F>
+    static void each_inst_in(block *b, F cb) {
+      for (auto *i : b->get_insts()) cb(i);
+      if (b->terminated()) cb(b->get_terminator());
+    }
+  };
+}  // namespace
+
+
+
+
+bool iir::inline_calls(func &fn, callee_table &callees) {
+  if (fn.get_blocks().size() == 0) return false;
+  inliner in(fn, callees);
+  return in.run();
+}
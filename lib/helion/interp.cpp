@@ -0,0 +1,583 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <alloca.h>
+#include <helion/gc.h>
+#include <helion/iir.h>
+#include <helion/passes.h>
+#include <helion/vm.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+
+using namespace helion;
+using namespace helion::vm;
+
+
+/*
+ * the tier 0 interpreter. The first time a function is called, its iir is
+ * flattened into an array of ops over a register file: one register per
+ * instruction, with the constants, functions and globals it uses preloaded
+ * into the registers in front of them. Blocks are laid out in reverse
+ * postorder, so a jump to an op that comes earlier is a back edge.
+ *
+ * each op holds the address of the code that runs it (direct threading), so
+ * dispatch is a single indirect jump with no switch or bounds check. Ops are
+ * also specialized ahead of time on whether they work on integers or floats,
+ * and sized integers are sign extended back into shape by a separate op
+ * after the arithmetic that needs it.
+ */
+
+
+static word to_word(double d) {
+  word w;
+  memcpy(&w, &d, sizeof(w));
+  return w;
+}
+
+
+
+namespace {
+
+  class linearizer {
+    function &fn;
+    iir::func &ir;
+    machine &m;
+    code &c;
+    const void *const *labels;
+
+    std::unordered_map<iir::value *, int32_t> regs;
+    std::unordered_map<iir::block *, int32_t> starts;
+    // fields of ops that jump to a block that might not be placed yet
+    struct fixup {
+      size_t index;
+      int32_t op::*field;
+      iir::block *target;
+    };
+    std::vector<fixup> fixups;
+    int next_arg = 0;
+
+   public:
+    linearizer(function &fn, code &c, const void *const *labels)
+        : fn(fn), ir(*fn.ir), m(*fn.owner), c(c), labels(labels) {}
+
+
+    void run(void) {
+      auto order = iir::reverse_postorder(ir);
+
+      // the instructions each get a register after the constants, but the
+      // constants are only found while emitting, so registers are numbered
+      // from the top down and moved into place once everything is known
+      int32_t ninsts = 0;
+      for (auto *b : order) {
+        for (auto *i : b->get_insts()) {
+          if (i->get_inst_type() != iir::inst_type::global)
+            regs[i] = -(++ninsts);
+        }
+      }
+
+      for (auto *b : order) {
+        starts[b] = c.ops.size();
+        for (auto *i : b->get_insts()) emit(i);
+        if (b->terminated()) {
+          emit(b->get_terminator());
+        } else {
+          add(op_retz);
+        }
+      }
+
+      for (auto &f : fixups) {
+        auto &o = c.ops[f.index];
+        int32_t target = starts[f.target];
+        o.*f.field = target;
+        // jumps and branches that can go backwards are counted
+        if (target > (int32_t)f.index) continue;
+        if (o.kind == op_jmp) o.kind = op_loop;
+        if (o.kind == op_br) o.kind = op_br_loop;
+        o.run = labels[o.kind];
+      }
+
+      // move the instruction registers to just after the constants. Nothing
+      // else an op holds (targets, counts, indices) is ever negative
+      int32_t base = c.consts.size();
+      auto fix = [&](int32_t &r) {
+        if (r < 0) r = base + (-r - 1);
+      };
+      for (auto &o : c.ops) {
+        fix(o.dst);
+        fix(o.a);
+        fix(o.b);
+      }
+      for (auto &r : c.lists) fix(r);
+      c.nregs = base + ninsts;
+    }
+
+
+   private:
+    op &add(opcode k, int32_t dst = 0, int32_t a = 0, int32_t b = 0,
+            int32_t cc = 0) {
+      c.ops.push_back({labels[k], k, dst, a, b, cc});
+      return c.ops.back();
+    }
+
+    int32_t constant(word w) {
+      c.consts.push_back(w);
+      return c.consts.size() - 1;
+    }
+
+
+    int32_t reg(iir::value *v) {
+      if (auto it = regs.find(v); it != regs.end()) return it->second;
+
+      int32_t r;
+      // a null operand is Void, like the ret of a body that ends in an if
+      if (v == nullptr) {
+        r = constant(0);
+      } else if (auto *i = dynamic_cast<iir::const_int *>(v); i != nullptr) {
+        r = constant(i->val);
+      } else if (auto *f = dynamic_cast<iir::const_flt *>(v); f != nullptr) {
+        r = constant(to_word(f->val));
+      } else if (auto *f = dynamic_cast<iir::func *>(v); f != nullptr) {
+        r = constant((word)m.get(f)->plain);
+      } else if (auto *i = dynamic_cast<iir::instruction *>(v);
+                 i != nullptr && i->get_inst_type() == iir::inst_type::global) {
+        r = constant((word)m.global(i));
+      } else {
+        throw std::logic_error("@" + ir.name + " refers to a value the " +
+                               "interpreter can't see");
+      }
+      regs[v] = r;
+      return r;
+    }
+
+
+    void fail(std::string msg) {
+      c.messages.push_back(msg);
+      add(op_fail, 0, c.messages.size() - 1);
+    }
+
+
+    static bool floating(iir::value *v) {
+      return iir::numeric_kind(&v->get_type()) == iir::num_kind::floating;
+    }
+
+    // put a result back into the shape of its type
+    void narrow(int32_t r, iir::type *t) {
+      int bits = iir::numeric_bits(t);
+      if (bits == 0 || bits == 64) return;
+      if (iir::numeric_kind(t) == iir::num_kind::floating) {
+        add(op_round32, r, r);
+      } else {
+        add(op_sext, r, r, bits);
+      }
+    }
+
+
+    void emit(iir::instruction *i) {
+      using iir::inst_type;
+      auto t = i->get_inst_type();
+      int32_t dst = t == inst_type::global ? 0 : regs[i];
+      auto arg = [&](int n) { return reg(i->args[n]); };
+
+      switch (t) {
+        case inst_type::add:
+        case inst_type::sub:
+        case inst_type::mul:
+        case inst_type::div: {
+          bool f = floating(i);
+          static const opcode ints[] = {op_add_i, op_sub_i, op_mul_i,
+                                        op_div_i};
+          static const opcode flts[] = {op_add_f, op_sub_f, op_mul_f,
+                                        op_div_f};
+          int n = (int)t - (int)inst_type::add;
+          add(f ? flts[n] : ints[n], dst, arg(0), arg(1));
+          narrow(dst, &i->get_type());
+          return;
+        }
+
+        case inst_type::invert:
+          add(floating(i) ? op_neg_f : op_neg_i, dst, arg(0));
+          narrow(dst, &i->get_type());
+          return;
+
+        case inst_type::lt:
+        case inst_type::le:
+        case inst_type::gt:
+        case inst_type::ge:
+        case inst_type::eq:
+        case inst_type::ne: {
+          bool f = floating(i->args[0]) || floating(i->args[1]);
+          int n = (int)t - (int)inst_type::lt;
+          add((opcode)((f ? op_lt_f : op_lt_i) + n), dst, arg(0), arg(1));
+          return;
+        }
+
+        case inst_type::cast: {
+          bool from = floating(i->args[0]), to = floating(i);
+          if (from == to) {
+            add(op_move, dst, arg(0));
+          } else {
+            add(to ? op_i2f : op_f2i, dst, arg(0));
+          }
+          narrow(dst, &i->get_type());
+          return;
+        }
+
+        case inst_type::global:
+          // globals are preloaded as a constant holding their location
+          return;
+
+        case inst_type::alloc:
+          if (i->heap) {
+            add(op_halloc, dst);
+          } else {
+            add(op_alloc, dst, c.nlocals++);
+          }
+          return;
+
+        case inst_type::poparg:
+          // arguments that outlive the call are copied into a cell of their own
+          add(i->heap ? op_hpoparg : op_poparg, dst, next_arg++);
+          return;
+
+        case inst_type::env: {
+          auto *n = dynamic_cast<iir::const_int *>(i->args[0]);
+          if (n == nullptr) return fail("env without a constant index");
+          add(op_env, dst, n->val);
+          return;
+        }
+
+        case inst_type::load:
+          add(op_load, dst, arg(0));
+          return;
+
+        case inst_type::store:
+          add(op_store, 0, arg(0), arg(1));
+          return;
+
+        case inst_type::closure: {
+          int32_t start = c.lists.size();
+          for (size_t n = 0; n < (size_t)i->args.size(); n++)
+            c.lists.push_back(arg(n));
+          int32_t count = i->args.size() - 2;
+          int32_t where = -1;
+          if (!i->heap) {
+            where = c.nlocals;
+            c.nlocals += 2 + count;
+          }
+          add(op_closure, dst, start, count, where);
+          return;
+        }
+
+        case inst_type::call: {
+          int32_t callee = arg(0);
+          int32_t start = c.lists.size();
+          for (size_t n = 1; n < (size_t)i->args.size(); n++)
+            c.lists.push_back(arg(n));
+          add(op_call, dst, callee, start, i->args.size() - 1);
+          c.nargs = std::max<int>(c.nargs, i->args.size() - 1);
+          return;
+        }
+
+        case inst_type::box:
+          add(op_box, dst, arg(0));
+          return;
+
+        case inst_type::unbox:
+          add(op_unbox, dst, arg(0));
+          return;
+
+        case inst_type::ret:
+          add(op_ret, 0, arg(0));
+          return;
+
+        case inst_type::jmp:
+          jump(add(op_jmp), &op::a, i->args[0]);
+          return;
+
+        case inst_type::br: {
+          add(op_br, 0, arg(0));
+          jump(c.ops.back(), &op::b, i->args[1]);
+          jump(c.ops.back(), &op::c, i->args[2]);
+          return;
+        }
+
+        default:
+          return fail(std::string("can't interpret ") +
+                      iir::inst_type_to_str(t) + " in @" + ir.name);
+      }
+    }
+
+
+    void jump(op &o, int32_t op::*field, iir::value *target) {
+      auto *b = dynamic_cast<iir::block *>(target);
+      if (b == nullptr) throw std::logic_error("jump to something not a block");
+      fixups.push_back({(size_t)(&o - c.ops.data()), field, b});
+    }
+  };
+}  // namespace
+
+
+
+static code *prepare(function &fn, const void *const *labels) {
+  std::lock_guard<std::mutex> guard(fn.linear_lock);
+  if (auto *c = fn.linear.load(std::memory_order_acquire); c != nullptr)
+    return c;
+
+  auto *c = new code();
+  try {
+    linearizer l(fn, *c, labels);
+    l.run();
+  } catch (std::logic_error &e) {
+    fail(e.what());
+  }
+  fn.linear.store(c, std::memory_order_release);
+  return c;
+}
+
+
+
+static inline word sext(word w, int bits) {
+  int shift = 64 - bits;
+  return (word)(((int64_t)(w << shift)) >> shift);
+}
+
+static inline double as_f(word w) {
+  double d;
+  memcpy(&d, &w, sizeof(d));
+  return d;
+}
+
+
+
+word vm::interpret(closure *self, word *args) {
+  // in the same order as the opcodes
+  static const void *const labels[num_opcodes] = {
+      &&add_i,  &&sub_i,   &&mul_i,  &&div_i,   &&neg_i,   &&add_f,
+      &&sub_f,  &&mul_f,   &&div_f,  &&neg_f,   &&lt_i,    &&le_i,
+      &&gt_i,   &&ge_i,    &&eq_i,   &&ne_i,    &&lt_f,    &&le_f,
+      &&gt_f,   &&ge_f,    &&eq_f,   &&ne_f,    &&sext,    &&round32,
+      &&i2f,    &&f2i,     &&move,   &&load,    &&store,   &&alloc,
+      &&halloc, &&poparg,  &&hpoparg, &&env,    &&closure, &&call,
+      &&box,    &&unbox,   &&jmp,     &&loop,   &&br,      &&br_loop,
+      &&ret,    &&retz,    &&fail,
+  };
+
+  auto &fn = *self->fn;
+  auto &m = *fn.owner;
+  code *c = fn.linear.load(std::memory_order_acquire);
+  if (c == nullptr) c = prepare(fn, labels);
+
+  // after the linear form is made, as the baseline compiler works from it
+  fn.calls.fetch_add(1, std::memory_order_relaxed);
+  m.tick(fn);
+
+  // frames live on the native stack, where the collector sees them
+  word *r = (word *)alloca(sizeof(word) * std::max(c->nregs, 1));
+  memcpy(r, c->consts.data(), sizeof(word) * c->consts.size());
+  word *locals = (word *)alloca(sizeof(word) * std::max(c->nlocals, 1));
+  memset(locals, 0, sizeof(word) * c->nlocals);
+  // calls are made one at a time, so they can all pass arguments in the same
+  // array. The callee can write to it, which is why it isn't shared further
+  word *argv = (word *)alloca(sizeof(word) * std::max(c->nargs, 1));
+
+  const op *ops = c->ops.data();
+  const op *pc = ops;
+
+#define NEXT goto *(++pc)->run
+#define JUMP(n)       \
+  do {                \
+    pc = ops + (n);   \
+    goto *pc->run;    \
+  } while (0)
+#define A r[pc->a]
+#define B r[pc->b]
+#define D r[pc->dst]
+#define INT(x) ((int64_t)(x))
+#define FLT_OP(expr) D = to_word(expr)
+
+  goto *pc->run;
+
+add_i:
+  D = A + B;
+  NEXT;
+sub_i:
+  D = A - B;
+  NEXT;
+mul_i:
+  D = A * B;
+  NEXT;
+div_i:
+  if (B == 0) vm::fail("division by zero");
+  D = INT(A) / INT(B);
+  NEXT;
+neg_i:
+  D = -A;
+  NEXT;
+add_f:
+  FLT_OP(as_f(A) + as_f(B));
+  NEXT;
+sub_f:
+  FLT_OP(as_f(A) - as_f(B));
+  NEXT;
+mul_f:
+  FLT_OP(as_f(A) * as_f(B));
+  NEXT;
+div_f:
+  FLT_OP(as_f(A) / as_f(B));
+  NEXT;
+neg_f:
+  FLT_OP(-as_f(A));
+  NEXT;
+
+lt_i:
+  D = INT(A) < INT(B);
+  NEXT;
+le_i:
+  D = INT(A) <= INT(B);
+  NEXT;
+gt_i:
+  D = INT(A) > INT(B);
+  NEXT;
+ge_i:
+  D = INT(A) >= INT(B);
+  NEXT;
+eq_i:
+  D = A == B;
+  NEXT;
+ne_i:
+  D = A != B;
+  NEXT;
+lt_f:
+  D = as_f(A) < as_f(B);
+  NEXT;
+le_f:
+  D = as_f(A) <= as_f(B);
+  NEXT;
+gt_f:
+  D = as_f(A) > as_f(B);
+  NEXT;
+ge_f:
+  D = as_f(A) >= as_f(B);
+  NEXT;
+eq_f:
+  D = as_f(A) == as_f(B);
+  NEXT;
+ne_f:
+  D = as_f(A) != as_f(B);
+  NEXT;
+
+sext:
+  D = ::sext(A, pc->b);
+  NEXT;
+round32:
+  FLT_OP((double)(float)as_f(A));
+  NEXT;
+i2f:
+  FLT_OP((double)INT(A));
+  NEXT;
+f2i:
+  D = (word)(int64_t)as_f(A);
+  NEXT;
+move:
+  D = A;
+  NEXT;
+
+load:
+  D = *(word *)A;
+  NEXT;
+store:
+  *(word *)A = B;
+  NEXT;
+alloc:
+  D = (word)&locals[pc->a];
+  NEXT;
+halloc:
+  D = (word)gc::alloc(sizeof(word));
+  *(word *)D = 0;
+  NEXT;
+poparg:
+  D = (word)&args[pc->a];
+  NEXT;
+hpoparg: {
+  auto *cell = (word *)gc::alloc(sizeof(word));
+  *cell = args[pc->a];
+  D = (word)cell;
+  NEXT;
+}
+env:
+  // captures by reference hold the address of the variable, and captures by
+  // copy are the variable
+  if ((self->mask >> pc->a) & 1) {
+    D = self->env[pc->a];
+  } else {
+    D = (word)&self->env[pc->a];
+  }
+  NEXT;
+
+closure: {
+  auto *ops_ = &c->lists[pc->a];
+  int n = pc->b;
+  closure *rec;
+  if (pc->c < 0) {
+    rec = (closure *)gc::alloc(sizeof(closure) + n * sizeof(word));
+  } else {
+    rec = (closure *)&locals[pc->c];
+  }
+  rec->fn = ((closure *)r[ops_[0]])->fn;
+  rec->mask = r[ops_[1]];
+  for (int k = 0; k < n; k++) rec->env[k] = r[ops_[k + 2]];
+  D = (word)rec;
+  NEXT;
+}
+
+call: {
+  auto *callee = (closure *)A;
+  int n = pc->c;
+  argv[0] = 0;
+  for (int k = 0; k < n; k++) argv[k] = r[c->lists[pc->b + k]];
+  D = callee->fn->entry.load(std::memory_order_acquire)(callee, argv);
+  NEXT;
+}
+
+box: {
+  auto *cell = (word *)gc::alloc(sizeof(word));
+  *cell = A;
+  D = (word)cell;
+  NEXT;
+}
+unbox:
+  D = *(word *)A;
+  NEXT;
+
+loop:
+  fn.back_edges.fetch_add(1, std::memory_order_relaxed);
+  m.tick(fn);
+jmp:
+  JUMP(pc->a);
+
+br_loop:
+  if (ops + (A ? pc->b : pc->c) <= pc) {
+    fn.back_edges.fetch_add(1, std::memory_order_relaxed);
+    m.tick(fn);
+  }
+br:
+  JUMP(A ? pc->b : pc->c);
+
+ret:
+  return A;
+retz:
+  return 0;
+fail:
+  vm::fail(c->messages[pc->a].c_str());
+
+#undef NEXT
+#undef JUMP
+#undef A
+#undef B
+#undef D
+#undef INT
+#undef FLT_OP
+}
@@ -0,0 +1,682 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/core.h>
+#include <helion/gc.h>
+#include <helion/iir.h>
+#include <helion/infer.h>
+#include <helion/passes.h>
+#include <helion/util.h>
+#include <helion/vm.h>
+#include <string.h>
+#include <mutex>
+#include <unordered_map>
+
+
+using namespace helion;
+
+
+/*
+ * the tier 1 compiler. A hot function's iir is lowered to llvm ir with the
+ * same shape as the interpreter's frame: every value is an i64, and the
+ * function takes the closure it was called through and the array of its
+ * arguments, so the result can be swapped into the function's entry as is.
+ *
+ * anything the runtime owns (functions, globals, the collector) is known by
+ * the time a function is hot, but it is still referred to by a name that is
+ * mapped to its address in the engine, not baked in. Addresses change from
+ * run to run, and the object cache is keyed on the ir, so the ir has to be
+ * the same every time for a function compiled on an earlier run to be
+ * found. Calls to a function that is known load its entry each time, so
+ * they follow it up the tiers too.
+ *
+ * the same lowering makes whole modules ahead of time (see lower_module),
+ * where nothing has an address yet. There, every function is a symbol that
+ * known calls go straight to, functions as values are closures the program
+ * makes when it starts, and globals are llvm globals.
+ */
+
+
+
+namespace {
+
+  // the symbols of a module compiled ahead of time, shared by the functions
+  // in it
+  struct aot_unit {
+    llvm::Module &mod;
+    std::unordered_map<iir::func *, llvm::Function *> fns;
+    std::unordered_map<iir::func *, llvm::GlobalVariable *> closures;
+    std::unordered_map<iir::value *, llvm::GlobalVariable *> globals;
+
+    aot_unit(llvm::Module &mod) : mod(mod) {}
+
+    llvm::Type *word(void) { return llvm::Type::getInt64Ty(mod.getContext()); }
+
+    llvm::Function *function(iir::func *f) {
+      auto &fn = fns[f];
+      if (fn == nullptr) {
+        auto *words = word()->getPointerTo();
+        auto *t = llvm::FunctionType::get(word(), {words, words}, false);
+        fn = llvm::Function::Create(t, llvm::Function::InternalLinkage,
+                                    "helion.fn." + f->name, &mod);
+      }
+      return fn;
+    }
+
+    // set by main before anything runs
+    llvm::GlobalVariable *closure(iir::func *f) {
+      auto &g = closures[f];
+      if (g == nullptr) g = variable("helion.closure." + f->name);
+      return g;
+    }
+
+    llvm::GlobalVariable *global(iir::value *v) {
+      auto &g = globals[v];
+      if (g == nullptr)
+        g = variable("helion.global." + std::to_string(globals.size()));
+      return g;
+    }
+
+    llvm::GlobalVariable *variable(const std::string &name) {
+      return new llvm::GlobalVariable(mod, word(), false,
+                                      llvm::GlobalValue::InternalLinkage,
+                                      llvm::ConstantInt::get(word(), 0), name);
+    }
+  };
+
+  class llvm_gen {
+    iir::func &ir;
+    // the vm the code runs in, when it is jitted, or the module it is part
+    // of, when it is compiled ahead of time
+    vm::machine *m;
+    aot_unit *unit;
+
+    llvm::Module &mod;
+    // the module's own context, so functions can be lowered in parallel
+    llvm::LLVMContext &ctx;
+    llvm::Function *out = nullptr;
+    llvm::IRBuilder<> b;
+    llvm::IRBuilder<> prologue;
+
+    llvm::Type *i64;
+    llvm::Type *f64;
+    llvm::Type *f32;
+    llvm::PointerType *words;
+    llvm::FunctionType *entry_ty;
+
+    llvm::Value *self = nullptr;
+    llvm::Value *args = nullptr;
+    llvm::Value *argv = nullptr;
+
+    std::unordered_map<iir::value *, llvm::Value *> vals;
+    std::unordered_map<iir::block *, llvm::BasicBlock *> blocks;
+    int next_arg = 0;
+    size_t nargs = 1;
+
+   public:
+    llvm_gen(iir::func &ir, vm::machine *m, aot_unit *unit, llvm::Module &mod)
+        : ir(ir),
+          m(m),
+          unit(unit),
+          mod(mod),
+          ctx(mod.getContext()),
+          b(ctx),
+          prologue(ctx) {
+      i64 = llvm::Type::getInt64Ty(ctx);
+      f64 = llvm::Type::getDoubleTy(ctx);
+      f32 = llvm::Type::getFloatTy(ctx);
+      words = i64->getPointerTo();
+      entry_ty = llvm::FunctionType::get(i64, {words, words}, false);
+    }
+
+
+    // fill in the body of a function with the entry_fn signature. False if
+    // the function uses something that can't be compiled yet, in which case
+    // it stays in the interpreter
+    bool run(llvm::Function *f) {
+      out = f;
+      auto it = out->arg_begin();
+      self = &*it++;
+      args = &*it;
+
+      auto *entry = llvm::BasicBlock::Create(ctx, "prologue", out);
+      prologue.SetInsertPoint(entry);
+
+      if (ir.intrinsic || ir.get_blocks().size() == 0) {
+        b.SetInsertPoint(entry);
+        intrinsic();
+        return !llvm::verifyFunction(*out, &llvm::errs());
+      }
+
+      auto order = iir::reverse_postorder(ir);
+      for (auto *bb : order)
+        blocks[bb] = llvm::BasicBlock::Create(ctx, bb->get_name(), out);
+
+      for (auto *i : all(order)) {
+        if (i->get_inst_type() != iir::inst_type::call) continue;
+        nargs = std::max(nargs, (size_t)i->args.size() - 1);
+      }
+      // calls are made one at a time, so they share one argument array. A
+      // call with no arguments still writes one (init pops a Void)
+      argv = prologue.CreateAlloca(i64, cint(std::max<size_t>(nargs, 1)),
+                                   "argv");
+
+      for (auto *bb : order) {
+        b.SetInsertPoint(blocks[bb]);
+        for (auto *i : bb->get_insts())
+          if (!emit(i)) return false;
+        if (bb->terminated()) {
+          if (!emit(bb->get_terminator())) return false;
+        } else {
+          b.CreateRet(cint(0));
+        }
+      }
+
+      prologue.CreateBr(blocks[order[0]]);
+      return !llvm::verifyFunction(*out, &llvm::errs());
+    }
+
+
+   private:
+    static std::vector<iir::instruction *> all(
+        std::vector<iir::block *> &order) {
+      std::vector<iir::instruction *> v;
+      for (auto *bb : order) {
+        for (auto *i : bb->get_insts()) v.push_back(i);
+        if (bb->terminated()) v.push_back(bb->get_terminator());
+      }
+      return v;
+    }
+
+
+    llvm::Constant *cint(uint64_t n) { return llvm::ConstantInt::get(i64, n); }
+
+    // a function of the runtime. The engine knows where they are (see
+    // map_runtime), and executables link them in
+    llvm::Constant *helper(const char *name, llvm::FunctionType *t) {
+      return mod.getOrInsertFunction(name, t);
+    }
+
+    // something the vm owns, as a global the engine maps to its address
+    llvm::Constant *external(const std::string &name, void *addr,
+                             llvm::Type *t) {
+      execution_engine->add_global_mapping(name, (uint64_t)addr);
+      return mod.getOrInsertGlobal(name, t);
+    }
+
+    llvm::Value *ptr(llvm::Value *v) { return b.CreateIntToPtr(v, words); }
+
+    llvm::Value *word_at(llvm::Value *base, size_t n) {
+      return b.CreateGEP(base, cint(n));
+    }
+
+    llvm::Value *as_f(llvm::Value *v) { return b.CreateBitCast(v, f64); }
+    llvm::Value *from_f(llvm::Value *v) { return b.CreateBitCast(v, i64); }
+
+
+    llvm::Value *val(iir::value *v) {
+      // a null operand is Void, like the ret of a body that ends in an if
+      if (v == nullptr) return cint(0);
+      if (auto it = vals.find(v); it != vals.end()) return it->second;
+
+      llvm::Value *r = nullptr;
+      if (auto *i = dynamic_cast<iir::const_int *>(v); i != nullptr) {
+        r = cint(i->val);
+      } else if (auto *f = dynamic_cast<iir::const_flt *>(v); f != nullptr) {
+        r = llvm::ConstantExpr::getBitCast(llvm::ConstantFP::get(f64, f->val),
+                                           i64);
+      } else if (auto *f = dynamic_cast<iir::func *>(v); f != nullptr) {
+        // loaded up front, so the value is there in every block
+        if (unit != nullptr) {
+          r = prologue.CreateLoad(unit->closure(f));
+        } else {
+          auto *plain = external("helion.plain." + f->name, m->get(f)->plain,
+                                 i64);
+          r = llvm::ConstantExpr::getPtrToInt(plain, i64);
+        }
+      } else if (auto *i = dynamic_cast<iir::instruction *>(v);
+                 i != nullptr && i->get_inst_type() == iir::inst_type::global) {
+        auto *g = unit != nullptr ? unit->global(i)
+                                  : external("helion.global." + i->get_name(),
+                                             m->global(i), i64);
+        r = llvm::ConstantExpr::getPtrToInt(g, i64);
+      }
+      if (r != nullptr) vals[v] = r;
+      return r;
+    }
+
+
+    static bool floating(iir::value *v) {
+      return iir::numeric_kind(&v->get_type()) == iir::num_kind::floating;
+    }
+
+    // put a result back into the shape of its type, like the interpreter
+    llvm::Value *narrow(llvm::Value *v, iir::type *t) {
+      int bits = iir::numeric_bits(t);
+      if (bits == 0 || bits == 64) return v;
+      if (iir::numeric_kind(t) == iir::num_kind::floating)
+        return from_f(b.CreateFPExt(b.CreateFPTrunc(as_f(v), f32), f64));
+      auto *small = llvm::Type::getIntNTy(ctx, bits);
+      return b.CreateSExt(b.CreateTrunc(v, small), i64);
+    }
+
+
+    llvm::Value *alloc(size_t nwords) {
+      auto *t = llvm::FunctionType::get(i64, {i64}, false);
+      return b.CreateCall(helper("helion_rt_alloc", t),
+                          {cint(nwords * 8)});
+    }
+
+    // locals are made once in the prologue, and zeroed there
+    llvm::Value *local(size_t nwords) {
+      auto *a = prologue.CreateAlloca(i64, cint(nwords));
+      for (size_t n = 0; n < nwords; n++)
+        prologue.CreateStore(cint(0), prologue.CreateGEP(a, cint(n)));
+      return b.CreatePtrToInt(a, i64);
+    }
+
+
+    void fail(const char *msg) {
+      auto *t = llvm::FunctionType::get(b.getVoidTy(), {b.getInt8PtrTy()},
+                                        false);
+      auto *str = b.CreateGlobalStringPtr(msg);
+      b.CreateCall(helper("helion_rt_fail", t), {str});
+      b.CreateUnreachable();
+    }
+
+
+    bool emit(iir::instruction *i) {
+      using iir::inst_type;
+      auto t = i->get_inst_type();
+
+      // every operand has to be something the code can see
+      std::vector<llvm::Value *> a;
+      for (auto *v : i->args) {
+        if (dynamic_cast<iir::block *>(v) != nullptr) continue;
+        auto *x = val(v);
+        if (x == nullptr) return false;
+        a.push_back(x);
+      }
+
+      llvm::Value *r = nullptr;
+      switch (t) {
+        case inst_type::add:
+        case inst_type::sub:
+        case inst_type::mul:
+        case inst_type::div: {
+          static const llvm::Instruction::BinaryOps ints[] = {
+              llvm::Instruction::Add, llvm::Instruction::Sub,
+              llvm::Instruction::Mul, llvm::Instruction::SDiv};
+          static const llvm::Instruction::BinaryOps flts[] = {
+              llvm::Instruction::FAdd, llvm::Instruction::FSub,
+              llvm::Instruction::FMul, llvm::Instruction::FDiv};
+          int n = (int)t - (int)inst_type::add;
+          if (floating(i)) {
+            r = from_f(b.CreateBinOp(flts[n], as_f(a[0]), as_f(a[1])));
+          } else {
+            if (t == inst_type::div) check_zero(a[1]);
+            r = b.CreateBinOp(ints[n], a[0], a[1]);
+          }
+          r = narrow(r, &i->get_type());
+          break;
+        }
+
+        case inst_type::invert:
+          r = floating(i) ? from_f(b.CreateFNeg(as_f(a[0])))
+                          : b.CreateNeg(a[0]);
+          r = narrow(r, &i->get_type());
+          break;
+
+        case inst_type::lt:
+        case inst_type::le:
+        case inst_type::gt:
+        case inst_type::ge:
+        case inst_type::eq:
+        case inst_type::ne: {
+          using P = llvm::CmpInst::Predicate;
+          static const P ints[] = {P::ICMP_SLT, P::ICMP_SLE, P::ICMP_SGT,
+                                   P::ICMP_SGE, P::ICMP_EQ,  P::ICMP_NE};
+          static const P flts[] = {P::FCMP_OLT, P::FCMP_OLE, P::FCMP_OGT,
+                                   P::FCMP_OGE, P::FCMP_OEQ, P::FCMP_UNE};
+          int n = (int)t - (int)inst_type::lt;
+          llvm::Value *c;
+          if (floating(i->args[0]) || floating(i->args[1])) {
+            c = b.CreateFCmp(flts[n], as_f(a[0]), as_f(a[1]));
+          } else {
+            c = b.CreateICmp(ints[n], a[0], a[1]);
+          }
+          r = b.CreateZExt(c, i64);
+          break;
+        }
+
+        case inst_type::cast: {
+          bool from = floating(i->args[0]), to = floating(i);
+          if (from == to) {
+            r = a[0];
+          } else if (to) {
+            r = from_f(b.CreateSIToFP(a[0], f64));
+          } else {
+            r = b.CreateFPToSI(as_f(a[0]), i64);
+          }
+          r = narrow(r, &i->get_type());
+          break;
+        }
+
+        case inst_type::global:
+          return true;
+
+        case inst_type::alloc:
+          r = i->heap ? alloc(1) : local(1);
+          break;
+
+        case inst_type::poparg: {
+          auto *slot = b.CreateGEP(args, cint(next_arg++));
+          if (i->heap) {
+            // arguments that outlive the call are copied into a cell
+            r = alloc(1);
+            b.CreateStore(b.CreateLoad(slot), ptr(r));
+          } else {
+            r = b.CreatePtrToInt(slot, i64);
+          }
+          break;
+        }
+
+        case inst_type::env: {
+          auto *c = dynamic_cast<iir::const_int *>(i->args[0]);
+          if (c == nullptr) return false;
+          int64_t n = c->val;
+          auto *slot = word_at(self, 2 + n);
+          auto *mask = b.CreateLoad(word_at(self, 1));
+          auto *bit = b.CreateAnd(b.CreateLShr(mask, cint(n)), cint(1));
+          // captures by reference hold the address of the variable
+          r = b.CreateSelect(b.CreateICmpNE(bit, cint(0)), b.CreateLoad(slot),
+                             b.CreatePtrToInt(slot, i64));
+          break;
+        }
+
+        case inst_type::load:
+          r = b.CreateLoad(ptr(a[0]));
+          break;
+
+        case inst_type::store:
+          b.CreateStore(a[1], ptr(a[0]));
+          return true;
+
+        case inst_type::closure: {
+          size_t count = a.size() - 2;
+          r = i->heap ? alloc(2 + count) : local(2 + count);
+          auto *rec = ptr(r);
+          b.CreateStore(b.CreateLoad(ptr(a[0])), word_at(rec, 0));
+          b.CreateStore(a[1], word_at(rec, 1));
+          for (size_t n = 0; n < count; n++)
+            b.CreateStore(a[n + 2], word_at(rec, n + 2));
+          break;
+        }
+
+        case inst_type::call:
+          r = call(i->args[0], a, tail_call(i));
+          break;
+
+        case inst_type::box:
+          r = alloc(1);
+          b.CreateStore(a[0], ptr(r));
+          break;
+
+        case inst_type::unbox:
+          r = b.CreateLoad(ptr(a[0]));
+          break;
+
+        case inst_type::ret:
+          b.CreateRet(a[0]);
+          return true;
+
+        case inst_type::jmp:
+          b.CreateBr(target(i->args[0]));
+          return true;
+
+        case inst_type::br:
+          b.CreateCondBr(b.CreateICmpNE(a[0], cint(0)), target(i->args[1]),
+                         target(i->args[2]));
+          return true;
+
+        default:
+          return false;
+      }
+
+      vals[i] = r;
+      return true;
+    }
+
+
+    llvm::BasicBlock *target(iir::value *v) {
+      return blocks.at(dynamic_cast<iir::block *>(v));
+    }
+
+
+    void check_zero(llvm::Value *v) {
+      auto *bad = llvm::BasicBlock::Create(ctx, "divzero", out);
+      auto *ok = llvm::BasicBlock::Create(ctx, "", out);
+      b.CreateCondBr(b.CreateICmpEQ(v, cint(0)), bad, ok);
+      b.SetInsertPoint(bad);
+      fail("division by zero");
+      b.SetInsertPoint(ok);
+    }
+
+
+    // a call can reuse the frame if its value is returned right away and
+    // nothing it is handed lives in this frame. Its arguments then go in the
+    // array this function was called with, which outlives the frame, so it
+    // has to have room for them
+    bool tail_call(iir::instruction *i) {
+      if (!i->tail) return false;
+      auto &bb = i->get_block();
+      auto *t = bb.get_terminator();
+      if (bb.get_insts().back() != i || t == nullptr ||
+          t->get_inst_type() != iir::inst_type::ret || t->args[0] != i)
+        return false;
+
+      size_t params = 0;
+      for (auto *p : ir.entry()->get_insts())
+        if (p->get_inst_type() == iir::inst_type::poparg) params++;
+      if (i->args.size() - 1 > std::max<size_t>(params, 1)) return false;
+
+      for (auto *v : i->args) {
+        auto *o = dynamic_cast<iir::instruction *>(v);
+        if (o == nullptr || o->heap) continue;
+        auto k = o->get_inst_type();
+        if (k == iir::inst_type::alloc || k == iir::inst_type::poparg ||
+            k == iir::inst_type::closure)
+          return false;
+      }
+      return true;
+    }
+
+
+    // every tier calls with the c calling convention, so a tail call always
+    // matches the convention of the function it is made from
+    llvm::Value *call(iir::value *callee, std::vector<llvm::Value *> &a,
+                      bool tail = false) {
+      // the operands are all computed, so overwriting this function's own
+      // arguments with them is safe
+      auto *out = tail ? args : argv;
+      b.CreateStore(cint(0), out);
+      for (size_t n = 1; n < a.size(); n++)
+        b.CreateStore(a[n], b.CreateGEP(out, cint(n - 1)));
+
+      llvm::CallInst *c;
+      // a known callee is called through its entry, loaded fresh each time so
+      // the call moves up when it does
+      if (auto *f = dynamic_cast<iir::func *>(callee); f != nullptr) {
+        // ahead of time, every function stays where it is
+        if (unit != nullptr) {
+          c = b.CreateCall(unit->function(f), {ptr(a[0]), out});
+        } else {
+          auto *slot = external("helion.entry." + f->name, &m->get(f)->entry,
+                                entry_ty->getPointerTo());
+          auto *entry = b.CreateLoad(slot);
+          entry->setAtomic(llvm::AtomicOrdering::Acquire);
+          entry->setAlignment(8);
+          c = b.CreateCall(entry, {ptr(a[0]), out});
+        }
+      } else {
+        c = b.CreateCall(helper("helion_rt_call", entry_ty),
+                         {ptr(a[0]), out});
+      }
+      if (tail) c->setTailCallKind(llvm::CallInst::TCK_MustTail);
+      return c;
+    }
+
+
+    // the body of a function that has no iir: intrinsics, which the vm gives
+    // a native implementation by name. They look at the type of the copy
+    // they are, like those do
+    void intrinsic(void) {
+      auto &name = ir.generic != nullptr ? ir.generic->name : ir.name;
+      if (ir.intrinsic && name == "add_sim") {
+        auto *t = infer::find(&ir.get_type())->as_named();
+        auto *p = t != nullptr && t->params.size() != 0
+                      ? infer::find(t->params[0])
+                      : nullptr;
+        auto *x = b.CreateLoad(word_at(args, 0));
+        auto *y = b.CreateLoad(word_at(args, 1));
+        // an instance that isn't ground gets its values in heap cells, and
+        // adds them as integers (see add_sim in vm.cpp)
+        if (p == nullptr || p->is_var()) {
+          auto *sum = b.CreateAdd(b.CreateLoad(ptr(x)), b.CreateLoad(ptr(y)));
+          auto *cell = alloc(1);
+          b.CreateStore(sum, ptr(cell));
+          b.CreateRet(cell);
+          return;
+        }
+        bool flt = iir::numeric_kind(p) == iir::num_kind::floating;
+        b.CreateRet(flt ? from_f(b.CreateFAdd(as_f(x), as_f(y)))
+                        : b.CreateAdd(x, y));
+        return;
+      }
+      fail(ir.intrinsic ? "no implementation of an intrinsic"
+                        : "call to a function with no body");
+    }
+  };
+}  // namespace
+
+
+
+// the runtime functions compiled code calls by name. The executable doesn't
+// export them, so the engine is told where they are
+static void map_runtime(void) {
+  static std::once_flag once;
+  std::call_once(once, [](void) {
+    auto map = [](const char *name, auto *f) {
+      execution_engine->add_global_mapping(name, (uint64_t)f);
+    };
+    map("helion_rt_alloc", helion_rt_alloc);
+    map("helion_rt_call", helion_rt_call);
+    map("helion_rt_fail", helion_rt_fail);
+    map("helion_rt_start", helion_rt_start);
+    map("helion_rt_function", helion_rt_function);
+  });
+}
+
+
+
+vm::entry_fn helion::jit_function(vm::function &fn) {
+  map_runtime();
+  // named after the function, not the order things got hot in, so the ir is
+  // the same on every run. A function is only compiled once
+  std::string name = "helion.jit." + fn.ir->name;
+
+  // every function gets a context of its own, so the compile threads never
+  // share one
+  auto ctx = std::make_unique<llvm::LLVMContext>();
+  auto mod = std::make_unique<llvm::Module>(name, *ctx);
+  mod->setDataLayout(execution_engine->getDataLayout());
+  mod->setTargetTriple(execution_engine->getTargetTriple().str());
+
+  auto *t = llvm::FunctionType::get(
+      llvm::Type::getInt64Ty(*ctx),
+      {llvm::Type::getInt64PtrTy(*ctx), llvm::Type::getInt64PtrTy(*ctx)},
+      false);
+  auto *f = llvm::Function::Create(t, llvm::Function::ExternalLinkage, name,
+                                   mod.get());
+  llvm_gen gen(*fn.ir, fn.owner, nullptr, *mod);
+  if (!gen.run(f)) return nullptr;
+
+  // compiled right here, as this is already one of the vm's compile threads
+  execution_engine->add_module(
+      llvm::orc::ThreadSafeModule(std::move(mod), std::move(ctx)));
+  return (vm::entry_fn)execution_engine->get_function_address(name);
+}
+
+
+
+std::unique_ptr<llvm::Module> helion::lower_module(iir::module &m,
+                                                   llvm::LLVMContext &ctx,
+                                                   std::string &error) {
+  auto mod = std::make_unique<llvm::Module>("helion", ctx);
+  mod->setDataLayout(execution_engine->getDataLayout());
+  mod->setTargetTriple(execution_engine->getTargetTriple().str());
+
+  aot_unit unit(*mod);
+  iir::func *init = nullptr;
+  for (auto *f : m.funcs) {
+    if (f->name == "init") init = f;
+    llvm_gen gen(*f, nullptr, &unit, *mod);
+    if (!gen.run(unit.function(f))) {
+      error = "@" + f->name + " can't be compiled ahead of time";
+      return nullptr;
+    }
+  }
+  if (init == nullptr) {
+    error = "module has no init function";
+    return nullptr;
+  }
+
+  // main makes the closure of every function, then runs init
+  auto *i64 = llvm::Type::getInt64Ty(ctx);
+  auto *main = llvm::Function::Create(
+      llvm::FunctionType::get(llvm::Type::getInt32Ty(ctx), false),
+      llvm::Function::ExternalLinkage, "main", mod.get());
+  llvm::IRBuilder<> b(llvm::BasicBlock::Create(ctx, "", main));
+
+  b.CreateCall(mod->getOrInsertFunction(
+                   "helion_rt_start",
+                   llvm::FunctionType::get(b.getVoidTy(), false)),
+               {});
+  auto *make = mod->getOrInsertFunction(
+      "helion_rt_function", llvm::FunctionType::get(i64, {i64}, false));
+  for (auto *f : m.funcs) {
+    auto *c = b.CreateCall(make, {b.CreatePtrToInt(unit.function(f), i64)});
+    b.CreateStore(c, unit.closure(f));
+  }
+
+  auto *argv = b.CreateAlloca(i64);
+  b.CreateStore(llvm::ConstantInt::get(i64, 0), argv);
+  auto *self = b.CreateIntToPtr(b.CreateLoad(unit.closure(init)),
+                                i64->getPointerTo());
+  b.CreateCall(unit.function(init), {self, argv});
+  b.CreateRet(b.getInt32(0));
+
+  if (llvm::verifyModule(*mod, &llvm::errs())) {
+    error = "lowering made a broken module";
+    return nullptr;
+  }
+  return mod;
+}
+
+
+
+void helion::run_module_lazy(iir::module &m) {
+  map_runtime();
+  // the lazy layer keeps the module (and the pieces it splits it into) for
+  // as long as the engine is around, which is the rest of the process
+  auto *ctx = new llvm::LLVMContext();
+  std::string error;
+  auto mod = lower_module(m, *ctx, error);
+  if (!mod) die(error);
+
+  // lower_module's main makes the closures and runs init. Only it is
+  // compiled here, and every function it reaches is compiled by its stub
+  execution_engine->add_module(std::move(mod), true);
+  auto *main = (int (*)(void))execution_engine->get_function_address("main");
+  main();
+}
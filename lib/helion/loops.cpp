@@ -0,0 +1,455 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/iir.h>
+#include <helion/passes.h>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+/*
+ * loop optimizations. There are no phi nodes in iir, so the variables of a
+ * loop live in memory (allocs) and every iteration loads and stores them:
+ *
+ *     for let i = 0, i < n, i += 1
+ *       a = a + i * 4
+ *     end
+ *
+ *   &preheader:                     (made by licm if the loop has none)
+ *     store %i, 0
+ *     jmp &for_cond
+ *   &for_cond:
+ *     %1 = load %i
+ *     %2 = load %n
+ *     %3 = lt %1, %2
+ *     br %3, &for_body, &for_exit
+ *   &for_body:
+ *     %4 = mul %1, 4
+ *     ...
+ *   &for_step:
+ *     %5 = add %1, 1
+ *     store %i, %5
+ *     jmp &for_cond
+ *
+ * licm moves the load of %n (which nothing in the loop writes) into the
+ * preheader. Strength reduction notices that %i is stepped by 1 once per
+ * iteration, and replaces `mul %1, 4` with a new variable that starts at
+ * i * 4 and is stepped by 4 right after %i is
+ */
+
+
+
+static bool is_location(value *v) {
+  auto *i = dynamic_cast<instruction *>(v);
+  if (i == nullptr) return false;
+  auto t = i->get_inst_type();
+  return t == inst_type::alloc || t == inst_type::global ||
+         t == inst_type::poparg;
+}
+
+
+// instructions that can be run ahead of time, or more often than they
+// would have been, without changing anything
+static bool is_speculatable(inst_type t) {
+  switch (t) {
+    case inst_type::add:
+    case inst_type::sub:
+    case inst_type::mul:
+    case inst_type::invert:
+    case inst_type::cast:
+    case inst_type::lt:
+    case inst_type::le:
+    case inst_type::gt:
+    case inst_type::ge:
+    case inst_type::eq:
+    case inst_type::ne:
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+
+// the block that runs right before the loop, and only jumps to its header.
+// If there isn't one, the edges into the loop are split to make one. This
+// changes the blocks of the function, so the analysis has to be redone after
+static block *get_preheader(func &fn, loop &l) {
+  auto preds = predecessors(fn);
+  std::vector<block *> outside;
+  for (auto *p : preds[l.header->get_id()])
+    if (!l.contains(p)) outside.push_back(p);
+
+  if (outside.size() == 1 && outside[0]->successors().size() == 1)
+    return outside[0];
+
+  auto *pre = fn.new_block();
+  pre->set_name("preheader");
+  slice<value *> as = {l.header};
+  pre->set_terminator(
+      fn.new_inst(*pre, inst_type::jmp, new_variable_type(), as));
+  for (auto *p : outside) {
+    for (auto &a : p->get_terminator()->args)
+      if (a == l.header) a = pre;
+  }
+
+  // keep the layout readable by putting it right above the header
+  slice<block *> old = fn.get_blocks();
+  fn.get_blocks().clear();
+  for (auto *b : old) {
+    if (b == l.header) fn.add_block(pre);
+    fn.add_block(b);
+  }
+  return pre;
+}
+
+
+
+// move instructions to the end of a block (before its terminator)
+static void move_to(block *to, std::unordered_set<instruction *> &moved,
+                    std::vector<instruction *> &order, loop &l) {
+  for (auto *b : l.blocks) {
+    slice<instruction *> kept;
+    for (auto *i : b->get_insts())
+      if (moved.count(i) == 0) kept.push_back(i);
+    b->get_insts() = kept;
+  }
+  for (auto *i : order) {
+    i->set_block(*to);
+    to->add_inst(i);
+  }
+}
+
+
+
+// does a block run on every trip around a loop?
+static bool every_iteration(domtree &dt, loop &l, block *b) {
+  for (auto *x : l.latches)
+    if (!dt.dominates(b, x)) return false;
+  return true;
+}
+
+
+// does a block always run once a loop has been entered? That's if it runs
+// every time around, and before any of the ways out
+static bool always_runs(domtree &dt, loop &l, block *b) {
+  for (auto *x : l.blocks) {
+    for (auto *s : x->successors())
+      if (!l.contains(s) && !dt.dominates(b, x)) return false;
+  }
+  return every_iteration(dt, l, b);
+}
+
+
+
+
+static bool hoist(func &fn, domtree &dt, loop &l) {
+  // a preheader in front of the entry block would push the arguments out of
+  // it, and there's nothing to gain from a loop around the whole function
+  if (l.header == fn.entry()) return false;
+
+  // what the loop might write to. Calls can run closures that write to
+  // anything, and stores that don't go to a known location might too
+  std::unordered_set<value *> written;
+  bool clobbers = false;
+  for (auto *b : l.blocks) {
+    for (auto *i : b->get_insts()) {
+      auto t = i->get_inst_type();
+      if (t == inst_type::call) clobbers = true;
+      if (t != inst_type::store) continue;
+      if (is_location(i->args[0])) {
+        written.insert(i->args[0]);
+      } else {
+        clobbers = true;
+      }
+    }
+  }
+
+  std::unordered_set<instruction *> invariant;
+  std::vector<instruction *> order;
+  auto outside = [&](value *v) {
+    auto *i = dynamic_cast<instruction *>(v);
+    // constants and functions, or the values of other functions
+    if (i == nullptr || &i->get_block().get_func() != &fn) return true;
+    return !l.contains(&i->get_block()) || invariant.count(i) != 0;
+  };
+
+  // reverse postorder visits definitions before their uses, so chains of
+  // invariant instructions are found in one go
+  for (auto *b : l.blocks) {
+    for (auto *i : b->get_insts()) {
+      auto t = i->get_inst_type();
+      bool ok = is_speculatable(t);
+      // division can trap, so it can only be done ahead of time if it would
+      // have happened anyway
+      if (t == inst_type::div) ok = always_runs(dt, l, b);
+      if (t == inst_type::load)
+        ok = !clobbers && written.count(i->args[0]) == 0;
+      if (!ok) continue;
+
+      for (auto *a : i->args) ok &= outside(a);
+      if (!ok) continue;
+      invariant.insert(i);
+      order.push_back(i);
+    }
+  }
+
+  if (order.empty()) return false;
+  move_to(get_preheader(fn, l), invariant, order, l);
+  return true;
+}
+
+
+
+bool iir::licm(func &fn) {
+  if (fn.get_blocks().size() == 0) return false;
+  bool changed = false;
+  // hoisting out of an inner loop can make the code invariant in the loop
+  // around it too, and making a preheader changes the blocks, so start over
+  // after every loop that changes. Each time, something moves out of a loop
+  // for good, so this ends
+  while (true) {
+    domtree dt(fn);
+    loop_info li(fn, dt);
+    bool moved = false;
+    for (auto &l : li.get_loops()) {
+      if (hoist(fn, dt, *l)) {
+        moved = true;
+        break;
+      }
+    }
+    if (!moved) break;
+    changed = true;
+  }
+  return changed;
+}
+
+
+
+
+namespace {
+
+  // a local that is stepped by a constant exactly once per iteration
+  struct induction_var {
+    value *loc;
+    // the store of the new value, and the add or sub that made it
+    instruction *store;
+    instruction *step;
+    size_t by;
+    int store_index;
+  };
+
+
+  class reducer {
+    func &fn;
+    domtree &dt;
+    loop &l;
+    std::unordered_set<value *> captured;
+
+    std::unordered_map<value *, induction_var> ivs;
+
+   public:
+    reducer(func &fn, domtree &dt, loop &l)
+        : fn(fn), dt(dt), l(l), captured(captured_locals(fn)) {}
+
+
+    bool run(void) {
+      if (l.header == fn.entry()) return false;
+      find_ivs();
+      if (ivs.empty()) return false;
+
+      // multiplications of an iv by a constant, as (load of the iv, factor)
+      std::vector<std::pair<instruction *, size_t>> muls;
+      std::vector<instruction *> mul_insts;
+      for (auto *b : l.blocks) {
+        for (auto *i : b->get_insts()) {
+          if (i->get_inst_type() != inst_type::mul) continue;
+          for (int n = 0; n < 2; n++) {
+            auto *k = dynamic_cast<const_int *>(i->args[1 - n]);
+            auto *x = dynamic_cast<instruction *>(i->args[n]);
+            if (k == nullptr || x == nullptr || !start_load(x)) continue;
+            muls.push_back({x, k->val});
+            mul_insts.push_back(i);
+            break;
+          }
+        }
+      }
+      if (muls.empty()) return false;
+
+      auto *pre = get_preheader(fn, l);
+
+      // one new variable for each (iv, factor) pair
+      std::map<std::pair<value *, size_t>, instruction *> reduced;
+      std::unordered_set<instruction *> dead;
+      std::unordered_map<instruction *, std::vector<instruction *>> after;
+
+      for (size_t n = 0; n < muls.size(); n++) {
+        auto [x, k] = muls[n];
+        auto *mul = mul_insts[n];
+        auto &iv = ivs[x->args[0]];
+        auto key = std::make_pair(iv.loc, k);
+
+        if (reduced.count(key) == 0) {
+          auto &ty = mul->get_type();
+          // locals go in the entry block, so they are only made once even
+          // when the loop is nested in another one
+          auto *entry = fn.entry();
+          auto *t = fn.new_inst(*entry, inst_type::alloc, ty);
+          entry->add_inst(t);
+
+          // t = iv * k on the way in...
+          slice<value *> largs = {iv.loc};
+          auto *v0 = fn.new_inst(*pre, inst_type::load, ty, largs);
+          slice<value *> margs = {v0, fn.new_int(k)};
+          auto *t0 = fn.new_inst(*pre, inst_type::mul, ty, margs);
+          slice<value *> sargs = {t, t0};
+          pre->add_inst(v0);
+          pre->add_inst(t0);
+          pre->add_inst(fn.new_inst(*pre, inst_type::store, ty, sargs));
+
+          // ...and t += step * k whenever the iv is stepped
+          auto &bb = iv.store->get_block();
+          slice<value *> l2 = {t};
+          auto *tl = fn.new_inst(bb, inst_type::load, ty, l2);
+          slice<value *> aargs = {tl, fn.new_int(iv.by * k)};
+          auto *tn = fn.new_inst(bb, iv.step->get_inst_type(), ty, aargs);
+          slice<value *> s2 = {t, tn};
+          auto *ts = fn.new_inst(bb, inst_type::store, ty, s2);
+          for (auto *i : {tl, tn, ts}) after[iv.store].push_back(i);
+          reduced[key] = t;
+        }
+
+        // the product is whatever t holds at the point the iv was loaded
+        slice<value *> targs = {reduced[key]};
+        auto &ty = mul->get_type();
+        auto *use = fn.new_inst(x->get_block(), inst_type::load, ty, targs);
+        after[x].push_back(use);
+        replace_uses(fn, mul, use);
+        dead.insert(mul);
+      }
+
+      for (auto *b : l.blocks) {
+        slice<instruction *> insts;
+        for (auto *i : b->get_insts()) {
+          if (dead.count(i) != 0) continue;
+          insts.push_back(i);
+          for (auto *a : after[i]) insts.push_back(a);
+        }
+        b->get_insts() = insts;
+      }
+      return true;
+    }
+
+
+   private:
+    // the induction variables are allocs from outside the loop that only
+    // this function can see, and that only ever hold integer constants or
+    // their own steps
+    void find_ivs(void) {
+      std::unordered_map<value *, std::vector<instruction *>> stores;
+      for (auto *b : fn.get_blocks()) {
+        for (auto *i : b->get_insts())
+          if (i->get_inst_type() == inst_type::store)
+            stores[i->args[0]].push_back(i);
+      }
+
+      for (auto *b : l.blocks) {
+        auto &insts = b->get_insts();
+        for (int n = 0; n < insts.size(); n++) {
+          auto *s = insts[n];
+          if (s->get_inst_type() != inst_type::store) continue;
+          auto *loc = dynamic_cast<instruction *>(s->args[0]);
+          if (loc == nullptr || loc->get_inst_type() != inst_type::alloc)
+            continue;
+          if (&loc->get_block().get_func() != &fn || captured.count(loc) != 0)
+            continue;
+          if (l.contains(&loc->get_block())) continue;
+
+          induction_var iv{loc, s, nullptr, 0, n};
+          if (!is_step(iv) || !every_iteration(dt, l, b)) continue;
+
+          bool ok = true;
+          for (auto *o : stores[loc]) {
+            if (o == s) continue;
+            // the only other writes have to be integers from outside
+            ok &= !l.contains(&o->get_block());
+            ok &= dynamic_cast<const_int *>(o->args[1]) != nullptr;
+          }
+          if (ok) ivs[loc] = iv;
+        }
+      }
+    }
+
+
+    // stores of `add (load loc), c`, `add c, (load loc)` or `sub (load loc), c`
+    bool is_step(induction_var &iv) {
+      auto *op = dynamic_cast<instruction *>(iv.store->args[1]);
+      if (op == nullptr) return false;
+      auto t = op->get_inst_type();
+      if (t != inst_type::add && t != inst_type::sub) return false;
+
+      for (int n = 0; n < 2; n++) {
+        if (n == 1 && t == inst_type::sub) break;
+        auto *x = dynamic_cast<instruction *>(op->args[n]);
+        auto *c = dynamic_cast<const_int *>(op->args[1 - n]);
+        if (x == nullptr || c == nullptr) continue;
+        if (x->get_inst_type() != inst_type::load || x->args[0] != iv.loc)
+          continue;
+        iv.step = op;
+        iv.by = c->val;
+        return true;
+      }
+      return false;
+    }
+
+
+    // is this a load, inside the loop, of an induction variable's value from
+    // the start of the iteration (before it is stepped)?
+    bool start_load(instruction *x) {
+      if (x->get_inst_type() != inst_type::load) return false;
+      auto it = ivs.find(x->args[0]);
+      if (it == ivs.end()) return false;
+      auto &iv = it->second;
+
+      auto *xb = &x->get_block();
+      auto *sb = &iv.store->get_block();
+      if (!l.contains(xb)) return false;
+      if (xb != sb) return dt.dominates(xb, sb);
+      auto &insts = xb->get_insts();
+      for (int n = 0; n < iv.store_index; n++)
+        if (insts[n] == x) return true;
+      return false;
+    }
+  };
+}  // namespace
+
+
+
+
+bool iir::strength_reduce(func &fn) {
+  if (fn.get_blocks().size() == 0) return false;
+  bool changed = false;
+  // like licm, a preheader may be made, so the analysis is redone after
+  // every loop that changes. The new variables are stepped by addition, so
+  // there is nothing left to reduce in a loop once it has been done
+  while (true) {
+    domtree dt(fn);
+    loop_info li(fn, dt);
+    bool reduced = false;
+    for (auto &l : li.get_loops()) {
+      reducer r(fn, dt, *l);
+      if (r.run()) {
+        reduced = true;
+        break;
+      }
+    }
+    if (!reduced) break;
+    changed = true;
+  }
+  return changed;
+}
@@ -0,0 +1,106 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/core.h>
+#include <helion/gc.h>
+#include <helion/iir.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+// the job each worker thread is lowering right now
+static thread_local lowering_queue::job *current_job = nullptr;
+
+
+
+lowering_queue::job *lowering_queue::current(void) { return current_job; }
+
+
+std::string lowering_queue::job::next_var_name(void) {
+  // the dots keep these from colliding with anything the user wrote, or with
+  // another job's variables
+  return "z" + std::to_string(id) + "." + std::to_string(next_var++);
+}
+
+
+
+void lowering_queue::add(func *fn, std::function<void(void)> lower) {
+  jobs.push_back({(int)jobs.size(), fn, std::move(lower)});
+}
+
+
+
+void lowering_queue::run(int threads) {
+  if (threads <= 0) threads = std::thread::hardware_concurrency();
+  threads = std::min<int>(std::max(threads, 1), jobs.size());
+
+  // workers take the next job off the front until there aren't any left
+  std::atomic<size_t> next = 0;
+  auto drain = [&](void) {
+    for (size_t n = next++; n < jobs.size(); n = next++) {
+      auto &j = jobs[n];
+      current_job = &j;
+      try {
+        j.lower();
+      } catch (...) {
+        j.error = std::current_exception();
+      }
+      current_job = nullptr;
+    }
+  };
+
+  if (threads == 1) {
+    drain();
+  } else {
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+      workers.emplace_back([&](void) {
+        gc::register_thread();
+        drain();
+        gc::unregister_thread();
+      });
+    }
+    for (auto &w : workers) w.join();
+  }
+
+  // report errors in the order the functions were added, not the order
+  // they happened in
+  for (auto &j : jobs) {
+    if (j.error != nullptr) {
+      auto e = j.error;
+      jobs.clear();
+      std::rethrow_exception(e);
+    }
+  }
+
+  for (auto &j : jobs) commit(j);
+  jobs.clear();
+}
+
+
+
+void lowering_queue::commit(job &j) {
+  for (auto *v : j.vars) v->name = get_next_param_name();
+
+  std::vector<func *> fns = {j.fn};
+  for (auto *f : j.lambdas) {
+    f->name = mod.unique_name(f->name, '@');
+    mod.add_func(f);
+    fns.push_back(f);
+  }
+
+  // the worker left every value with the name it asked for
+  for (auto *f : fns) {
+    for (auto *b : f->get_blocks()) {
+      for (auto *i : b->get_insts()) {
+        if (i->get_name() != "")
+          i->set_name(mod.unique_name(i->get_name(), '%'));
+      }
+    }
+  }
+}
@@ -0,0 +1,280 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/gc.h>
+#include <helion/iir.h>
+#include <helion/infer.h>
+#include <helion/passes.h>
+#include <ctype.h>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+/*
+ * monomorphization, after type inference. A call to a polymorphic function
+ * whose argument types are all known is pointed at a copy of the function
+ * made just for those types:
+ *
+ *     func @id a -> a                 func @id$Int Int -> Int
+ *       ...                             ... (every a is now Int)
+ *     %r: Int = call @id, %x    =>    %r: Int = call @id$Int, %x
+ *
+ * copies are kept on the function they were made from, by the interned type
+ * of the instance, so every call site (in any module) that uses the same
+ * types shares one copy. A copy's body is a plain monomorphic function, and
+ * the calls in it are specialized in turn.
+ */
+
+
+
+template <typename F>
+static void each_inst(func &fn, F cb) {
+  for (auto *b : fn.get_blocks()) {
+    for (auto *i : b->get_insts()) cb(i);
+    if (b->terminated()) cb(b->get_terminator());
+  }
+}
+
+
+
+// the interned form of a type with every variable resolved, or null if some
+// variable in it is still free
+static type *ground(type *t) {
+  t = infer::find(t);
+  auto *n = t->as_named();
+  if (n == nullptr) return nullptr;
+  if (n->interned) return n;
+  std::vector<type *> params;
+  for (auto *p : n->params) {
+    auto *g = ground(p);
+    if (g == nullptr) return nullptr;
+    params.push_back(g);
+  }
+  return intern_type(n->name, params);
+}
+
+
+static bool polymorphic(type *t) {
+  t = infer::find(t);
+  if (auto *v = t->as_var(); v != nullptr) return v->generic;
+  auto *n = t->as_named();
+  if (n->interned) return false;
+  for (auto *p : n->params)
+    if (polymorphic(p)) return true;
+  return false;
+}
+
+
+// bind the generic variables of a signature to the parts of a ground
+// instance. Fails if the two don't have the same shape, or if the signature
+// has a variable that isn't generic (one it shares with its environment)
+static bool match(type *sig, type *inst,
+                  std::unordered_map<type *, type *> &subst) {
+  sig = infer::find(sig);
+  if (auto *v = sig->as_var(); v != nullptr) {
+    if (!v->generic) return false;
+    auto it = subst.find(sig);
+    if (it != subst.end()) return it->second == inst;
+    subst[sig] = inst;
+    return true;
+  }
+  auto *s = sig->as_named();
+  auto *i = inst->as_named();
+  if (s->name != i->name || s->params.size() != i->params.size())
+    return false;
+  for (size_t n = 0; n < s->params.size(); n++)
+    if (!match(s->params[n], i->params[n], subst)) return false;
+  return true;
+}
+
+
+// names have to read back in (see read_module), so anything in the type's
+// string that isn't part of an identifier is dropped
+static std::string mangle(std::string base, type *inst) {
+  std::string name = base + "$";
+  bool sep = false;
+  for (char c : inst->str()) {
+    if (isalnum(c)) {
+      if (sep && name.back() != '$') name += '_';
+      name += c;
+      sep = false;
+    } else {
+      sep = true;
+    }
+  }
+  return name;
+}
+
+
+
+namespace {
+
+  class monomorphizer {
+    module &mod;
+    // the functions whose calls still have to be looked at
+    std::vector<func *> work;
+    // one for each module the work is in (copies go in the module of the
+    // function they are made from), made the first time it's needed. The
+    // copies' bodies are added to it as they are made
+    std::unordered_map<module *, std::unique_ptr<callee_table>> tables;
+
+    callee_table &callees(module &m) {
+      auto &t = tables[&m];
+      if (!t) t = std::make_unique<callee_table>(m);
+      return *t;
+    }
+
+   public:
+    monomorphizer(module &m) : mod(m) {
+      for (auto *fn : m.funcs) work.push_back(fn);
+    }
+
+
+    int run(void) {
+      int made = 0;
+      for (size_t n = 0; n < work.size(); n++) {
+        auto *fn = work[n];
+        if (fn->get_blocks().size() == 0) continue;
+        auto &table = callees(fn->get_module());
+        bool changed = false;
+        each_inst(*fn, [&](instruction *i) {
+          if (i->get_inst_type() != inst_type::call) return;
+          auto *callee = table.resolve(i->args[0]);
+          if (callee == nullptr || !polymorphic(&callee->get_type())) return;
+
+          auto *inst = instance(i);
+          if (inst == nullptr) return;
+          auto *spec = specialization(callee, inst, made);
+          if (spec == nullptr) return;
+          i->args[0] = spec;
+          changed = true;
+        });
+        // the loads of the generic function that calls went through are
+        // dead now
+        if (changed) simplify(*fn);
+      }
+      return made;
+    }
+
+
+   private:
+    // the ground type of the function a call runs, built out of its argument
+    // and result types the same way inference curries it
+    type *instance(instruction *call) {
+      std::vector<type *> args;
+      for (size_t n = 1; n < call->args.size(); n++) {
+        // nothing is known about a null argument's type
+        if (call->args[n] == nullptr) return nullptr;
+        auto *t = ground(&call->args[n]->get_type());
+        if (t == nullptr) return nullptr;
+        args.push_back(t);
+      }
+      if (args.size() == 0) args.push_back(intern_type("Void"));
+
+      type *t = ground(&call->get_type());
+      if (t == nullptr) return nullptr;
+      for (size_t n = args.size(); n-- > 0;)
+        t = intern_type("->", {args[n], t});
+      return t;
+    }
+
+
+    func *specialization(func *callee, type *inst, int &made) {
+      auto &table = callee->specializations;
+      if (auto it = table.find(inst); it != table.end()) return it->second;
+
+      std::unordered_map<type *, type *> subst;
+      if (!match(&callee->get_type(), inst, subst)) return nullptr;
+
+      // copies belong with the function they were made from, so other modules
+      // that call it find them there too
+      auto &m = callee->get_module();
+      auto *fn = gc::make_collected<func>(m);
+      fn->name = m.unique_name(mangle(callee->name, inst), '@');
+      fn->intrinsic = callee->intrinsic;
+      fn->node = callee->node;
+      fn->sc = callee->sc;
+      fn->generic = callee;
+      fn->set_type(*inst);
+      m.add_func(fn);
+      // before the body is copied, so recursive calls in it find the copy
+      table[inst] = fn;
+      made++;
+
+      // intrinsics are only a declaration, which codegen picks the
+      // implementation of by the type
+      if (callee->get_blocks().size() != 0) {
+        copy_body(*callee, *fn, subst);
+        // the copy stores to the same globals the original does, which can
+        // change which functions locations are known to hold
+        auto &known = callees(m);
+        each_inst(*fn, [&](instruction *i) { known.add(i); });
+        work.push_back(fn);
+      }
+      return fn;
+    }
+
+
+    void copy_body(func &from, func &to,
+                   std::unordered_map<type *, type *> &subst) {
+      auto &m = to.get_module();
+      std::unordered_map<value *, value *> vmap;
+
+      for (auto *b : from.get_blocks()) {
+        auto *nb = to.new_block();
+        nb->set_name(b->get_name());
+        vmap[b] = nb;
+      }
+
+      // clone_type looks the generic variables up in the substitution, and
+      // gives any other variable a fresh one
+      auto copy = [&](block *nb, instruction *i) {
+        auto *ni = to.new_inst(*nb, i->get_inst_type(),
+                               *clone_type(&i->get_type(), subst), i->args);
+        ni->heap = i->heap;
+        ni->tail = i->tail;
+        if (i->get_name() != "")
+          ni->set_name(m.unique_name(i->get_name(), '%'));
+        vmap[i] = ni;
+        return ni;
+      };
+
+      for (auto *b : from.get_blocks()) {
+        auto *nb = static_cast<block *>(vmap[b]);
+        for (auto *i : b->get_insts()) nb->add_inst(copy(nb, i));
+        if (b->terminated()) nb->set_terminator(copy(nb, b->get_terminator()));
+      }
+
+      // constants live in the original's arena, so the copy gets its own
+      for (auto *b : from.get_blocks()) {
+        auto *nb = static_cast<block *>(vmap[b]);
+        auto remap = [&](instruction *i) {
+          for (auto &a : i->args) {
+            if (auto it = vmap.find(a); it != vmap.end()) {
+              a = it->second;
+            } else if (auto *c = dynamic_cast<const_int *>(a); c != nullptr) {
+              a = to.new_int(c->val);
+            } else if (auto *c = dynamic_cast<const_flt *>(a); c != nullptr) {
+              a = to.new_float(c->val);
+            }
+          }
+        };
+        for (auto *i : nb->get_insts()) remap(i);
+        if (nb->terminated()) remap(nb->get_terminator());
+        to.add_block(nb);
+      }
+    }
+  };
+}  // namespace
+
+
+
+int iir::monomorphize(module &m) {
+  monomorphizer mm(m);
+  return mm.run();
+}
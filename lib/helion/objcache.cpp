@@ -0,0 +1,189 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/core.h>
+#include <helion/util.h>
+#include <stdlib.h>
+#include <utime.h>
+#include <algorithm>
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/SHA1.h"
+
+
+using namespace helion;
+
+
+/*
+ * the jit's object cache. Every module the jit compiles is looked up here by
+ * a hash of its optimized ir, along with everything else that goes into the
+ * object made from it (the target, the cpu and its features, the version of
+ * llvm and the optimization level), so a module that was compiled on an
+ * earlier run is just read back in and linked.
+ *
+ * objects are files in the cache directory, named by their key. When the
+ * directory gets bigger than the limit, the files that were used least
+ * recently (by modification time, which a hit updates) are removed.
+ */
+
+
+
+static std::string default_dir(void) {
+  if (auto *d = getenv("HELION_CACHE_DIR"); d != nullptr) return d;
+  if (auto *d = getenv("XDG_CACHE_HOME"); d != nullptr)
+    return std::string(d) + "/helion";
+  if (auto *d = getenv("HOME"); d != nullptr)
+    return std::string(d) + "/.cache/helion";
+  return "";
+}
+
+
+
+object_cache::object_cache(llvm::TargetMachine &TM) : TM(TM) {
+  opts.dir = default_dir();
+  if (auto *e = getenv("HELION_CACHE"); e != nullptr && std::string(e) == "0")
+    opts.enabled = false;
+}
+
+
+void object_cache::configure(object_cache_options o) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (o.dir == "") o.dir = default_dir();
+  opts = o;
+  // the size on disk is counted again for the new directory
+  total = -1;
+}
+
+
+bool object_cache::enabled(void) { return opts.enabled && opts.dir != ""; }
+
+
+std::string object_cache::key(const llvm::Module &m) {
+  std::string ir;
+  llvm::raw_string_ostream s(ir);
+  m.print(s, nullptr);
+  s.flush();
+
+  llvm::SHA1 h;
+  h.update(ir);
+  h.update(TM.getTargetTriple().str());
+  h.update(TM.getTargetCPU());
+  h.update(TM.getTargetFeatureString());
+  h.update(LLVM_VERSION_STRING);
+  h.update(std::to_string((int)TM.getOptLevel()));
+  return llvm::toHex(h.final(), true);
+}
+
+
+std::string object_cache::path(const std::string &key) {
+  return opts.dir + "/" + key + ".o";
+}
+
+
+
+std::unique_ptr<llvm::MemoryBuffer> object_cache::getObject(
+    const llvm::Module *m) {
+  if (!enabled()) return nullptr;
+  auto k = key(*m);
+  auto file = path(k);
+
+  auto buf = llvm::MemoryBuffer::getFile(file);
+  if (!buf) {
+    misses++;
+    // remembered so the object can be stored under it once it is compiled
+    std::lock_guard<std::mutex> guard(lock);
+    pending[m] = k;
+    return nullptr;
+  }
+  hits++;
+  // so it is the last to go when the cache is trimmed
+  utime(file.c_str(), nullptr);
+  return std::move(*buf);
+}
+
+
+void object_cache::notifyObjectCompiled(const llvm::Module *m,
+                                        llvm::MemoryBufferRef obj) {
+  std::string k;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = pending.find(m);
+    if (it == pending.end()) return;
+    k = it->second;
+    pending.erase(it);
+  }
+
+  if (llvm::sys::fs::create_directories(opts.dir)) return;
+
+  // written to a file of its own and moved into place, so a run reading the
+  // cache at the same time never sees half an object
+  int fd;
+  llvm::SmallString<128> tmp;
+  if (llvm::sys::fs::createUniqueFile(opts.dir + "/%%%%%%%%.tmp", fd, tmp))
+    return;
+  {
+    llvm::raw_fd_ostream out(fd, true);
+    out << obj.getBuffer();
+  }
+  if (llvm::sys::fs::rename(tmp, path(k))) {
+    llvm::sys::fs::remove(tmp);
+    return;
+  }
+  stores++;
+
+  std::lock_guard<std::mutex> guard(lock);
+  if (total >= 0) total += obj.getBufferSize();
+  trim();
+}
+
+
+
+// expects the lock to be held
+void object_cache::trim(void) {
+  if (opts.max_bytes == 0) return;
+  if (total >= 0 && (uint64_t)total <= opts.max_bytes) return;
+
+  struct entry {
+    std::string path;
+    uint64_t size;
+    llvm::sys::TimePoint<> used;
+  };
+  std::vector<entry> entries;
+  total = 0;
+
+  std::error_code ec;
+  for (llvm::sys::fs::directory_iterator it(opts.dir, ec), end;
+       it != end && !ec; it.increment(ec)) {
+    if (!llvm::StringRef(it->path()).endswith(".o")) continue;
+    llvm::sys::fs::file_status st;
+    if (llvm::sys::fs::status(it->path(), st)) continue;
+    entries.push_back({it->path(), st.getSize(),
+                       st.getLastModificationTime()});
+    total += st.getSize();
+  }
+  if ((uint64_t)total <= opts.max_bytes) return;
+
+  // down to a little under the limit, so the next store doesn't trim again
+  std::sort(entries.begin(), entries.end(),
+            [](auto &a, auto &b) { return a.used < b.used; });
+  uint64_t target = opts.max_bytes / 10 * 9;
+  for (auto &e : entries) {
+    if ((uint64_t)total <= target) break;
+    if (llvm::sys::fs::remove(e.path)) continue;
+    total -= e.size;
+    evictions++;
+  }
+}
+
+
+
+void object_cache::print_stats(std::ostream &s) {
+  uint64_t h = hits, m = misses;
+  s << "object cache (" << (enabled() ? opts.dir : "disabled") << "):\n";
+  s << "  hits:      " << h << "\n";
+  s << "  misses:    " << m << "\n";
+  s << "  stores:    " << stores << "\n";
+  s << "  evictions: " << evictions << "\n";
+  if (h + m != 0) s << "  hit rate:  " << (100 * h / (h + m)) << "%\n";
+}
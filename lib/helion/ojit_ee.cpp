@@ -4,13 +4,18 @@
 #include <dlfcn.h>
 #include <helion/core.h>
 #include <helion/util.h>
+#include <stdlib.h>
+#include <algorithm>
 #include <iostream>
+#include "llvm/Analysis/TargetTransformInfo.h"
 
 using namespace helion;
 
 
 ojit_ee::ojit_ee(llvm::TargetMachine& TM)
-    : TM(TM),
+    : cache(TM),
+      opt_level(2),
+      TM(TM),
       DL(TM.createDataLayout()),
       exec_session(),
       symbol_resolver(createLegacyLookupResolver(
@@ -24,16 +29,35 @@ ojit_ee::ojit_ee(llvm::TargetMachine& TM)
             cantFail(std::move(err), "lookupFlags failed");
           })),
       obj_layer(exec_session,
-                [this](llvm::orc::VModuleKey) {
+                [this](llvm::orc::VModuleKey k) {
                   return ObjLayer::Resources{
                       std::make_shared<llvm::SectionMemoryManager>(),
-                      symbol_resolver};
+                      resolver(k)};
                 }),
-      compile_layer(obj_layer, llvm::orc::SimpleCompiler(TM)),
-      opt_layer(compile_layer, [this](std::unique_ptr<llvm::Module> M) {
-        return opt_module(std::move(M));
-      }) {
+      compile_layer(obj_layer, llvm::orc::SimpleCompiler(TM, &cache)),
+      opt_layer(compile_layer,
+                [this](std::unique_ptr<llvm::Module> M) {
+                  return opt_module(std::move(M));
+                }),
+      locked(*this),
+      callbacks(llvm::cantFail(llvm::orc::createLocalCompileCallbackManager(
+          TM.getTargetTriple(), exec_session, 0))),
+      lazy_layer(exec_session, locked,
+                 [this](llvm::orc::VModuleKey k) { return resolver(k); },
+                 [this](llvm::orc::VModuleKey k,
+                        std::shared_ptr<llvm::orc::SymbolResolver> r) {
+                   resolvers[k] = std::move(r);
+                 },
+                 // every function is compiled on its own
+                 [](llvm::Function& f) {
+                   return std::set<llvm::Function*>({&f});
+                 },
+                 *callbacks,
+                 llvm::orc::createLocalIndirectStubsManagerBuilder(
+                     TM.getTargetTriple())) {
   llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  if (auto* env = getenv("HELION_OPT_LEVEL"); env != nullptr)
+    opt_level = std::clamp(atoi(env), 0, 3);
 }
 
 
@@ -48,6 +72,8 @@ const llvm::Triple& ojit_ee::getTargetTriple() const {
 
 
 void* ojit_ee::get_function_address(std::string name) {
+  // getting the address finishes linking the module it is in
+  std::lock_guard<std::recursive_mutex> guard(lock);
   auto symbol = find_symbol(name);
   uint64_t addr = 0;
   auto sinfo = symbol.getAddress();
@@ -60,26 +86,41 @@ void* ojit_ee::get_function_address(std::string name) {
 }
 
 void ojit_ee::add_global_mapping(llvm::StringRef name, uint64_t addr) {
-  bool successful =
-      GlobalSymbolTable.insert(std::make_pair(name, (void*)addr)).second;
-  (void)successful;
-  assert(successful);
+  std::lock_guard<std::recursive_mutex> guard(lock);
+  GlobalSymbolTable[mangle(name)] = (void*)addr;
 }
 
 llvm::JITSymbol ojit_ee::find_mangled_symbol(const std::string& name,
                                              bool exp_only) {
   const bool ExportedSymbolsOnly = exp_only;
+  std::lock_guard<std::recursive_mutex> guard(lock);
 
   // Search modules in reverse order: from last added to first added.
   // This is the opposite of the usual search order for dlsym, but makes more
   // sense in a REPL where we want to bind to the newest available definition.
-  for (auto H : llvm::make_range(module_keys.rbegin(), module_keys.rend())) {
-    auto sym = compile_layer.findSymbolIn(H, name, ExportedSymbolsOnly);
+  for (auto& m : llvm::make_range(module_keys.rbegin(), module_keys.rend())) {
+    llvm::JITSymbol sym = nullptr;
+    switch (m.in) {
+      case layer::eager:
+        sym = compile_layer.findSymbolIn(m.key, name, ExportedSymbolsOnly);
+        break;
+      // the functions of lazy modules are found as their stubs
+      case layer::lazy:
+        sym = lazy_layer.findSymbolIn(m.key, name, ExportedSymbolsOnly);
+        break;
+      case layer::object:
+        sym = obj_layer.findSymbolIn(m.key, name, ExportedSymbolsOnly);
+        break;
+    }
     if (sym) {
       return sym;
     }
   }
 
+  if (auto it = GlobalSymbolTable.find(name); it != GlobalSymbolTable.end())
+    return llvm::JITSymbol((uint64_t)it->second,
+                           llvm::JITSymbolFlags::Exported);
+
   // If we can't find the symbol in the JIT, try looking in the host process.
   if (auto SymAddr = llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name))
     return llvm::JITSymbol(SymAddr, llvm::JITSymbolFlags::Exported);
@@ -108,35 +149,156 @@ llvm::JITSymbol ojit_ee::find_mangled_symbol(const std::string& name,
 
 
 
-ojit_ee::ModuleHandle ojit_ee::add_module(std::unique_ptr<llvm::Module> m) {
+std::shared_ptr<llvm::orc::SymbolResolver> ojit_ee::resolver(
+    ModuleHandle k) {
+  auto it = resolvers.find(k);
+  return it != resolvers.end() ? it->second : symbol_resolver;
+}
+
+
+ojit_ee::ModuleHandle ojit_ee::add_module(std::unique_ptr<llvm::Module> m,
+                                          bool lazy) {
+  std::lock_guard<std::recursive_mutex> guard(lock);
+  auto K = exec_session.allocateVModule();
+  if (lazy) {
+    resolvers[K] = symbol_resolver;
+    cantFail(lazy_layer.addModule(K, std::move(m)));
+  } else {
+    cantFail(opt_layer.addModule(K, std::move(m)));
+  }
+  module_keys.push_back({K, lazy ? layer::lazy : layer::eager});
+  return K;
+}
+
+
+
+// target machines can't generate code on two threads at once, so each
+// thread that compiles gets its own copy of the engine's
+static llvm::TargetMachine& thread_target(llvm::TargetMachine& TM) {
+  thread_local std::unique_ptr<llvm::TargetMachine> tm;
+  if (!tm) {
+    tm.reset(TM.getTarget().createTargetMachine(
+        TM.getTargetTriple().str(), TM.getTargetCPU(),
+        TM.getTargetFeatureString(), TM.Options, llvm::Reloc::Static,
+        TM.getCodeModel(), TM.getOptLevel(), true));
+  }
+  return *tm;
+}
+
+
+ojit_ee::ModuleHandle ojit_ee::add_module(llvm::orc::ThreadSafeModule m) {
+  std::unique_ptr<llvm::MemoryBuffer> obj;
+  {
+    // the module's context is its own, so this only waits on someone else
+    // using the same module
+    auto ctx_lock = m.getContextLock();
+    optimize(*m.getModule());
+    obj = llvm::orc::SimpleCompiler(thread_target(TM), &cache)(
+        *m.getModule());
+  }
+
+  std::lock_guard<std::recursive_mutex> guard(lock);
   auto K = exec_session.allocateVModule();
-  cantFail(opt_layer.addModule(K, std::move(m)));
-  module_keys.push_back(K);
+  cantFail(obj_layer.addObject(K, std::move(obj)));
+  module_keys.push_back({K, layer::object});
   return K;
 }
 
 
+
+llvm::Error ojit_ee::locked_layer::addModule(ModuleHandle k,
+                                             std::unique_ptr<llvm::Module> m) {
+  std::lock_guard<std::recursive_mutex> guard(ee.lock);
+  return ee.opt_layer.addModule(k, std::move(m));
+}
+
+// symbols are resolved before the lock is let go, as that is when their
+// module is compiled and linked
+static llvm::JITSymbol resolved(llvm::JITSymbol sym) {
+  if (!sym) return sym;
+  auto addr = sym.getAddress();
+  if (!addr) return addr.takeError();
+  return llvm::JITSymbol(*addr, sym.getFlags());
+}
+
+llvm::JITSymbol ojit_ee::locked_layer::findSymbol(const std::string& name,
+                                                  bool exp_only) {
+  std::lock_guard<std::recursive_mutex> guard(ee.lock);
+  return resolved(ee.opt_layer.findSymbol(name, exp_only));
+}
+
+llvm::JITSymbol ojit_ee::locked_layer::findSymbolIn(ModuleHandle k,
+                                                    const std::string& name,
+                                                    bool exp_only) {
+  std::lock_guard<std::recursive_mutex> guard(ee.lock);
+  return resolved(ee.opt_layer.findSymbolIn(k, name, exp_only));
+}
+
+llvm::Error ojit_ee::locked_layer::removeModule(ModuleHandle k) {
+  std::lock_guard<std::recursive_mutex> guard(ee.lock);
+  return ee.opt_layer.removeModule(k);
+}
+
+
+
 // Optimize a module and all it's functions
 std::unique_ptr<llvm::Module> ojit_ee::opt_module(
     std::unique_ptr<llvm::Module> M) {
-  // Create a pass mananger
-  auto pm = llvm::legacy::FunctionPassManager(M.get());
+  optimize(*M);
+  return M;
+}
 
-  // Add some optimizations.
-  pm.add(llvm::createInstructionCombiningPass());
-  pm.add(llvm::createReassociatePass());
-  pm.add(llvm::createGVNPass());
-  pm.add(llvm::createCFGSimplificationPass());
-  pm.add(llvm::createLoopVectorizePass());
-  pm.add(llvm::createSLPVectorizerPass());
 
-  pm.add(llvm::createPartiallyInlineLibCallsPass());
+static const char* opt_level_attr = "helion-opt-level";
 
-  pm.doInitialization();
+void helion::set_opt_level(llvm::Module& M, int level) {
+  auto str = std::to_string(std::clamp(level, 0, 3));
+  for (auto& F : M)
+    if (!F.isDeclaration()) F.addFnAttr(opt_level_attr, str);
+}
 
-  // Run the optimizations over all functions in the module being added to
-  // the JIT.
-  for (auto& F : *M) pm.run(F);
+int helion::get_opt_level(llvm::Module& M) {
+  // the highest any function in it asks for
+  int level = -1;
+  for (auto& F : M) {
+    auto a = F.getFnAttribute(opt_level_attr);
+    if (a.isStringAttribute())
+      level = std::max(level, atoi(a.getValueAsString().str().c_str()));
+  }
+  return level;
+}
 
-  return M;
+
+void ojit_ee::optimize(llvm::Module& M) {
+  int level = get_opt_level(M);
+  if (level < 0) level = opt_level;
+  if (level == 0) return;
+
+  // called from many compile threads at once, so the cost model comes from
+  // this thread's target machine
+  auto& tm = thread_target(TM);
+
+  // the same pipeline clang builds for -O<level>: the inliner and the other
+  // module passes, and the function passes in the order they depend on
+  // each other (sroa before licm and indvars, loops put in canonical form
+  // before any loop pass, the vectorizers last)
+  llvm::PassManagerBuilder pmb;
+  pmb.OptLevel = level;
+  pmb.SizeLevel = 0;
+  pmb.Inliner = llvm::createFunctionInliningPass(level, 0, false);
+  pmb.LoopVectorize = level >= 2;
+  pmb.SLPVectorize = level >= 2;
+  tm.adjustPassManager(pmb);
+
+  llvm::legacy::FunctionPassManager fpm(&M);
+  llvm::legacy::PassManager mpm;
+  fpm.add(llvm::createTargetTransformInfoWrapperPass(tm.getTargetIRAnalysis()));
+  mpm.add(llvm::createTargetTransformInfoWrapperPass(tm.getTargetIRAnalysis()));
+  pmb.populateFunctionPassManager(fpm);
+  pmb.populateModulePassManager(mpm);
+
+  fpm.doInitialization();
+  for (auto& F : M) fpm.run(F);
+  fpm.doFinalization();
+  mpm.run(M);
 }
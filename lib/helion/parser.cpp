@@ -89,6 +89,8 @@ static presult parse_function_args(pstate, scope *);
 static presult parse_function_literal(pstate, scope *);
 static presult parse_return(pstate, scope *);
 static presult parse_if(pstate, scope *);
+static presult parse_while(pstate, scope *);
+static presult parse_for(pstate, scope *);
 static presult parse_typedef(pstate, scope *);
 static presult parse_let(pstate, scope *);
 
@@ -235,6 +237,8 @@ static presult parse_expr(pstate s, scope *sc, bool do_binary) {
   if (!res && begin.type == tok_left_curly) TRY(parse_do(s, sc));
   if (!res && begin.type == tok_return) TRY_NO_EXPAND(parse_return(s, sc));
   if (!res && begin.type == tok_if) TRY_NO_EXPAND(parse_if(s, sc));
+  if (!res && begin.type == tok_while) TRY_NO_EXPAND(parse_while(s, sc));
+  if (!res && begin.type == tok_for) TRY_NO_EXPAND(parse_for(s, sc));
   if (!res && begin.type == tok_def) TRY_NO_EXPAND(parse_def(s, sc));
   if (!res && begin.type == tok_typedef) TRY_NO_EXPAND(parse_typedef(s, sc));
   if (!res && begin.type == tok_let) TRY_NO_EXPAND(parse_let(s, sc));
@@ -1104,6 +1108,94 @@ static presult parse_if(pstate s, scope *sc) {
 
 
 
+// the body of a loop is a list of statements that runs up to an `end`
+static presult parse_loop_body(pstate s, scope *sc) {
+  auto body = std::make_shared<ast::do_block>(sc);
+
+  while (true) {
+    s = glob_term(s);
+    if (s.first().type == tok_end) break;
+    if (s.first().type == tok_eof)
+      throw syntax_error(s, "unterminated loop, expected `end`");
+
+    auto res = parse_expr(s, sc);
+    if (!res) throw syntax_error(s, "error in loop body");
+    s = res;
+    for (auto e : res.vals) body->exprs.push_back(e);
+  }
+  s++;
+  return presult(body, s);
+}
+
+
+
+static presult parse_while(pstate s, scope *sc) {
+  auto n = std::make_shared<ast::while_node>(sc);
+  auto start_token = s.first();
+
+  // skip the 'while'
+  s++;
+
+  auto cond = parse_expr(s, sc);
+  if (!cond) throw syntax_error(s, "failed to parse while condition");
+  s = cond;
+  n->cond = cond;
+
+  auto body = parse_loop_body(s, sc->spawn());
+  s = body;
+  n->body = body.as<ast::do_block>();
+
+  n->set_bounds(start_token, s.first());
+  return presult(n, s);
+}
+
+
+
+// for init, cond, step
+//   ...
+// end
+static presult parse_for(pstate s, scope *sc) {
+  auto n = std::make_shared<ast::for_node>(sc);
+  auto start_token = s.first();
+
+  // skip the 'for'
+  s++;
+
+  // anything declared in the header is only visible inside the loop
+  sc = sc->spawn();
+
+  auto init = parse_expr(s, sc);
+  if (!init) throw syntax_error(s, "failed to parse for loop initializer");
+  s = init;
+  n->init = init;
+  if (s.first().type != tok_comma)
+    throw syntax_error(s, "expected `,` after for loop initializer");
+  s++;
+
+  auto cond = parse_expr(s, sc);
+  if (!cond) throw syntax_error(s, "failed to parse for loop condition");
+  s = cond;
+  n->cond = cond;
+  if (s.first().type != tok_comma)
+    throw syntax_error(s, "expected `,` after for loop condition");
+  s++;
+
+  auto step = parse_expr(s, sc);
+  if (!step) throw syntax_error(s, "failed to parse for loop step");
+  s = step;
+  n->step = step;
+
+  auto body = parse_loop_body(s, sc->spawn());
+  s = body;
+  n->body = body.as<ast::do_block>();
+
+  n->set_bounds(start_token, s.first());
+  return presult(n, s);
+}
+
+
+
+
 static presult parse_def(pstate s, scope *sc) {
   auto n = std::make_shared<ast::var_decl>(sc);
 
@@ -0,0 +1,87 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/iir.h>
+#include <helion/passes.h>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+
+
+static void cleanup(func &fn) {
+  simplify(fn);
+  gvn(fn);
+  simplify(fn);
+}
+
+
+
+void iir::optimize(module &m) {
+  for (auto *fn : m.funcs) {
+    // intrinsics and declarations have no body to work on
+    if (fn->get_blocks().size() == 0) continue;
+    // self recursion becomes a loop first, so everything after sees it as one
+    eliminate_tail_recursion(*fn);
+    cleanup(*fn);
+  }
+
+  // value numbering forwards functions stored in locals straight to the
+  // calls that use them, which is what lets the inliner see through them.
+  // The table is made once, and the inliner keeps it up to date. Cleaning
+  // up only ever removes instructions, which leaves the table counting too
+  // many uses and stores, and that only makes it more careful
+  callee_table callees(m);
+  for (auto *fn : m.funcs) {
+    if (fn->get_blocks().size() == 0) continue;
+    if (inline_calls(*fn, callees)) cleanup(*fn);
+  }
+
+  // inlining can bring more invariant code into a loop, so loops are done
+  // after it. Stepping induction variables by addition leaves their loads
+  // and stores for value numbering to clean up
+  for (auto *fn : m.funcs) {
+    if (fn->get_blocks().size() == 0) continue;
+    bool changed = licm(*fn);
+    changed |= strength_reduce(*fn);
+    if (changed) cleanup(*fn);
+  }
+
+  // this has to come last, because inlining removes closures entirely and
+  // the other passes don't know how to look through one
+  convert_closures(m);
+}
+
+
+
+bool iir::run_pass(module &m, std::string name) {
+  if (name == "optimize") {
+    optimize(m);
+    return true;
+  }
+  if (name == "closures") {
+    convert_closures(m);
+    return true;
+  }
+
+  if (name == "inline") {
+    callee_table callees(m);
+    for (auto *fn : m.funcs)
+      if (fn->get_blocks().size() != 0) inline_calls(*fn, callees);
+    return true;
+  }
+
+  bool (*pass)(func &) = nullptr;
+  if (name == "gvn") pass = gvn;
+  if (name == "simplify") pass = simplify;
+  if (name == "tailcall") pass = eliminate_tail_recursion;
+  if (name == "licm") pass = licm;
+  if (name == "strength") pass = strength_reduce;
+  if (pass == nullptr) return false;
+
+  for (auto *fn : m.funcs)
+    if (fn->get_blocks().size() != 0) pass(*fn);
+  return true;
+}
@@ -0,0 +1,65 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#define GC_THREADS
+#include <gc/gc.h>
+
+#include <helion/gc.h>
+#include <helion/util.h>
+#include <helion/vm.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+using namespace helion;
+using namespace helion::vm;
+
+
+/*
+ * the part of the runtime that compiled code calls into. The jit bakes the
+ * addresses of these into its code, and code compiled ahead of time links
+ * against them by name. This file and the collector are all a program that
+ * was compiled ahead of time is linked with, so nothing in here can reach
+ * for the compiler.
+ */
+
+
+
+void vm::fail(const char *msg) {
+  puts("runtime error:", msg);
+  exit(1);
+}
+
+
+
+extern "C" {
+
+  word helion_rt_alloc(word bytes) {
+    auto *p = gc::alloc(bytes);
+    memset(p, 0, bytes);
+    return (word)p;
+  }
+
+
+  word helion_rt_call(closure *c, word *args) {
+    return c->fn->entry.load(std::memory_order_acquire)(c, args);
+  }
+
+
+  void helion_rt_fail(const char *msg) { vm::fail(msg); }
+
+
+  void helion_rt_start(void) { GC_INIT(); }
+
+
+  closure *helion_rt_function(entry_fn entry) {
+    // never promoted, as there is nothing to promote it to
+    auto *fn = new function();
+    fn->entry = entry;
+    fn->level = tier::failed;
+    fn->plain = (closure *)gc::alloc_uncollectable(sizeof(closure));
+    fn->plain->fn = fn;
+    fn->plain->mask = 0;
+    return fn->plain;
+  }
+}
@@ -0,0 +1,241 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/iir.h>
+#include <helion/passes.h>
+#include <unordered_map>
+#include <unordered_set>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+/*
+ * cfg simplification and dead code elimination. Lowering from the ast is
+ * very naive about control flow (every if gets a join block, code after a
+ * return gets its own unreachable block, etc) so this cleans up after it.
+ */
+
+
+
+// instructions that only compute a value, and can be deleted if nothing
+// uses that value
+static bool is_removable(instruction *i) {
+  switch (i->get_inst_type()) {
+    case inst_type::add:
+    case inst_type::sub:
+    case inst_type::mul:
+    case inst_type::div:
+    case inst_type::invert:
+    case inst_type::cast:
+    case inst_type::load:
+    case inst_type::closure:
+    case inst_type::env:
+    case inst_type::lt:
+    case inst_type::le:
+    case inst_type::gt:
+    case inst_type::ge:
+    case inst_type::eq:
+    case inst_type::ne:
+    case inst_type::box:
+    case inst_type::unbox:
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+
+// rewrite the branch targets of every terminator from one block to another
+static void retarget(func &fn, block *from, block *to) {
+  for (auto *b : fn.get_blocks()) {
+    if (!b->terminated()) continue;
+    for (auto &a : b->get_terminator()->args)
+      if (a == from) a = to;
+  }
+}
+
+
+
+// a conditional branch with the same block on both sides is just a jump
+static bool fold_branches(func &fn) {
+  bool changed = false;
+  for (auto *b : fn.get_blocks()) {
+    auto *t = b->get_terminator();
+    if (t == nullptr || t->get_inst_type() != inst_type::br) continue;
+    if (t->args[1] != t->args[2]) continue;
+    slice<value *> as = {t->args[1]};
+    b->set_terminator(fn.new_inst(*b, inst_type::jmp, t->get_type(), as));
+    changed = true;
+  }
+  return changed;
+}
+
+
+
+// blocks that contain nothing but a jump can be skipped over entirely
+static bool thread_jumps(func &fn) {
+  bool changed = false;
+  auto *entry = fn.entry();
+  for (auto *b : fn.get_blocks()) {
+    if (b == entry || b->get_insts().size() != 0) continue;
+    auto *t = b->get_terminator();
+    if (t == nullptr || t->get_inst_type() != inst_type::jmp) continue;
+    auto *dst = dynamic_cast<block *>(t->args[0]);
+    if (dst == b) continue;
+
+    // make sure something actually gets rewritten, otherwise we'd report a
+    // change forever on an already threaded block
+    for (auto *p : fn.get_blocks()) {
+      if (p == b || !p->terminated()) continue;
+      for (auto *a : p->get_terminator()->args)
+        if (a == b) changed = true;
+    }
+    retarget(fn, b, dst);
+  }
+  return changed;
+}
+
+
+
+// drop every block that can't be reached from the entry, keeping the
+// original layout of the ones that remain, and renumber them
+static bool remove_unreachable(func &fn) {
+  auto rpo = reverse_postorder(fn);
+  std::unordered_set<block *> live(rpo.begin(), rpo.end());
+
+  auto &blocks = fn.get_blocks();
+  if (live.size() == (size_t)blocks.size()) return false;
+
+  slice<block *> old = blocks;
+  blocks.clear();
+  for (auto *b : old) {
+    if (live.count(b) != 0) fn.add_block(b);
+  }
+  return true;
+}
+
+
+
+// if a block unconditionally jumps to a block that has no other way in, the
+// two can be glued together into one
+static bool merge_chains(func &fn) {
+  bool changed = false;
+  auto preds = predecessors(fn);
+  std::unordered_set<block *> merged;
+
+  for (auto *a : fn.get_blocks()) {
+    if (merged.count(a) != 0) continue;
+    while (true) {
+      auto *t = a->get_terminator();
+      if (t == nullptr || t->get_inst_type() != inst_type::jmp) break;
+      auto *b = dynamic_cast<block *>(t->args[0]);
+      if (b == a || b == fn.entry() || preds[b->get_id()].size() != 1) break;
+
+      for (auto *i : b->get_insts()) {
+        i->set_block(*a);
+        a->add_inst(i);
+      }
+      auto *bt = b->get_terminator();
+      if (bt != nullptr) bt->set_block(*a);
+      a->set_terminator(bt);
+
+      // b's successors now have a as their predecessor instead
+      for (auto *s : a->successors()) {
+        for (auto &p : preds[s->get_id()])
+          if (p == b) p = a;
+      }
+      b->get_insts().clear();
+      b->set_terminator(nullptr);
+      merged.insert(b);
+      changed = true;
+    }
+  }
+
+  // the merged blocks are now empty and unreferenced, rebuild the list
+  // without them
+  if (changed) {
+    slice<block *> old = fn.get_blocks();
+    fn.get_blocks().clear();
+    for (auto *b : old) {
+      if (merged.count(b) == 0) fn.add_block(b);
+    }
+  }
+  return changed;
+}
+
+
+
+// delete instructions without side effects whose results are never used, and
+// locals that are only ever written to (along with the writes)
+static bool remove_dead(func &fn) {
+  std::unordered_map<value *, int> uses;
+  std::unordered_map<value *, int> stores_to;
+  auto count = [&](instruction *i, int d) {
+    for (auto *a : i->args) uses[a] += d;
+    if (i->get_inst_type() == inst_type::store) stores_to[i->args[0]] += d;
+  };
+
+  for (auto *b : fn.get_blocks()) {
+    for (auto *i : b->get_insts()) count(i, 1);
+    if (b->terminated()) count(b->get_terminator(), 1);
+  }
+
+  auto captured = captured_locals(fn);
+  auto write_only = [&](value *v) {
+    auto *i = dynamic_cast<instruction *>(v);
+    if (i == nullptr || i->get_inst_type() != inst_type::alloc) return false;
+    return captured.count(v) == 0 && uses[v] == stores_to[v];
+  };
+
+  bool changed = false;
+  bool again = true;
+  // removing one instruction may make its operands dead too, so keep going
+  // until nothing else falls out
+  while (again) {
+    again = false;
+    for (auto *b : fn.get_blocks()) {
+      slice<instruction *> kept;
+      for (auto *i : b->get_insts()) {
+        bool dead = false;
+        if (is_removable(i) && uses[i] == 0) dead = true;
+        if (i->get_inst_type() == inst_type::store && write_only(i->args[0]))
+          dead = true;
+        if (i->get_inst_type() == inst_type::alloc && uses[i] == 0 &&
+            captured.count(i) == 0)
+          dead = true;
+
+        if (dead) {
+          count(i, -1);
+          again = changed = true;
+        } else {
+          kept.push_back(i);
+        }
+      }
+      b->get_insts() = kept;
+    }
+  }
+  return changed;
+}
+
+
+
+
+bool iir::simplify(func &fn) {
+  if (fn.get_blocks().size() == 0) return false;
+  bool changed = false;
+  while (true) {
+    bool iter = false;
+    iter |= fold_branches(fn);
+    iter |= thread_jumps(fn);
+    iter |= remove_unreachable(fn);
+    iter |= merge_chains(fn);
+    // dead code removal can empty out blocks, which opens up more threading
+    iter |= remove_dead(fn);
+    if (!iter) break;
+    changed = true;
+  }
+  return changed;
+}
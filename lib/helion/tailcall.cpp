@@ -0,0 +1,121 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/iir.h>
+#include <helion/passes.h>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+/*
+ * tail recursion elimination. A function that calls itself in tail position
+ * doesn't need a new frame for that call. Arguments are locations like any
+ * other local, so the call can overwrite them with its operands and jump
+ * back to the top of the body instead:
+ *
+ *     func @f:                        func @f:
+ *       &bb.0:                          &bb.0:
+ *         %n = poparg                     %n = poparg
+ *         ...                             jmp &tailrec
+ *         %r = tail call %f, %x   =>    &tailrec:
+ *         ret %r                          ...
+ *                                         store %n, %x
+ *                                         jmp &tailrec
+ *
+ * tail calls to anything else are left for llvmgen, which emits them as
+ * musttail calls when nothing they are handed lives in the caller's frame.
+ * The interpreter and baseline code make them as normal calls.
+ */
+
+
+
+// the self calls in tail position, which are the last instruction of a block
+// that returns their value
+static std::vector<instruction *> self_tail_calls(func &fn, int nargs) {
+  callee_table callees(fn.get_module());
+  std::vector<instruction *> calls;
+  for (auto *b : fn.get_blocks()) {
+    auto *t = b->get_terminator();
+    if (t == nullptr || t->get_inst_type() != inst_type::ret) continue;
+    if (b->get_insts().empty()) continue;
+
+    auto *call = b->get_insts().back();
+    if (call->get_inst_type() != inst_type::call || !call->tail) continue;
+    if (t->args[0] != call || call->args.size() - 1 != nargs) continue;
+    if (callees.resolve(call->args[0]) == &fn) calls.push_back(call);
+  }
+  return calls;
+}
+
+
+
+bool iir::eliminate_tail_recursion(func &fn) {
+  if (fn.get_blocks().size() == 0) return false;
+
+  // the arguments, in the order they are popped
+  std::vector<instruction *> params;
+  for (auto *i : fn.entry()->get_insts())
+    if (i->get_inst_type() == inst_type::poparg) params.push_back(i);
+
+  auto calls = self_tail_calls(fn, params.size());
+  if (calls.empty()) return false;
+
+  // every call used to get its own copy of the locals. A closure that
+  // captured one would now see it change under it
+  if (!captured_locals(fn).empty()) return false;
+
+  // split the arguments off of the entry block, so the rest of it can be
+  // jumped back to
+  auto *entry = fn.entry();
+  auto *body = fn.new_block();
+  body->set_name("tailrec");
+
+  slice<instruction *> head;
+  for (auto *i : entry->get_insts()) {
+    if (i->get_inst_type() == inst_type::poparg) {
+      head.push_back(i);
+    } else {
+      i->set_block(*body);
+      body->add_inst(i);
+    }
+  }
+  entry->get_insts() = head;
+  if (entry->terminated()) entry->get_terminator()->set_block(*body);
+  body->set_terminator(entry->get_terminator());
+
+  // anything that branched to the entry (read in from text, for example)
+  // shouldn't pop the arguments again
+  for (auto *b : fn.get_blocks()) {
+    if (!b->terminated()) continue;
+    for (auto &a : b->get_terminator()->args)
+      if (a == entry) a = body;
+  }
+  slice<value *> jargs = {body};
+  entry->set_terminator(
+      fn.new_inst(*entry, inst_type::jmp, new_variable_type(), jargs));
+
+  slice<block *> old = fn.get_blocks();
+  fn.get_blocks().clear();
+  for (auto *b : old) {
+    fn.add_block(b);
+    if (b == entry) fn.add_block(body);
+  }
+
+  // the operands have all been computed by the time of the call, so they
+  // can be stored in order without clobbering each other
+  for (auto *call : calls) {
+    auto &b = call->get_block();
+    b.get_insts().pop_back();
+    for (size_t n = 0; n < params.size(); n++) {
+      slice<value *> sargs = {params[n], call->args[n + 1]};
+      b.add_inst(fn.new_inst(b, inst_type::store, params[n]->get_type(),
+                             sargs));
+    }
+    slice<value *> bargs = {body};
+    b.set_terminator(
+        fn.new_inst(b, inst_type::jmp, new_variable_type(), bargs));
+  }
+  return true;
+}
@@ -0,0 +1,510 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/core.h>
+#include <helion/gc.h>
+#include <helion/iir.h>
+#include <helion/infer.h>
+#include <helion/passes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+
+using namespace helion;
+using namespace helion::iir;
+
+
+/*
+ * type inference over a whole module. Rather than inferring the init function
+ * and letting it pull in everything it refers to, the functions are split
+ * into groups that refer to each other (Tarjan's strongly connected
+ * components), which are inferred in dependency order. Every group gets a key
+ * from its iir and the keys of its dependencies, so a group whose key was
+ * seen in an earlier compile doesn't have to be inferred again: the types it
+ * had are put back on its signatures and on every instruction in it, which
+ * is all the passes after inference look at.
+ */
+
+
+
+template <typename F>
+static void each_inst(func &fn, F cb) {
+  for (auto *b : fn.get_blocks()) {
+    for (auto *i : b->get_insts()) cb(i);
+    if (b->terminated()) cb(b->get_terminator());
+  }
+}
+
+
+
+namespace {
+
+  // FNV-1a, over whatever gets mixed in
+  struct hasher {
+    uint64_t h = 14695981039346656037ULL;
+    // type variables are numbered in the order they are first seen, as their
+    // names depend on everything lowered before them
+    std::unordered_map<type *, uint64_t> vars;
+
+    inline void mix(uint64_t v) { h = (h ^ v) * 1099511628211ULL; }
+    inline void mix(const std::string &s) { mix(std::hash<std::string>()(s)); }
+
+    void mix_type(type *t) {
+      t = infer::find(t);
+      if (t->is_var()) {
+        mix(1);
+        mix(vars.emplace(t, vars.size()).first->second);
+        return;
+      }
+      auto *n = t->as_named();
+      mix(2);
+      mix(n->name);
+      mix(n->params.size());
+      for (auto *p : n->params) mix_type(p);
+    }
+  };
+
+
+
+  // types are remembered in prefix form: `name/n` followed by its n
+  // parameters, or `@n` for the nth variable of the group. Variables are
+  // numbered across the whole group, so types that shared one still do when
+  // they are read back
+  void write_type(std::ostream &s, type *t,
+                  std::unordered_map<type *, int> &vars) {
+    t = infer::find(t);
+    if (t->is_var()) {
+      auto it = vars.emplace(t, vars.size()).first;
+      s << " @" << it->second;
+      return;
+    }
+    auto *n = t->as_named();
+    s << " " << n->name << "/" << n->params.size();
+    for (auto *p : n->params) write_type(s, p, vars);
+  }
+
+  type *read_type(std::istream &s, std::vector<type *> &vars) {
+    std::string tok;
+    if (!(s >> tok)) throw std::runtime_error("truncated type in the cache");
+    if (tok[0] == '@') {
+      size_t n = strtoul(tok.c_str() + 1, nullptr, 10);
+      while (vars.size() <= n) vars.push_back(&new_variable_type());
+      return vars[n];
+    }
+    auto slash = tok.rfind('/');
+    if (slash == std::string::npos)
+      throw std::runtime_error("bad type in the cache");
+    size_t count = strtoul(tok.c_str() + slash + 1, nullptr, 10);
+    std::vector<type *> params;
+    for (size_t i = 0; i < count; i++) params.push_back(read_type(s, vars));
+    return intern_type(tok.substr(0, slash), params);
+  }
+
+
+
+  uint64_t hash_func(func &fn) {
+    hasher h;
+    h.mix(fn.name);
+    h.mix_type(&fn.get_type());
+
+    // instructions are numbered by position, so the key doesn't depend on
+    // how many ids were handed out before them
+    std::unordered_map<value *, uint64_t> local;
+    each_inst(fn, [&](instruction *i) { local.emplace(i, local.size()); });
+
+    h.mix(fn.get_blocks().size());
+    each_inst(fn, [&](instruction *i) {
+      h.mix((uint64_t)i->get_inst_type());
+      h.mix(i->get_block().get_id());
+      h.mix(i->heap | (i->tail << 1));
+      h.mix_type(&i->get_type());
+      h.mix(i->args.size());
+      for (auto *a : i->args) {
+        if (a == nullptr) {
+          h.mix(9);
+        } else if (auto it = local.find(a); it != local.end()) {
+          h.mix(3);
+          h.mix(it->second);
+        } else if (auto *bb = dynamic_cast<block *>(a); bb != nullptr) {
+          h.mix(4);
+          h.mix(bb->get_id());
+        } else if (auto *f = dynamic_cast<func *>(a); f != nullptr) {
+          h.mix(5);
+          h.mix(f->name);
+        } else if (auto *c = dynamic_cast<const_int *>(a); c != nullptr) {
+          h.mix(6);
+          h.mix(c->val);
+        } else if (auto *c = dynamic_cast<const_flt *>(a); c != nullptr) {
+          uint64_t bits;
+          memcpy(&bits, &c->val, sizeof(bits));
+          h.mix(7);
+          h.mix(bits);
+        } else {
+          // values from other functions (globals, mostly) go by name
+          h.mix(8);
+          h.mix(a->get_name());
+        }
+      }
+    });
+    return h.h;
+  }
+};  // namespace
+
+
+
+std::vector<infer::def_group> infer::definition_groups(module &m) {
+  callee_table callees(m);
+
+  std::unordered_map<func *, int> index;
+  for (auto *fn : m.funcs) index.emplace(fn, index.size());
+
+  std::vector<std::vector<int>> edges(m.funcs.size());
+  for (auto *fn : m.funcs) {
+    auto &out = edges[index[fn]];
+    each_inst(*fn, [&](instruction *i) {
+      for (auto *a : i->args) {
+        auto *f = callees.resolve(a);
+        if (f == nullptr || index.count(f) == 0) continue;
+        out.push_back(index[f]);
+      }
+    });
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+  }
+
+  // Tarjan's algorithm, with an explicit stack. A component is finished only
+  // after every component it can reach, which is the order they're needed in
+  size_t n = m.funcs.size();
+  std::vector<int> order(n, -1), low(n, 0), group(n, -1);
+  std::vector<bool> on_stack(n, false);
+  std::vector<int> stack;
+  std::vector<std::pair<int, size_t>> work;
+  std::vector<def_group> groups;
+  int next = 0;
+
+  for (size_t root = 0; root < n; root++) {
+    if (order[root] != -1) continue;
+    work.push_back({root, 0});
+
+    while (!work.empty()) {
+      auto &[v, e] = work.back();
+      if (e == 0 && order[v] == -1) {
+        order[v] = low[v] = next++;
+        stack.push_back(v);
+        on_stack[v] = true;
+      }
+
+      if (e < edges[v].size()) {
+        int w = edges[v][e++];
+        if (order[w] == -1) {
+          work.push_back({w, 0});
+        } else if (on_stack[w]) {
+          low[v] = std::min(low[v], order[w]);
+        }
+        continue;
+      }
+
+      int done = v;
+      work.pop_back();
+      if (!work.empty()) {
+        int parent = work.back().first;
+        low[parent] = std::min(low[parent], low[done]);
+      }
+      if (low[done] != order[done]) continue;
+
+      def_group g;
+      int w;
+      do {
+        w = stack.back();
+        stack.pop_back();
+        on_stack[w] = false;
+        group[w] = groups.size();
+        g.funcs.push_back(m.funcs[w]);
+      } while (w != done);
+      // keep the functions in the order the module has them
+      std::reverse(g.funcs.begin(), g.funcs.end());
+      groups.push_back(std::move(g));
+    }
+  }
+
+  for (size_t i = 0; i < groups.size(); i++) {
+    auto &g = groups[i];
+    hasher h;
+    for (auto *fn : g.funcs) {
+      h.mix(hash_func(*fn));
+      for (int w : edges[index[fn]]) {
+        if (group[w] != (int)i) g.deps.push_back(group[w]);
+      }
+    }
+    std::sort(g.deps.begin(), g.deps.end());
+    g.deps.erase(std::unique(g.deps.begin(), g.deps.end()), g.deps.end());
+    // dependencies always come first, so their keys are already done
+    for (int d : g.deps) h.mix(groups[d].key);
+    g.key = h.h;
+  }
+
+  return groups;
+}
+
+
+
+// the task each thread is running right now
+static thread_local infer::task *current_task = nullptr;
+
+infer::task *infer::task::current(void) { return current_task; }
+
+
+std::string infer::task::next_var_name(void) {
+  return "y" + std::to_string(id) + "." + std::to_string(next_var++);
+}
+
+
+
+// does a group read or write any value outside of itself, other than
+// functions? Those values' types are shared with the other groups that use
+// them, so the group can't be inferred alongside anything else
+static bool touches_shared(infer::def_group &g, callee_table &callees) {
+  std::unordered_set<func *> in(g.funcs.begin(), g.funcs.end());
+  bool shared = false;
+  for (auto *fn : g.funcs) {
+    each_inst(*fn, [&](instruction *i) {
+      // loads of a function are references to the function
+      if (callees.resolve(i) != nullptr) return;
+      for (auto *a : i->args) {
+        auto *o = dynamic_cast<instruction *>(a);
+        if (o != nullptr && in.count(&o->get_block().get_func()) == 0)
+          shared = true;
+      }
+    });
+  }
+  return shared;
+}
+
+
+// a type is closed if every variable in it has been generalized, which
+// means nothing that uses it can change it
+static bool closed(type *t) {
+  t = infer::find(t);
+  if (auto *v = t->as_var(); v != nullptr) return v->generic;
+  auto *n = t->as_named();
+  if (n->interned) return true;
+  for (auto *p : n->params)
+    if (!closed(p)) return false;
+  return true;
+}
+
+
+
+int infer::inference_cache::check(module &m, context &root) {
+  for (auto &[key, e] : entries) e.used = false;
+  auto groups = definition_groups(m);
+  callee_table callees(m);
+  int inferred = 0;
+
+  // anything unified before now has to be readable from the tasks
+  store().publish();
+
+  // tasks only ever add to their own top context, and look things up in
+  // root, which nothing writes to until they're done
+  root.callees = &callees;
+  root.frozen = true;
+
+  std::vector<bool> shared(groups.size()), done(groups.size(), false);
+  for (size_t i = 0; i < groups.size(); i++)
+    shared[i] = touches_shared(groups[i], callees);
+
+  // groups that touch a shared value aren't cached. Their types depend on
+  // what every other user of the value does with it, which the key doesn't
+  // cover
+  auto cached = [&](int gi) -> entry * {
+    auto &g = groups[gi];
+    if (shared[gi]) return nullptr;
+    auto it = entries.find(g.key);
+    if (it == entries.end() || it->second.count != g.funcs.size())
+      return nullptr;
+    return &it->second;
+  };
+
+  auto run = [&](task &t, int gi) {
+    auto &g = groups[gi];
+    current_task = &t;
+    try {
+      if (auto *e = cached(gi); e != nullptr) {
+        // give each signature and instruction the type it had last time, a
+        // level deeper like deduce does, and generalize the signatures the
+        // same way it would have
+        std::istringstream types(e->types);
+        std::vector<type *> vars;
+        for (auto *fn : g.funcs) {
+          t.store.enter();
+          unify(&fn->get_type(), read_type(types, vars));
+          each_inst(*fn, [&](instruction *i) {
+            unify(&i->get_type(), read_type(types, vars));
+          });
+          t.store.leave();
+          generalize(&fn->get_type());
+          t.top.set(fn, &fn->get_type());
+        }
+      } else {
+        for (auto *fn : g.funcs) fn->deduce(t.top);
+      }
+    } catch (...) {
+      t.error = std::current_exception();
+    }
+    t.store.publish();
+    current_task = nullptr;
+  };
+
+  // commits happen on this thread, in group order
+  auto commit = [&](task &t, int gi) {
+    auto &g = groups[gi];
+    if (t.error != nullptr) {
+      root.frozen = false;
+      root.callees = nullptr;
+      std::rethrow_exception(t.error);
+    }
+    for (auto *v : t.vars) v->name = get_next_param_name();
+    t.top.merge_into(root);
+    done[gi] = true;
+
+    if (auto *e = cached(gi); e != nullptr) {
+      e->used = true;
+      return;
+    }
+    inferred++;
+    if (shared[gi]) return;
+    std::ostringstream types;
+    std::unordered_map<type *, int> vars;
+    for (auto *fn : g.funcs) {
+      write_type(types, &fn->get_type(), vars);
+      each_inst(*fn, [&](instruction *i) {
+        write_type(types, &i->get_type(), vars);
+      });
+    }
+    entries[g.key] = {g.funcs.size(), types.str(), true};
+  };
+
+  size_t finished = 0;
+  while (finished < groups.size()) {
+    // everything whose dependencies are done is ready
+    std::vector<int> parallel, serial;
+    for (size_t i = 0; i < groups.size(); i++) {
+      if (done[i]) continue;
+      bool ready = true, deps_closed = true;
+      for (int d : groups[i].deps) {
+        if (!done[d]) ready = false;
+        if (!ready) break;
+        for (auto *fn : groups[d].funcs)
+          if (!closed(&fn->get_type())) deps_closed = false;
+      }
+      if (!ready) continue;
+      if (shared[i] || !deps_closed) {
+        serial.push_back(i);
+      } else {
+        parallel.push_back(i);
+      }
+    }
+
+    std::deque<task> tasks;
+    for (int gi : parallel) {
+      tasks.emplace_back();
+      tasks.back().id = gi;
+      tasks.back().top.parent = &root;
+    }
+
+    int nthreads = threads > 0 ? threads : std::thread::hardware_concurrency();
+    nthreads = std::min<int>(std::max(nthreads, 1), tasks.size());
+    std::atomic<size_t> next = 0;
+    auto drain = [&](void) {
+      for (size_t n = next++; n < tasks.size(); n = next++)
+        run(tasks[n], parallel[n]);
+    };
+    if (nthreads <= 1) {
+      drain();
+    } else {
+      std::vector<std::thread> workers;
+      for (int i = 0; i < nthreads; i++) {
+        workers.emplace_back([&](void) {
+          gc::register_thread();
+          drain();
+          gc::unregister_thread();
+        });
+      }
+      for (auto &w : workers) w.join();
+    }
+    for (size_t n = 0; n < tasks.size(); n++) commit(tasks[n], parallel[n]);
+
+    // groups that share variables with others go one at a time
+    for (int gi : serial) {
+      task t;
+      t.id = gi;
+      t.top.parent = &root;
+      run(t, gi);
+      commit(t, gi);
+    }
+
+    finished += parallel.size() + serial.size();
+  }
+
+  root.frozen = false;
+  root.callees = nullptr;
+  return inferred;
+}
+
+
+
+// the most entries kept in a saved cache, so it doesn't grow forever. The
+// ones the last check used are always kept, and count towards it
+static const size_t max_saved = 4096;
+static const char *cache_magic = "helion-types 1";
+
+bool infer::inference_cache::load(const std::string &path) {
+  std::ifstream in(path);
+  std::string line;
+  if (!std::getline(in, line) || line != cache_magic) return false;
+
+  // <key> <functions> then the group's types on one line
+  std::unordered_map<uint64_t, entry> read;
+  uint64_t key;
+  size_t count;
+  while (in >> std::hex >> key >> std::dec >> count) {
+    in.ignore(1);
+    if (!std::getline(in, line)) return false;
+    read[key] = {count, line, false};
+  }
+  entries = std::move(read);
+  return true;
+}
+
+
+bool infer::inference_cache::save(const std::string &path) {
+  // written next to the file and moved over it, so a compile reading it at
+  // the same time never sees half of it
+  auto tmp = path + "." + std::to_string(getpid()) + ".tmp";
+  {
+    std::ofstream out(tmp);
+    if (!out) return false;
+    out << cache_magic << "\n";
+    size_t n = 0;
+    for (int used = 1; used >= 0; used--) {
+      for (auto &[key, e] : entries) {
+        if (e.used != (bool)used) continue;
+        if (!used && n >= max_saved) break;
+        n++;
+        out << std::hex << key << std::dec << " " << e.count << " " << e.types
+            << "\n";
+      }
+    }
+    if (!out) return false;
+  }
+  return rename(tmp.c_str(), path.c_str()) == 0;
+}
@@ -22,8 +22,72 @@ void helion::init_types(void) {
 
 
 bool iir::operator==(type &a, type &b) {
-  auto hf = std::hash<type>();
-  return hf(a) == hf(b);
+  if (&a == &b) return true;
+  auto *x = infer::find(&a);
+  auto *y = infer::find(&b);
+  if (x == y) return true;
+
+  // variables are only ever equal to themselves
+  auto *nx = x->as_named();
+  auto *ny = y->as_named();
+  if (nx == nullptr || ny == nullptr) return false;
+  // and there is only one of each ground type
+  if (nx->interned && ny->interned) return false;
+
+  if (nx->name != ny->name || nx->params.size() != ny->params.size())
+    return false;
+  for (size_t i = 0; i < nx->params.size(); i++) {
+    if (*nx->params[i] != *ny->params[i]) return false;
+  }
+  return true;
+}
+
+
+
+namespace {
+  struct intern_key {
+    std::string name;
+    std::vector<type *> params;
+
+    inline bool operator==(const intern_key &o) const {
+      return name == o.name && params == o.params;
+    }
+  };
+
+  struct intern_hash {
+    size_t operator()(const intern_key &k) const {
+      // the parameters are canonical already, so their addresses will do
+      size_t x = std::hash<std::string>()(k.name);
+      for (auto *p : k.params) x = (x ^ (size_t)p) * 1000003UL;
+      return x;
+    }
+  };
+};  // namespace
+
+// lowering threads convert types at the same time
+static std::mutex intern_lock;
+static std::unordered_map<intern_key, named_type *, intern_hash> interned;
+
+
+named_type *iir::intern_type(std::string name, std::vector<type *> params) {
+  for (auto *p : params) {
+    if (!p->is_named() || !p->as_named()->interned)
+      return gc::make_collected<named_type>(name, params);
+  }
+
+  std::lock_guard<std::mutex> guard(intern_lock);
+  intern_key key = {name, params};
+  auto it = interned.find(key);
+  if (it != interned.end()) return it->second;
+
+  // interned types live as long as the process does. They are still scanned,
+  // as they point at other types
+  auto *t = new (gc::alloc_uncollectable(sizeof(named_type)))
+      named_type(name, params);
+  t->hash = std::hash<type>()(*t);
+  t->interned = true;
+  interned[key] = t;
+  return t;
 }
 
 named_type *type::as_named(void) {
@@ -63,22 +127,36 @@ std::string named_type::str(void) {
 
   for (auto &param : params) {
     s += " ";
-    s += param->str();
+    // parameters that are applications themselves need parens, or
+    // `List (Maybe a)` would read back as `List Maybe a`
+    auto *n = infer::find(param)->as_named();
+    if (n != nullptr && n->name != "()" && n->params.size() != 0) {
+      s += "(" + param->str() + ")";
+    } else {
+      s += param->str();
+    }
   }
   return s;
 }
 
 
 std::string var_type::str(void) {
-  if (points_to != nullptr && points_to != this) {
-    return points_to->str();
-  }
+  auto *t = infer::find(this);
+  if (t != this) return t->str();
   return name;
 }
 
 
 std::string helion::get_next_param_name(void) {
   static std::atomic<int> next_type_num = 0;
+  // workers name variables out of their job's pool, and they are renamed
+  // into this sequence in order when the job is committed
+  if (auto *job = lowering_queue::current(); job != nullptr)
+    return job->next_var_name();
+  // and so do inference tasks
+  if (auto *t = infer::task::current(); t != nullptr)
+    return t->next_var_name();
+
   std::string name = "z";
   name += std::to_string(next_type_num++);
   return name;
@@ -87,7 +165,11 @@ std::string helion::get_next_param_name(void) {
 
 
 var_type &iir::new_variable_type(void) {
-  return *gc::make_collected<var_type>(get_next_param_name());
+  auto *v = gc::make_collected<var_type>(get_next_param_name());
+  if (auto *job = lowering_queue::current(); job != nullptr)
+    job->vars.push_back(v);
+  if (auto *t = infer::task::current(); t != nullptr) t->vars.push_back(v);
+  return *v;
 }
 
 
@@ -97,7 +179,7 @@ type *iir::convert_type(std::shared_ptr<ast::type_node> n, iir::scope *sc) {
   for (auto &p : n->params) params.push_back(convert_type(p, sc));
 
   if (!n->parameter) {
-    return gc::make_collected<named_type>(name, params);
+    return intern_type(name, params);
   } else {
     if (params.size() > 0) {
       throw std::logic_error("cannot have parameters on parameter type");
@@ -108,21 +190,43 @@ type *iir::convert_type(std::shared_ptr<ast::type_node> n, iir::scope *sc) {
       die("scope cannot be null when converting a variable datatype");
     }
 
-    auto new_var = gc::make_collected<var_type>(name);
-
     // if the type is a variable, check first for a definition in the scope.
+    // Sharing it (rather than unifying with it) keeps conversion out of the
+    // unifier, which lowering threads can't touch
     auto found = sc->find_vtype(name);
-    if (found != nullptr) {
-      new_var->points_to = found;
-    } else {
-      sc->set_vtype(name, new_var);
-    }
+    if (found != nullptr) return found;
+
+    auto new_var = gc::make_collected<var_type>(name);
+    sc->set_vtype(name, new_var);
     return new_var;
   }
   throw std::logic_error("UNKNOWN TYPE IN `IIR::CONVERT_TYPE`");
 }
 
 
+type *iir::clone_type(type *t, std::unordered_map<type *, type *> &fresh) {
+  t = infer::find(t);
+  if (fresh.count(t) != 0) return fresh[t];
+
+  if (t->is_var()) {
+    auto *n = &new_variable_type();
+    fresh[t] = n;
+    return n;
+  }
+
+  auto *n = t->as_named();
+  bool same = true;
+  std::vector<type *> params;
+  for (auto *p : n->params) {
+    params.push_back(clone_type(p, fresh));
+    if (params.back() != p) same = false;
+  }
+  // ground types can be shared as-is
+  if (same) return t;
+  return intern_type(n->name, params);
+}
+
+
 type *iir::convert_type(std::string s, iir::scope *sc) {
   return convert_type(ast::parse_type(s), sc);
 }
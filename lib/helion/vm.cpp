@@ -0,0 +1,240 @@
+// [License]
+// MIT - See LICENSE.md file in the package.
+
+#include <helion/gc.h>
+#include <helion/iir.h>
+#include <helion/util.h>
+#include <helion/vm.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+
+using namespace helion;
+using namespace helion::vm;
+
+
+// how hot a function has to get before it is compiled, when nothing else
+// says. High enough that code which only runs a few times never pays for it
+static const uint32_t default_threshold = 1000;
+// baseline code is made in microseconds, so anything that runs more than a
+// couple of times is worth it
+static const uint32_t default_warm_threshold = 10;
+
+
+
+machine::machine(void)
+    : hot_threshold(default_threshold),
+      warm_threshold(default_warm_threshold),
+      baseline(compile_baseline) {
+  if (auto *env = getenv("HELION_JIT_THRESHOLD"); env != nullptr)
+    hot_threshold = strtoul(env, nullptr, 10);
+  if (auto *env = getenv("HELION_BASELINE_THRESHOLD"); env != nullptr)
+    warm_threshold = strtoul(env, nullptr, 10);
+
+  // the thread running the program keeps a core to itself
+  unsigned cores = std::thread::hardware_concurrency();
+  compile_threads = cores > 1 ? cores - 1 : 1;
+  if (auto *env = getenv("HELION_JIT_THREADS"); env != nullptr)
+    compile_threads = std::max(1ul, strtoul(env, nullptr, 10));
+}
+
+
+machine::~machine(void) {
+  {
+    std::lock_guard<std::mutex> guard(queue_lock);
+    stopping = true;
+    queue.clear();
+  }
+  queue_cv.notify_all();
+  for (auto &w : workers) w.join();
+
+  for (auto &[ir, fn] : fns) {
+    gc::free(fn->plain);
+    delete fn;
+  }
+  for (auto &[ir, cell] : globals) gc::free(cell);
+}
+
+
+
+static word no_intrinsic(closure *self, word *) {
+  auto msg = "no implementation of intrinsic @" + self->fn->ir->name;
+  fail(msg.c_str());
+}
+
+
+function *machine::get(iir::func *f) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (auto it = fns.find(f); it != fns.end()) return it->second;
+
+  auto *fn = new function();
+  fn->ir = f;
+  fn->owner = this;
+  // compiled code refers to these by address, so they are never collected
+  fn->plain = (closure *)gc::alloc_uncollectable(sizeof(closure));
+  fn->plain->fn = fn;
+  fn->plain->mask = 0;
+
+  if (f->intrinsic) {
+    // specializations of an intrinsic share its implementation, which looks
+    // at the type of the copy it was called through
+    auto &name = f->generic != nullptr ? f->generic->name : f->name;
+    auto e = intrinsic(name);
+    fn->entry = e != nullptr ? e : no_intrinsic;
+    // intrinsics are native already
+    fn->level = tier::failed;
+  } else {
+    fn->entry = interpret;
+  }
+  fns[f] = fn;
+  return fn;
+}
+
+
+word *machine::global(iir::value *v) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto &cell = globals[v];
+  if (cell == nullptr) {
+    // globals can hold pointers to collected objects, so they are scanned
+    cell = (word *)gc::alloc_uncollectable(sizeof(word));
+    *cell = 0;
+  }
+  return cell;
+}
+
+
+word machine::call(iir::func *f, std::vector<word> args) {
+  auto *fn = get(f);
+  // the callee may pop more arguments than it was given (init takes Void)
+  args.resize(std::max<size_t>(args.size(), 1), 0);
+  return fn->entry.load(std::memory_order_acquire)(fn->plain, args.data());
+}
+
+
+
+void machine::warm(function &fn) {
+  auto expected = tier::interp;
+  if (!fn.level.compare_exchange_strong(expected, tier::baseline)) return;
+  if (!baseline) return;
+  // if it fails, the function is left in the interpreter until it gets hot
+  if (auto code = baseline(fn); code != nullptr)
+    fn.entry.store(code, std::memory_order_release);
+}
+
+
+void machine::promote(function &fn) {
+  // from the interpreter or from baseline code, whichever it is in
+  auto expected = fn.level.load();
+  if (expected != tier::interp && expected != tier::baseline) return;
+  if (!fn.level.compare_exchange_strong(expected, tier::queued)) return;
+  if (!compiler) {
+    fn.level = tier::failed;
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(queue_lock);
+  queue.push_back(&fn);
+  // threads are only started when there is more queued than the idle ones
+  // can take, so short scripts never pay for them
+  if (idle < queue.size() && workers.size() < compile_threads)
+    workers.emplace_back([this](void) { compile_loop(); });
+  queue_cv.notify_one();
+}
+
+
+void machine::compile_loop(void) {
+  gc::register_thread();
+  std::unique_lock<std::mutex> l(queue_lock);
+  while (true) {
+    idle++;
+    queue_cv.wait(l, [&](void) { return stopping || !queue.empty(); });
+    idle--;
+    if (stopping) break;
+    auto *fn = queue.front();
+    queue.pop_front();
+    busy++;
+    l.unlock();
+
+    auto code = compiler(*fn);
+    if (code != nullptr) {
+      // calls already in the interpreter finish there. Every call after this
+      // goes straight to the compiled code
+      fn->entry.store(code, std::memory_order_release);
+      fn->level = tier::jit;
+    } else {
+      fn->level = tier::failed;
+    }
+
+    l.lock();
+    busy--;
+    idle_cv.notify_all();
+  }
+  l.unlock();
+  gc::unregister_thread();
+}
+
+
+void machine::drain(void) {
+  std::unique_lock<std::mutex> l(queue_lock);
+  idle_cv.wait(l, [&](void) { return queue.empty() && busy == 0; });
+}
+
+
+
+
+/*
+ * intrinsics. They are called with the values of their arguments, like any
+ * other function, and look at the type of the function they were called
+ * through to know what they are working on
+ */
+
+static word to_word(double d) {
+  word w;
+  memcpy(&w, &d, sizeof(w));
+  return w;
+}
+
+static double to_double(word w) {
+  double d;
+  memcpy(&d, &w, sizeof(d));
+  return d;
+}
+
+
+static iir::type *first_param(iir::func *f) {
+  auto *t = infer::find(&f->get_type())->as_named();
+  if (t == nullptr || t->params.size() == 0) return nullptr;
+  return infer::find(t->params[0]);
+}
+
+
+// an instance that monomorphization couldn't make ground takes and returns
+// values of its variable positions in heap cells, like any other function
+// (see place_boxes)
+static bool boxed(iir::type *p) { return p == nullptr || p->is_var(); }
+
+static word box(word v) {
+  auto *cell = (word *)gc::alloc(sizeof(word));
+  *cell = v;
+  return (word)cell;
+}
+
+
+static word add_sim(closure *self, word *args) {
+  auto *p = first_param(self->fn->ir);
+  // nothing says what is in the cells, so they are added as integers
+  if (boxed(p)) return box(*(word *)args[0] + *(word *)args[1]);
+  if (iir::numeric_kind(p) == iir::num_kind::floating)
+    return to_word(to_double(args[0]) + to_double(args[1]));
+  return args[0] + args[1];
+}
+
+
+entry_fn vm::intrinsic(const std::string &name) {
+  static const std::unordered_map<std::string, entry_fn> table = {
+      {"add_sim", add_sim},
+  };
+  auto it = table.find(name);
+  return it == table.end() ? nullptr : it->second;
+}
@@ -9,8 +9,10 @@
 #include <uv.h>
 #include <algorithm>
 #include <chrono>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <sstream>
 #include <memory>
 #include <type_traits>
 #include <unordered_map>
@@ -21,6 +23,7 @@
 
 #include <helion/core.h>
 #include <helion/iir.h>
+#include <helion/passes.h>
 
 #include <immer/set.hpp>
 
@@ -45,17 +48,88 @@ int main(int argc, char **argv) {
   app.add_option("-d,--driver_opts", driver_opts,
                  "options to pass into the driver");
 
+  // -1 leaves it to $HELION_JIT_THRESHOLD (or the vm's default)
+  int jit_threshold = -1;
+  app.add_option("--jit-threshold", jit_threshold,
+                 "calls plus loop iterations before a function is compiled "
+                 "(0 never compiles)");
+
+  int baseline_threshold = -1;
+  app.add_option("--baseline-threshold", baseline_threshold,
+                 "calls plus loop iterations before a function gets baseline "
+                 "code (0 never does)");
+
+  app.add_option("--inline-threshold", iir::inline_threshold,
+                 "the largest function (in iir instructions) inlined into "
+                 "more than one caller");
+
+  bool jit_all = false;
+  app.add_flag("--jit-all", jit_all,
+               "compile every function with llvm the first time it is "
+               "called, instead of interpreting it until it gets hot");
+
+  std::string cache_dir;
+  app.add_option("--cache-dir", cache_dir,
+                 "where compiled code is kept between runs");
+  int cache_size = -1;
+  app.add_option("--cache-size", cache_size,
+                 "how big the code cache can get, in megabytes (0 is "
+                 "unlimited)");
+  bool no_cache = false;
+  app.add_flag("--no-cache", no_cache, "don't read or write the code cache");
+  bool cache_stats = false;
+  app.add_flag("--cache-stats", cache_stats,
+               "print how often the code cache was hit at exit");
+
+  // canned iir skips the front end, so passes, inference and lowering can be
+  // timed and tested on their own. The module is printed as it goes, for
+  // tests to compare
+  bool from_iir = false;
+  app.add_flag("--iir", from_iir,
+               "the entry file is iir as printed before type inference, "
+               "not source. Prints the module before and after inference");
+  // for the pass tests in tests/iir. `binary` writes the module out in the
+  // binary format and reads it back, and `none` does nothing
+  std::string passes;
+  app.add_option("--passes", passes,
+                 "with --iir, run just these passes (separated by commas), "
+                 "print the module and exit");
+
+  // -1 leaves it to $HELION_OPT_LEVEL (or the engine's default)
+  int opt_level = -1;
+  app.add_option("-O,--opt-level", opt_level,
+                 "how hard compiled code is optimized, from 0 to 3");
+
   std::string entry_point;
-  auto file_opt = app.add_option("entry point", entry_point, "the entry file");
-  file_opt->required(true);
+  app.add_option("entry point", entry_point, "the entry file");
+
+  // `helion build -o out file.he` compiles ahead of time instead of running
+  std::string output = "a.out";
+  auto *build = app.add_subcommand(
+      "build", "compile a program to an executable (or a .o) to run later");
+  build->add_option("-o,--output", output, "where to write it");
+  // so -O and the other options can come after `build`
+  build->fallthrough();
+  build->add_option("file", entry_point, "the entry file")->required(true);
 
   app.allow_extras(true);
 
   CLI11_PARSE(app, argc, argv);
 
+  if (entry_point == "") {
+    std::cerr << app.help();
+    return 1;
+  }
 
   helion::init();
 
+  auto cache_opts = execution_engine->cache.options();
+  if (no_cache) cache_opts.enabled = false;
+  if (cache_dir != "") cache_opts.dir = cache_dir;
+  if (cache_size >= 0) cache_opts.max_bytes = (uint64_t)cache_size << 20;
+  execution_engine->cache.configure(cache_opts);
+  if (opt_level >= 0) execution_engine->opt_level = std::min(opt_level, 3);
+
   const char *ep_ptr = entry_point.c_str();
   // check that the file exists before trying to read it
   struct stat sinfo;
@@ -67,15 +141,67 @@ int main(int argc, char **argv) {
 
 
 
-  // print every token from the file
-  text src = read_file(ep_ptr);
-
   try {
-    auto res = parse_module(src, entry_point);
-    compile_module(std::move(res));
+    iir::module *mod;
+    if (from_iir && passes != "") {
+      std::ifstream in(entry_point);
+      std::stringstream buf;
+      buf << in.rdbuf();
+      auto m = iir::read_module(buf.str(), entry_point);
+
+      std::stringstream names(passes);
+      std::string name;
+      while (std::getline(names, name, ',')) {
+        if (name == "none") continue;
+        if (name == "binary") {
+          std::stringstream out;
+          iir::write_binary(*m, out);
+          auto data = out.str();
+          m = iir::read_binary(data.data(), data.size(), entry_point);
+        } else if (!iir::run_pass(*m, name)) {
+          puts("unknown pass", name);
+          return 1;
+        }
+      }
+      m->print(std::cout);
+      return 0;
+    } else if (from_iir) {
+      std::ifstream in(entry_point);
+      std::stringstream buf;
+      buf << in.rdbuf();
+      mod = compile_iir(iir::read_module(buf.str(), entry_point), true);
+    } else {
+      text src = read_file(ep_ptr);
+      auto res = parse_module(src, entry_point);
+      mod = compile_module(std::move(res));
+    }
+    // nothing is waiting on a program compiled ahead of time, so it gets
+    // everything unless it asks otherwise
+    if (*build)
+      return build_module(*mod, output, opt_level >= 0 ? opt_level : 3);
+
+    if (jit_all) {
+      run_module_lazy(*mod);
+    } else {
+      vm::machine vm;
+      if (jit_threshold >= 0) vm.hot_threshold = jit_threshold;
+      if (baseline_threshold >= 0) vm.warm_threshold = baseline_threshold;
+      run_module(*mod, vm);
+      // so the stats cover everything that got hot, not just what the
+      // compile threads got to before the program ended
+      if (cache_stats) vm.drain();
+    }
   } catch (syntax_error &e) {
     puts(e.what());
+  } catch (iir::read_error &e) {
+    puts(entry_point + ":", e.what());
+    return 1;
+  } catch (iir::binary_error &e) {
+    puts(entry_point + ":", e.what());
+    return 1;
   }
+
+  if (cache_stats) execution_engine->cache.print_stats(std::cerr);
   return 0;
 }
 
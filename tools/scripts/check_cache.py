@@ -0,0 +1,74 @@
+# [License]
+# MIT - See LICENSE.md file in the package.
+#
+# checks that code compiled on one run is found in the object cache on the
+# next. The cache is keyed on the optimized ir, so this fails as soon as
+# anything that changes between runs (an address, a counter) ends up in it.
+#
+#   python3 tools/scripts/check_cache.py [path to helion]
+
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+program = """
+let add = (a: Int, b: Int): Int => {
+	return a + b
+}
+
+let inc = (x: Int): Int => {
+	return add(x, 1)
+}
+
+let x = inc(add(40, 1))
+"""
+
+# --jit-all compiles every function the first time it is called. The vm only
+# compiles what gets hot, which with a threshold of 1 is everything called
+modes = {
+    "jit-all": ["--jit-all"],
+    "vm": ["--jit-threshold", "1", "--baseline-threshold", "0"],
+}
+
+
+def stats(helion, args, cache, src):
+    out = subprocess.run([helion, "--cache-dir", cache, "--cache-stats"] +
+                         args + [src],
+                         stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                         universal_newlines=True)
+    if out.returncode != 0:
+        sys.exit("helion failed:\n" + out.stdout + out.stderr)
+    found = {}
+    for name in ("hits", "misses", "stores"):
+        m = re.search(r"^\s*" + name + r":\s*(\d+)", out.stderr, re.M)
+        if m is None:
+            sys.exit("no cache stats in the output:\n" + out.stderr)
+        found[name] = int(m.group(1))
+    return found
+
+
+def main():
+    helion = sys.argv[1] if len(sys.argv) > 1 else "build/helion"
+    failed = False
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "check.he")
+        with open(src, "w") as f:
+            f.write(program)
+
+        for mode, args in modes.items():
+            cache = os.path.join(tmp, "cache-" + mode)
+            first = stats(helion, args, cache, src)
+            second = stats(helion, args, cache, src)
+            ok = first["stores"] > 0 and second["hits"] > 0 and \
+                second["misses"] == 0
+            print("%-8s first: %s  second: %s  %s" %
+                  (mode, first, second, "ok" if ok else "FAILED"))
+            failed = failed or not ok
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
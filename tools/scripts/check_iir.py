@@ -0,0 +1,107 @@
+# [License]
+# MIT - See LICENSE.md file in the package.
+#
+# runs the canned iir in tests/iir through single passes and checks what
+# comes out. Each file says what to run and what to look for in comments:
+#
+#   # passes: gvn,simplify      passed to --passes
+#   # check: %p: Int = mul      has to be in the output, after the last check
+#   # check-not: %a2            can't be anywhere in the output
+#
+# whitespace is collapsed before comparing. Every file also has to read back
+# in as the same text it prints as, and come out of the binary format the
+# same as it went in.
+#
+#   python3 tools/scripts/check_iir.py [path to helion] [tests/iir]
+
+import glob
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+
+def squash(s):
+    return re.sub(r"\s+", " ", s).strip()
+
+
+def run(helion, passes, path):
+    out = subprocess.run([helion, "--iir", "--passes", passes, path],
+                         stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                         universal_newlines=True)
+    if out.returncode != 0:
+        raise RuntimeError("helion failed:\n" + out.stdout + out.stderr)
+    return out.stdout
+
+
+def directives(path):
+    passes = None
+    checks = []
+    nots = []
+    with open(path) as f:
+        for line in f:
+            m = re.match(r"^\s*#\s*(passes|check|check-not):(.*)$", line)
+            if m is None:
+                continue
+            kind, arg = m.group(1), squash(m.group(2))
+            if kind == "passes":
+                passes = arg.replace(" ", "")
+            elif kind == "check":
+                checks.append(arg)
+            else:
+                nots.append(arg)
+    return passes, checks, nots
+
+
+# returns what went wrong, or None
+def check(helion, path):
+    passes, checks, nots = directives(path)
+    if passes is None:
+        return "no '# passes:' line"
+
+    out = run(helion, passes, path)
+    flat = squash(out)
+    at = 0
+    for c in checks:
+        found = flat.find(c, at)
+        if found == -1:
+            return "expected '%s' in:\n%s" % (c, out)
+        at = found + len(c)
+    for c in nots:
+        if c in flat:
+            return "didn't expect '%s' in:\n%s" % (c, out)
+
+    # printing and reading back in shouldn't change anything
+    printed = run(helion, "none", path)
+    with tempfile.NamedTemporaryFile("w", suffix=".iir") as f:
+        f.write(printed)
+        f.flush()
+        again = run(helion, "none", f.name)
+    if again != printed:
+        return "reading the printed module back changes it:\n%s\n%s" % \
+            (printed, again)
+    if run(helion, "binary", path) != printed:
+        return "the binary format changes the module"
+    return None
+
+
+def main():
+    helion = sys.argv[1] if len(sys.argv) > 1 else "build/helion"
+    tests = sys.argv[2] if len(sys.argv) > 2 else "tests/iir"
+    failed = False
+    for path in sorted(glob.glob(os.path.join(tests, "*.iir"))):
+        try:
+            err = check(helion, path)
+        except RuntimeError as e:
+            err = str(e)
+        print("%-24s %s" % (os.path.basename(path), "ok" if err is None
+                                                    else "FAILED"))
+        if err is not None:
+            print(err)
+            failed = True
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
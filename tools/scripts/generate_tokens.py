@@ -62,6 +62,10 @@ tokens = [
     "comment",
     "end",
     "question",
+    "add_assign",
+    "sub_assign",
+    "mul_assign",
+    "div_assign",
 ]
 
 